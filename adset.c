@@ -0,0 +1,470 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "adset.h"
+#include "stats.h"
+
+// function prototypes
+size_t adset_size( uint32_t table_log2 );
+uint64_t adset_key( const char *trackid );
+uint64_t adset_bloom_bit( uint64_t key, int i, uint32_t table_log2 );
+int adset_map( adset_t *set, int fd, uint32_t table_log2, bool fresh );
+int adset_load( adset_t *set, const char *path );
+int adset_lock( adset_t *set );
+bool adset_insert( adset_t *set, uint64_t key );
+int adset_grow( adset_t *set );
+
+size_t adset_size( uint32_t table_log2 )
+{
+    return ADSET_HEADER_SIZE +
+           ( (size_t)1 << ( table_log2 + ADSET_BLOOM_SHIFT ) ) / 8 +
+           ( (size_t)1 << table_log2 ) * sizeof( uint64_t );
+}
+
+uint64_t adset_key( const char *trackid )
+{
+    // 0 marks an empty slot
+    uint64_t key = stats_hash( trackid );
+    return key ? key : 1;
+}
+
+/*
+ * The `i`th filter bit of `key`, by double hashing the two halves.
+ */
+uint64_t adset_bloom_bit( uint64_t key, int i, uint32_t table_log2 )
+{
+    uint64_t step = ( key >> 32 | key << 32 ) | 1;
+    uint64_t mask = ( (uint64_t)1 << ( table_log2 + ADSET_BLOOM_SHIFT ) ) - 1;
+    return ( key + (uint64_t)i * step ) & mask;
+}
+
+/*
+ * Map `fd` as a set with 2^`table_log2` slots. A fresh file is sized and
+ * given a header, an existing one is validated.
+ *
+ * Returns: 0 (`EXIT_SUCCESS`) on success, a negative errno on failure.
+ */
+int adset_map( adset_t *set, int fd, uint32_t table_log2, bool fresh )
+{
+    size_t size = adset_size( table_log2 );
+    struct stat st;
+
+    if ( fresh && ftruncate( fd, (off_t)size ) < 0 )
+    {
+        return -errno;
+    }
+    if ( fstat( fd, &st ) < 0 )
+    {
+        return -errno;
+    }
+    if ( (size_t)st.st_size != size )
+    {
+        return -EINVAL;
+    }
+
+    void *map = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    if ( map == MAP_FAILED )
+    {
+        return -errno;
+    }
+
+    set->fd = fd;
+    set->map = map;
+    set->map_size = size;
+    set->header = map;
+    set->bloom = (uint64_t *)(void *)( (char *)map + ADSET_HEADER_SIZE );
+    set->table =
+        set->bloom + ( (size_t)1 << ( table_log2 + ADSET_BLOOM_SHIFT ) ) / 64;
+
+    if ( fresh )
+    {
+        memcpy( set->header->magic,
+                ADSET_MAGIC,
+                sizeof( set->header->magic ) );
+        set->header->version = ADSET_VERSION;
+        set->header->table_log2 = table_log2;
+        set->header->count = 0;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Open and map the file at `path` into `set`, giving an empty file a fresh
+ * table. The file lock keeps two processes from both initialising it.
+ *
+ * Returns: 0 (`EXIT_SUCCESS`) on success, a negative errno on failure.
+ */
+int adset_load( adset_t *set, const char *path )
+{
+    int ret = 0;
+    adset_header_t header;
+    struct stat st;
+
+    int fd = open( path, O_RDWR | O_CREAT | O_CLOEXEC, 0644 );
+    if ( fd < 0 || flock( fd, LOCK_EX ) < 0 || fstat( fd, &st ) < 0 )
+    {
+        ret = -errno;
+        fprintf( stderr, "Could not open %s: %s\n", path, strerror( -ret ) );
+        if ( fd >= 0 )
+        {
+            close( fd );
+        }
+        return ret;
+    }
+
+    if ( st.st_size == 0 )
+    {
+        ret = adset_map( set, fd, ADSET_MIN_LOG2, true );
+    }
+    else if ( pread( fd, &header, sizeof( header ), 0 ) !=
+                  (ssize_t)sizeof( header ) ||
+              memcmp( header.magic, ADSET_MAGIC, sizeof( header.magic ) ) !=
+                  0 ||
+              header.version != ADSET_VERSION ||
+              header.table_log2 < ADSET_MIN_LOG2 || header.table_log2 > 40 )
+    {
+        ret = -EINVAL;
+    }
+    else
+    {
+        ret = adset_map( set, fd, header.table_log2, false );
+    }
+
+    if ( ret < 0 )
+    {
+        if ( ret == -EINVAL )
+        {
+            fprintf( stderr, "Error: %s is not an ad set\n", path );
+        }
+        else
+        {
+            fprintf( stderr, "Could not map %s: %s\n", path, strerror( -ret ) );
+        }
+        close( fd );
+        return ret;
+    }
+
+    flock( fd, LOCK_UN );
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Open (or create) the set at `path`.
+ *
+ * Returns: 0 (`EXIT_SUCCESS`) on success, a negative errno on failure.
+ */
+int adset_open( adset_t *set, const char *path )
+{
+    int ret = 0;
+
+    memset( set, 0, sizeof( *set ) );
+    set->fd = -1;
+
+    set->path = malloc( strlen( path ) + 1 );
+    if ( !set->path )
+    {
+        ret = -ENOMEM;
+        goto cleanup;
+    }
+    strcpy( set->path, path );
+
+    ret = adset_load( set, path );
+
+cleanup:
+    if ( ret < 0 )
+    {
+        adset_close( set );
+    }
+
+    return ret;
+}
+
+/*
+ * Follow the file at the set's path if another process replaced it while
+ * growing the set. Until then this process would look up (and add to) the
+ * old table that nobody else sees any more.
+ *
+ * Returns: 1 if the new file was mapped, 0 if the mapping is current and a
+ * negative errno on failure, the old mapping stays in use then.
+ */
+int adset_refresh( adset_t *set )
+{
+    struct stat path_st;
+    struct stat fd_st;
+
+    if ( !set->map )
+    {
+        return -EBADF;
+    }
+
+    // a removed file keeps serving from the old mapping
+    if ( stat( set->path, &path_st ) < 0 )
+    {
+        return errno == ENOENT ? 0 : -errno;
+    }
+    if ( fstat( set->fd, &fd_st ) < 0 )
+    {
+        return -errno;
+    }
+    if ( path_st.st_dev == fd_st.st_dev && path_st.st_ino == fd_st.st_ino )
+    {
+        return 0;
+    }
+
+    adset_t fresh = { .fd = -1 };
+    int ret = adset_load( &fresh, set->path );
+    if ( ret < 0 )
+    {
+        return ret;
+    }
+
+    // swap the mappings, the path stays with the set
+    fresh.path = set->path;
+    set->path = NULL;
+    adset_close( set );
+    *set = fresh;
+
+    return 1;
+}
+
+/*
+ * Take the file lock that serialises adding between processes, on the file
+ * currently at the set's path.
+ *
+ * Returns: 0 (`EXIT_SUCCESS`) with the lock held, a negative errno on
+ * failure.
+ */
+int adset_lock( adset_t *set )
+{
+    for ( ;; )
+    {
+        if ( flock( set->fd, LOCK_EX ) < 0 )
+        {
+            return -errno;
+        }
+
+        // closing the replaced file in adset_refresh() drops its lock
+        int ret = adset_refresh( set );
+        if ( ret == 0 )
+        {
+            return EXIT_SUCCESS;
+        }
+        if ( ret < 0 )
+        {
+            flock( set->fd, LOCK_UN );
+            return ret;
+        }
+    }
+}
+
+void adset_close( adset_t *set )
+{
+    if ( set->map )
+    {
+        munmap( set->map, set->map_size );
+    }
+    if ( set->fd >= 0 )
+    {
+        close( set->fd );
+    }
+    free( set->path );
+    memset( set, 0, sizeof( *set ) );
+    set->fd = -1;
+}
+
+bool adset_contains( const adset_t *set, const char *trackid )
+{
+    if ( !set->map )
+    {
+        return false;
+    }
+
+    uint32_t table_log2 = set->header->table_log2;
+    uint64_t key = adset_key( trackid );
+
+    for ( int i = 0; i < ADSET_BLOOM_K; ++i )
+    {
+        uint64_t bit = adset_bloom_bit( key, i, table_log2 );
+        if ( !( set->bloom[bit / 64] & (uint64_t)1 << ( bit % 64 ) ) )
+        {
+            return false;
+        }
+    }
+
+    uint64_t mask = ( (uint64_t)1 << table_log2 ) - 1;
+    uint64_t slot = ( key * 0x9e3779b97f4a7c15ULL ) >> ( 64 - table_log2 );
+    for ( ; set->table[slot]; slot = ( slot + 1 ) & mask )
+    {
+        if ( set->table[slot] == key )
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Insert `key` without growing the table.
+ *
+ * Returns: true if the key was new.
+ */
+bool adset_insert( adset_t *set, uint64_t key )
+{
+    uint32_t table_log2 = set->header->table_log2;
+    uint64_t mask = ( (uint64_t)1 << table_log2 ) - 1;
+    uint64_t slot = ( key * 0x9e3779b97f4a7c15ULL ) >> ( 64 - table_log2 );
+
+    for ( ; set->table[slot]; slot = ( slot + 1 ) & mask )
+    {
+        if ( set->table[slot] == key )
+        {
+            return false;
+        }
+    }
+
+    // the slot first, so whoever sees the filter bits also finds the slot
+    set->table[slot] = key;
+    for ( int i = 0; i < ADSET_BLOOM_K; ++i )
+    {
+        uint64_t bit = adset_bloom_bit( key, i, table_log2 );
+        set->bloom[bit / 64] |= (uint64_t)1 << ( bit % 64 );
+    }
+    set->header->count++;
+
+    return true;
+}
+
+/*
+ * Rebuild the set at twice the size next to the old file and replace it. Call
+ * with the file lock held, it moves to the new file.
+ *
+ * Returns: 0 (`EXIT_SUCCESS`) on success, a negative errno on failure.
+ */
+int adset_grow( adset_t *set )
+{
+    int ret = 0;
+    adset_t grown = { .fd = -1 };
+    uint32_t table_log2 = set->header->table_log2 + 1;
+
+    char *tmp = malloc( strlen( set->path ) + sizeof( ".tmp" ) );
+    if ( !tmp )
+    {
+        return -ENOMEM;
+    }
+    strcpy( tmp, set->path );
+    strcat( tmp, ".tmp" );
+
+    int fd = open( tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+    if ( fd < 0 )
+    {
+        ret = -errno;
+        goto cleanup;
+    }
+
+    ret = adset_map( &grown, fd, table_log2, true );
+    if ( ret < 0 )
+    {
+        close( fd );
+        goto cleanup;
+    }
+
+    uint64_t slots = (uint64_t)1 << set->header->table_log2;
+    for ( uint64_t i = 0; i < slots; ++i )
+    {
+        if ( set->table[i] )
+        {
+            adset_insert( &grown, set->table[i] );
+        }
+    }
+
+    // the new file is locked before anyone can find it at the path, the old
+    // lock goes away when the old file is closed below
+    if ( flock( grown.fd, LOCK_EX ) < 0 ||
+         msync( grown.map, grown.map_size, MS_SYNC ) < 0 ||
+         rename( tmp, set->path ) < 0 )
+    {
+        ret = -errno;
+        goto cleanup;
+    }
+
+    // swap the mappings, the path stays with the set
+    grown.path = set->path;
+    set->path = NULL;
+    adset_close( set );
+    *set = grown;
+    grown.map = NULL;
+    grown.fd = -1;
+    grown.path = NULL;
+
+cleanup:
+    if ( ret < 0 )
+    {
+        unlink( tmp );
+        adset_close( &grown );
+    }
+    free( tmp );
+
+    return ret;
+}
+
+/*
+ * Remember `trackid` as an ad. This takes the file lock and may rebuild the
+ * whole table, keep it off latency sensitive paths.
+ *
+ * Returns: 1 if it was added, 0 if it was already known, a negative errno on
+ * failure.
+ */
+int adset_add( adset_t *set, const char *trackid )
+{
+    int ret = 0;
+
+    if ( !set->map )
+    {
+        return -EBADF;
+    }
+
+    ret = adset_lock( set );
+    if ( ret < 0 )
+    {
+        fprintf( stderr, "Could not lock ad set: %s\n", strerror( -ret ) );
+        return ret;
+    }
+
+    if ( adset_contains( set, trackid ) )
+    {
+        goto unlock;
+    }
+
+    // keep the table at most half full
+    uint64_t slots = (uint64_t)1 << set->header->table_log2;
+    if ( ( set->header->count + 1 ) * 2 > slots )
+    {
+        ret = adset_grow( set );
+        if ( ret < 0 )
+        {
+            fprintf( stderr, "Could not grow ad set: %s\n", strerror( -ret ) );
+            goto unlock;
+        }
+    }
+
+    adset_insert( set, adset_key( trackid ) );
+    msync( set->map, set->map_size, MS_ASYNC );
+    ret = 1;
+
+unlock:
+    flock( set->fd, LOCK_UN );
+
+    return ret;
+}
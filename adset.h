@@ -0,0 +1,58 @@
+#ifndef SDE_ADSET_H
+#define SDE_ADSET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Persistent set of known ad trackids.
+ *
+ * The file is a header, a Bloom filter and an open addressing hash table of
+ * 64 bit trackid hashes (linear probing, 0 marks an empty slot), and is used
+ * in place through a shared mapping. Pages are only read when a lookup
+ * touches them, so opening costs nothing however large the set is.
+ *
+ * A lookup hashes the trackid once and tests `ADSET_BLOOM_K` filter bits;
+ * most trackids are not ads and stop there. The others probe a table that is
+ * never more than half full. Nothing is allocated.
+ *
+ * Adding writes the slot and filter bits straight into the mapping under an
+ * flock() on the file, so several processes can add to the same set. When the
+ * table reaches half full it is rebuilt at twice the size into a new file
+ * which replaces the old one; the other processes notice the new inode at the
+ * path on their next add or `adset_refresh()` and map it.
+ */
+
+#define ADSET_MAGIC "SMADSET1"
+#define ADSET_VERSION 1
+#define ADSET_HEADER_SIZE 64
+#define ADSET_MIN_LOG2 16  // 64k slots
+#define ADSET_BLOOM_SHIFT 3 // 8 filter bits per slot, 16 per entry
+#define ADSET_BLOOM_K 4
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t table_log2;
+    uint64_t count;
+} adset_header_t;
+
+typedef struct
+{
+    char *path;
+    int fd;
+    void *map;
+    size_t map_size;
+    adset_header_t *header;
+    uint64_t *bloom;
+    uint64_t *table;
+} adset_t;
+
+int adset_open( adset_t *set, const char *path );
+void adset_close( adset_t *set );
+int adset_refresh( adset_t *set );
+bool adset_contains( const adset_t *set, const char *trackid );
+int adset_add( adset_t *set, const char *trackid );
+
+#endif // SDE_ADSET_H
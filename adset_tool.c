@@ -0,0 +1,81 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "adset.h"
+
+/* Maintenance tool for the known ad set used by spotify_mute -A.
+ *
+ * Adds the trackids given on the command line (or one per line on stdin for
+ * "-") and prints how full the set is. Run it while the daemon is stopped:
+ * a set that grows is replaced by a new file the daemon would not see.
+ */
+
+// function prototypes
+int add_trackid( adset_t *set, const char *trackid, unsigned long *added );
+
+int add_trackid( adset_t *set, const char *trackid, unsigned long *added )
+{
+    int ret = adset_add( set, trackid );
+    if ( ret > 0 )
+    {
+        ( *added )++;
+    }
+    return ret;
+}
+
+int main( int argc, char **argv )
+{
+    int ret = EXIT_FAILURE;
+    adset_t set = { .fd = -1 };
+    unsigned long added = 0;
+    char line[512];
+
+    if ( argc < 2 )
+    {
+        fprintf( stderr, "Usage: %s AD_SET [TRACKID... | -]\n", argv[0] );
+        goto cleanup;
+    }
+
+    if ( adset_open( &set, argv[1] ) < 0 )
+    {
+        goto cleanup;
+    }
+
+    for ( int i = 2; i < argc; ++i )
+    {
+        if ( strcmp( argv[i], "-" ) != 0 )
+        {
+            if ( add_trackid( &set, argv[i], &added ) < 0 )
+            {
+                goto cleanup;
+            }
+            continue;
+        }
+
+        while ( fgets( line, sizeof( line ), stdin ) )
+        {
+            line[strcspn( line, "\r\n" )] = '\0';
+            if ( *line && add_trackid( &set, line, &added ) < 0 )
+            {
+                goto cleanup;
+            }
+        }
+    }
+
+    printf( "%20s: %lu\n", "added", added );
+    printf( "%20s: %llu\n",
+            "trackids",
+            (unsigned long long)set.header->count );
+    printf( "%20s: %llu\n",
+            "slots",
+            1ULL << set.header->table_log2 );
+    ret = EXIT_SUCCESS;
+
+cleanup:
+    adset_close( &set );
+
+    return ret;
+}
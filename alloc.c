@@ -0,0 +1,147 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "alloc.h"
+
+#ifdef SPOTIFY_MUTE_ALLOC_STATS
+
+typedef struct
+{
+    uint64_t live; // bytes
+    uint64_t peak; // bytes
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t events;
+} alloc_stats_t;
+
+// the daemon is single threaded, plain counters are enough
+alloc_stats_t alloc_stats[ALLOC_SUBSYSTEMS];
+
+// function prototypes
+void alloc_count( alloc_subsystem_t sub, void *ptr );
+
+void alloc_count( alloc_subsystem_t sub, void *ptr )
+{
+    alloc_stats_t *stats = &alloc_stats[sub];
+
+    stats->allocs++;
+    stats->live += malloc_usable_size( ptr );
+    if ( stats->live > stats->peak )
+    {
+        stats->peak = stats->live;
+    }
+}
+
+void *alloc_malloc( alloc_subsystem_t sub, size_t size )
+{
+    void *ptr = malloc( size );
+    if ( ptr )
+    {
+        alloc_count( sub, ptr );
+    }
+    return ptr;
+}
+
+void *alloc_calloc( alloc_subsystem_t sub, size_t n, size_t size )
+{
+    void *ptr = calloc( n, size );
+    if ( ptr )
+    {
+        alloc_count( sub, ptr );
+    }
+    return ptr;
+}
+
+void *alloc_realloc( alloc_subsystem_t sub, void *ptr, size_t size )
+{
+    // on failure the old block stays valid and counted
+    size_t old = ptr ? malloc_usable_size( ptr ) : 0;
+    void *ret = realloc( ptr, size );
+    if ( !ret )
+    {
+        return NULL;
+    }
+
+    alloc_stats[sub].live -= old;
+    if ( ptr )
+    {
+        alloc_stats[sub].frees++;
+    }
+    alloc_count( sub, ret );
+
+    return ret;
+}
+
+void alloc_free( alloc_subsystem_t sub, void *ptr )
+{
+    if ( !ptr )
+    {
+        return;
+    }
+    alloc_stats[sub].live -= malloc_usable_size( ptr );
+    alloc_stats[sub].frees++;
+    free( ptr );
+}
+
+void alloc_event( alloc_subsystem_t sub )
+{
+    alloc_stats[sub].events++;
+}
+
+#endif // SPOTIFY_MUTE_ALLOC_STATS
+
+/*
+ * Format the counters of `sub` as a single line.
+ *
+ * Returns: 0 (`EXIT_SUCCESS`) on success, -ENOTSUP if the accounting is not
+ * built in.
+ */
+int alloc_format( alloc_subsystem_t sub, char *buf, size_t size )
+{
+#ifdef SPOTIFY_MUTE_ALLOC_STATS
+    static const char *names[ALLOC_SUBSYSTEMS] = { "main",
+                                                   "dbus",
+                                                   "pactl",
+                                                   "cache" };
+    const alloc_stats_t *stats = &alloc_stats[sub];
+
+    snprintf( buf,
+              size,
+              "%s live=%llu peak=%llu allocs=%llu frees=%llu events=%llu "
+              "per_event=%.2f",
+              names[sub],
+              (unsigned long long)stats->live,
+              (unsigned long long)stats->peak,
+              (unsigned long long)stats->allocs,
+              (unsigned long long)stats->frees,
+              (unsigned long long)stats->events,
+              stats->events ? (double)stats->allocs / (double)stats->events
+                            : 0.0 );
+    return EXIT_SUCCESS;
+#else
+    (void)( sub );
+    (void)( buf );
+    (void)( size );
+    return -ENOTSUP;
+#endif
+}
+
+void alloc_dump( FILE *out )
+{
+    char line[256];
+
+    for ( int sub = 0; sub < ALLOC_SUBSYSTEMS; ++sub )
+    {
+        if ( alloc_format( (alloc_subsystem_t)sub, line, sizeof( line ) ) < 0 )
+        {
+            fprintf( out, "allocation accounting is not built in\n" );
+            return;
+        }
+        fprintf( out, "memory %s\n", line );
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef SDE_ALLOC_H
+#define SDE_ALLOC_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Allocation accounting for the long running daemon.
+ *
+ * main.c, dbus_utils.c, the metadata cache and the audio backends allocate
+ * through these wrappers, the "pactl" counts cover every sound server
+ * backend. Built
+ * with `make alloc-stats` every call is counted per subsystem: live bytes,
+ * their high-water mark, allocations, frees and allocations per event. The
+ * counts are dumped to stderr on SIGUSR1 and at exit, and answered by the
+ * control socket's "memory" request, so a long run can show its memory is
+ * flat. Block sizes come from malloc_usable_size(), so nothing is added to
+ * the blocks themselves.
+ *
+ * Memory handed out by other libraries is released the way they ask for,
+ * plain free() where that is what they document, never alloc_free().
+ *
+ * In normal builds the wrappers are the plain libc calls.
+ */
+
+typedef enum
+{
+    ALLOC_MAIN,
+    ALLOC_DBUS,
+    ALLOC_PACTL,
+    ALLOC_CACHE,
+    ALLOC_SUBSYSTEMS
+} alloc_subsystem_t;
+
+#ifdef SPOTIFY_MUTE_ALLOC_STATS
+
+#define ALLOC_STATS_ENABLED 1
+
+void *alloc_malloc( alloc_subsystem_t sub, size_t size );
+void *alloc_calloc( alloc_subsystem_t sub, size_t n, size_t size );
+void *alloc_realloc( alloc_subsystem_t sub, void *ptr, size_t size );
+void alloc_free( alloc_subsystem_t sub, void *ptr );
+void alloc_event( alloc_subsystem_t sub );
+
+#else
+
+#define ALLOC_STATS_ENABLED 0
+
+#define alloc_malloc( sub, size ) malloc( size )
+#define alloc_calloc( sub, n, size ) calloc( n, size )
+#define alloc_realloc( sub, ptr, size ) realloc( ptr, size )
+#define alloc_free( sub, ptr ) free( ptr )
+#define alloc_event( sub )
+
+#endif // SPOTIFY_MUTE_ALLOC_STATS
+
+int alloc_format( alloc_subsystem_t sub, char *buf, size_t size );
+void alloc_dump( FILE *out );
+
+#endif // SDE_ALLOC_H
@@ -0,0 +1,114 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "audio_backend.h"
+#include "pactl.h"
+
+// the first one is the default
+const audio_backend_t *audio_backends[] = {
+    &pulse_backend,
+    NULL,
+};
+
+/*
+ * Look up a backend by name, NULL picks the default one.
+ */
+const audio_backend_t *audio_backend_find( const char *name )
+{
+    if ( !name )
+    {
+        return audio_backends[0];
+    }
+
+    for ( int i = 0; audio_backends[i]; ++i )
+    {
+        if ( strcmp( audio_backends[i]->name, name ) == 0 )
+        {
+            return audio_backends[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Name of the `i`th backend built in, NULL past the last one.
+ */
+const char *audio_backend_name( int i )
+{
+    for ( int n = 0; audio_backends[n]; ++n )
+    {
+        if ( n == i )
+        {
+            return audio_backends[n]->name;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Open a connection to `server` through `backend`. Only allocation failures
+ * make this fail, an unreachable server is retried in the background.
+ *
+ * Returns: 0 (`EXIT_SUCCESS`) on success, a negative errno on failure.
+ */
+int audio_ctl_open( audio_ctl_t **ret,
+                    const audio_backend_t *backend,
+                    ev_loop_t *loop,
+                    const char *server )
+{
+    audio_ctl_t *ctl = alloc_malloc( ALLOC_PACTL, sizeof( *ctl ) );
+    if ( !ctl )
+    {
+        return -ENOMEM;
+    }
+
+    ctl->backend = backend;
+    ctl->impl = backend->open( loop, server );
+    if ( !ctl->impl )
+    {
+        alloc_free( ALLOC_PACTL, ctl );
+        return -ENOMEM;
+    }
+
+    *ret = ctl;
+    return EXIT_SUCCESS;
+}
+
+void audio_ctl_close( audio_ctl_t *ctl )
+{
+    if ( !ctl )
+    {
+        return;
+    }
+    ctl->backend->close( ctl->impl );
+    alloc_free( ALLOC_PACTL, ctl );
+}
+
+void audio_ctl_park( audio_ctl_t *ctl, int parked )
+{
+    ctl->backend->park( ctl->impl, parked );
+}
+
+void audio_ctl_set_mute( audio_ctl_t *ctl, int mute )
+{
+    ctl->backend->set_mute( ctl->impl, mute );
+}
+
+void audio_ctl_set_monitor( audio_ctl_t *ctl,
+                            unsigned rate,
+                            audio_monitor_cb cb,
+                            void *userdata )
+{
+    ctl->backend->set_monitor( ctl->impl, rate, cb, userdata );
+}
+
+void audio_ctl_set_mute_callback( audio_ctl_t *ctl,
+                                  audio_mute_cb cb,
+                                  void *userdata )
+{
+    ctl->backend->set_mute_callback( ctl->impl, cb, userdata );
+}
@@ -0,0 +1,78 @@
+#ifndef SDE_AUDIO_BACKEND_H
+#define SDE_AUDIO_BACKEND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "event_loop.h"
+
+/* Audio control backends.
+ *
+ * A backend finds the Spotify stream on one sound server, mutes it and
+ * optionally records it for the audio detectors. The daemon only talks to
+ * the `audio_ctl_*()` functions, the backend is picked by name at runtime:
+ *
+ *   pulse     libpulse, also works on PipeWire through pipewire-pulse
+ *
+ * Every backend reports the result of a mute request together with the time
+ * it took the server to apply it, so backends can be compared directly.
+ */
+
+/* Receives the Spotify stream as interleaved stereo float frames. */
+typedef void ( *audio_monitor_cb )( const float *samples,
+                                    size_t frames,
+                                    void *userdata );
+
+/* Told whether the server carried out a mute request, and how long after
+ * the request it did. The latency is 0 for a mute that was not requested
+ * then, such as a stream that showed up later being muted like the rest. */
+typedef void ( *audio_mute_cb )( int success,
+                                 uint64_t latency_usec,
+                                 void *userdata );
+
+typedef struct
+{
+    const char *name;
+    const char *user_socket; // server socket in a user's runtime dir
+
+    // `server` is NULL for the default server
+    void *( *open )( ev_loop_t *loop, const char *server );
+    void ( *close )( void *impl );
+
+    // while parked a lost connection is not retried
+    void ( *park )( void *impl, int parked );
+    void ( *set_mute )( void *impl, int mute );
+    void ( *set_monitor )( void *impl,
+                           unsigned rate,
+                           audio_monitor_cb cb,
+                           void *userdata );
+    void ( *set_mute_callback )( void *impl,
+                                 audio_mute_cb cb,
+                                 void *userdata );
+} audio_backend_t;
+
+typedef struct
+{
+    const audio_backend_t *backend;
+    void *impl;
+} audio_ctl_t;
+
+const audio_backend_t *audio_backend_find( const char *name );
+const char *audio_backend_name( int i );
+
+int audio_ctl_open( audio_ctl_t **ret,
+                    const audio_backend_t *backend,
+                    ev_loop_t *loop,
+                    const char *server );
+void audio_ctl_close( audio_ctl_t *ctl );
+void audio_ctl_park( audio_ctl_t *ctl, int parked );
+void audio_ctl_set_mute( audio_ctl_t *ctl, int mute );
+void audio_ctl_set_monitor( audio_ctl_t *ctl,
+                            unsigned rate,
+                            audio_monitor_cb cb,
+                            void *userdata );
+void audio_ctl_set_mute_callback( audio_ctl_t *ctl,
+                                  audio_mute_cb cb,
+                                  void *userdata );
+
+#endif // SDE_AUDIO_BACKEND_H
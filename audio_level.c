@@ -0,0 +1,300 @@
+#include <math.h>
+#include <string.h>
+
+#include "audio_level.h"
+
+// independent accumulators per loop, wide enough for 8 float SIMD lanes
+#define AL_LANES 8
+
+#define AL_PI 3.14159265358979f
+
+// short-term (~3 s) and reference (~60 s) smoothing per 100 ms block
+#define AL_SHORT_ALPHA ( 1.0f / 30.0f )
+#define AL_REFERENCE_ALPHA ( 1.0f / 600.0f )
+
+// function prototypes
+void al_power( const float *restrict re,
+               const float *restrict im,
+               float *restrict power,
+               size_t n );
+void al_fft( al_spectrum_t *spectrum, const float *window );
+float al_spectral_flatness( al_detector_t *al );
+bool al_block_done( al_detector_t *al );
+
+void al_init( al_detector_t *al )
+{
+    memset( al, 0, sizeof( *al ) );
+    al_spectrum_init( &al->spectrum );
+}
+
+void al_spectrum_init( al_spectrum_t *spectrum )
+{
+    for ( int i = 0; i < AL_FFT_SIZE; ++i )
+    {
+        spectrum->hann[i] =
+            0.5f - 0.5f * cosf( 2.0f * AL_PI * (float)i / AL_FFT_SIZE );
+
+        unsigned rev = 0;
+        for ( int b = 0; b < AL_FFT_ORDER; ++b )
+        {
+            rev |= ( ( (unsigned)i >> b ) & 1u ) << ( AL_FFT_ORDER - 1 - b );
+        }
+        spectrum->bitrev[i] = (uint16_t)rev;
+    }
+
+    for ( int i = 0; i < AL_FFT_SIZE / 2; ++i )
+    {
+        spectrum->twiddle_re[i] =
+            cosf( -2.0f * AL_PI * (float)i / AL_FFT_SIZE );
+        spectrum->twiddle_im[i] =
+            sinf( -2.0f * AL_PI * (float)i / AL_FFT_SIZE );
+    }
+}
+
+/*
+ * Forget the current track. The reference level is kept.
+ */
+void al_reset( al_detector_t *al )
+{
+    al->block_sumsq = 0.0f;
+    al->block_frames = 0;
+    al->block_flatness = 0.0f;
+    al->block_windows = 0;
+    al->window_len = 0;
+
+    al->short_ms = 0.0f;
+    al->flatness = 0.0f;
+    al->loud_blocks = 0;
+    al->ad = false;
+}
+
+float al_db( float mean_square )
+{
+    return 10.0f * log10f( mean_square + 1e-12f );
+}
+
+/*
+ * Downmix `n` interleaved stereo frames into `mono` and return the sum of
+ * squares of all samples.
+ */
+float al_downmix( const float *restrict in, float *restrict mono, size_t n )
+{
+    float acc[AL_LANES] = { 0 };
+    size_t i = 0;
+
+    for ( ; i + AL_LANES <= n; i += AL_LANES )
+    {
+        for ( size_t l = 0; l < AL_LANES; ++l )
+        {
+            float left = in[2 * ( i + l )];
+            float right = in[2 * ( i + l ) + 1];
+            mono[i + l] = 0.5f * ( left + right );
+            acc[l] += left * left + right * right;
+        }
+    }
+    for ( ; i < n; ++i )
+    {
+        float left = in[2 * i];
+        float right = in[2 * i + 1];
+        mono[i] = 0.5f * ( left + right );
+        acc[0] += left * left + right * right;
+    }
+
+    float sum = 0.0f;
+    for ( size_t l = 0; l < AL_LANES; ++l )
+    {
+        sum += acc[l];
+    }
+    return sum;
+}
+
+void al_power( const float *restrict re,
+               const float *restrict im,
+               float *restrict power,
+               size_t n )
+{
+    for ( size_t i = 0; i < n; ++i )
+    {
+        power[i] = re[i] * re[i] + im[i] * im[i];
+    }
+}
+
+/*
+ * In place radix-2 FFT of the windowed `window` into `re`/`im`.
+ */
+void al_fft( al_spectrum_t *spectrum, const float *window )
+{
+    float *restrict re = spectrum->re;
+    float *restrict im = spectrum->im;
+
+    for ( int i = 0; i < AL_FFT_SIZE; ++i )
+    {
+        int j = spectrum->bitrev[i];
+        re[i] = window[j] * spectrum->hann[j];
+        im[i] = 0.0f;
+    }
+
+    for ( int len = 2; len <= AL_FFT_SIZE; len <<= 1 )
+    {
+        int half = len / 2;
+        int step = AL_FFT_SIZE / len;
+        for ( int start = 0; start < AL_FFT_SIZE; start += len )
+        {
+            for ( int k = 0; k < half; ++k )
+            {
+                float wr = spectrum->twiddle_re[k * step];
+                float wi = spectrum->twiddle_im[k * step];
+                int a = start + k;
+                int b = a + half;
+
+                float tr = re[b] * wr - im[b] * wi;
+                float ti = re[b] * wi + im[b] * wr;
+                re[b] = re[a] - tr;
+                im[b] = im[a] - ti;
+                re[a] += tr;
+                im[a] += ti;
+            }
+        }
+    }
+}
+
+/*
+ * Power spectrum of `window` into `power`, `AL_FFT_BINS` values starting at
+ * bin 1. `power` may be `window` itself.
+ */
+void al_spectrum_power( al_spectrum_t *spectrum,
+                        const float *window,
+                        float *power )
+{
+    al_fft( spectrum, window );
+    al_power( spectrum->re + 1, spectrum->im + 1, power, AL_FFT_BINS );
+}
+
+/*
+ * Spectral flatness (geometric over arithmetic mean of the power spectrum)
+ * of the current window: close to 1 for noise, small for tonal material.
+ */
+float al_spectral_flatness( al_detector_t *al )
+{
+    // the samples are consumed, so the window holds the power spectrum
+    float *power = al->window;
+    al_spectrum_power( &al->spectrum, al->window, power );
+
+    float log_sum = 0.0f;
+    float sum = 0.0f;
+    for ( size_t i = 0; i < AL_FFT_BINS; ++i )
+    {
+        log_sum += logf( power[i] + 1e-12f );
+        sum += power[i];
+    }
+
+    float mean = sum / (float)AL_FFT_BINS;
+    return expf( log_sum / (float)AL_FFT_BINS ) / ( mean + 1e-12f );
+}
+
+/*
+ * Fold a finished block into the short-term and reference levels.
+ *
+ * Returns: true if the verdict changed.
+ */
+bool al_block_done( al_detector_t *al )
+{
+    float ms = al->block_sumsq / (float)( al->block_frames * AL_CHANNELS );
+    float flatness =
+        al->block_windows ? al->block_flatness / (float)al->block_windows
+                          : 1.0f;
+
+    al->block_sumsq = 0.0f;
+    al->block_frames = 0;
+    al->block_flatness = 0.0f;
+    al->block_windows = 0;
+
+    // pauses and a muted stream say nothing about the track
+    if ( al_db( ms ) < AL_SILENCE_DB )
+    {
+        return false;
+    }
+
+    if ( al->short_ms > 0.0f )
+    {
+        al->short_ms += ( ms - al->short_ms ) * AL_SHORT_ALPHA;
+        al->flatness += ( flatness - al->flatness ) * AL_SHORT_ALPHA;
+    }
+    else
+    {
+        al->short_ms = ms;
+        al->flatness = flatness;
+    }
+
+    // ads must not raise the level they are compared against
+    if ( !al->ad )
+    {
+        if ( al->reference_blocks )
+        {
+            al->reference_ms += ( ms - al->reference_ms ) * AL_REFERENCE_ALPHA;
+        }
+        else
+        {
+            al->reference_ms = ms;
+        }
+        al->reference_blocks++;
+    }
+
+    bool loud = al->reference_blocks >= AL_MIN_REFERENCE_BLOCKS &&
+                al_db( al->short_ms ) - al_db( al->reference_ms ) >
+                    AL_LOUD_DB &&
+                al->flatness < AL_MAX_FLATNESS;
+    al->loud_blocks = loud ? al->loud_blocks + 1 : 0;
+
+    if ( !al->ad && al->loud_blocks >= AL_HOLD_BLOCKS )
+    {
+        al->ad = true;
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Analyse `frames` interleaved stereo float frames.
+ *
+ * Returns: true if the verdict (`al->ad`) changed.
+ */
+bool al_feed( al_detector_t *al, const float *samples, size_t frames )
+{
+    bool changed = false;
+
+    while ( frames )
+    {
+        size_t n = AL_FFT_SIZE - al->window_len;
+        if ( n > AL_BLOCK_FRAMES - al->block_frames )
+        {
+            n = AL_BLOCK_FRAMES - al->block_frames;
+        }
+        if ( n > frames )
+        {
+            n = frames;
+        }
+
+        al->block_sumsq +=
+            al_downmix( samples, al->window + al->window_len, n );
+        al->window_len += (uint32_t)n;
+        al->block_frames += (uint32_t)n;
+        samples += n * AL_CHANNELS;
+        frames -= n;
+
+        if ( al->window_len == AL_FFT_SIZE )
+        {
+            al->block_flatness += al_spectral_flatness( al );
+            al->block_windows++;
+            al->window_len = 0;
+        }
+
+        if ( al->block_frames == AL_BLOCK_FRAMES )
+        {
+            changed |= al_block_done( al );
+        }
+    }
+
+    return changed;
+}
@@ -0,0 +1,87 @@
+#ifndef SDE_AUDIO_LEVEL_H
+#define SDE_AUDIO_LEVEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Audio level ad detector.
+ *
+ * Fed with the Spotify stream (interleaved stereo float at `AL_RATE`), it
+ * keeps a short-term level and spectral flatness and a slow reference level of
+ * everything that was not an ad. Ads are mastered much louder than music, so a
+ * track whose short-term level stays `AL_LOUD_DB` above the reference for
+ * `AL_HOLD_BLOCKS` is flagged. The verdict latches until `al_reset()`, which
+ * the caller does on every track change: once muted the stream is silent and
+ * says nothing about when the ad ends.
+ *
+ * Cost per second of audio is one pass over the samples plus ~86 512 point
+ * FFTs, written as fixed width lane loops the compiler turns into SIMD.
+ */
+
+#define AL_RATE 44100
+#define AL_CHANNELS 2
+#define AL_BLOCK_FRAMES ( AL_RATE / 10 ) // 100 ms
+#define AL_FFT_ORDER 9
+#define AL_FFT_SIZE ( 1 << AL_FFT_ORDER )
+#define AL_FFT_BINS ( AL_FFT_SIZE / 2 - 1 ) // without DC and Nyquist
+
+#define AL_LOUD_DB 6.0f
+#define AL_HOLD_BLOCKS 30           // 3 s
+#define AL_MIN_REFERENCE_BLOCKS 100 // 10 s of music before voting
+#define AL_MAX_FLATNESS 0.5f        // noise, not program material
+#define AL_SILENCE_DB -60.0f
+
+/* Power spectrum of a Hann windowed `AL_FFT_SIZE` mono window, shared by the
+ * level detector and the fingerprinter. */
+typedef struct
+{
+    // tables built by al_spectrum_init()
+    float hann[AL_FFT_SIZE];
+    float twiddle_re[AL_FFT_SIZE / 2];
+    float twiddle_im[AL_FFT_SIZE / 2];
+    uint16_t bitrev[AL_FFT_SIZE];
+
+    // fft scratch, split real and imaginary parts
+    float re[AL_FFT_SIZE];
+    float im[AL_FFT_SIZE];
+} al_spectrum_t;
+
+typedef struct
+{
+    // block being accumulated
+    float block_sumsq;
+    uint32_t block_frames;
+    float block_flatness;
+    uint32_t block_windows;
+
+    // mono samples waiting for the next spectrum
+    float window[AL_FFT_SIZE];
+    uint32_t window_len;
+
+    al_spectrum_t spectrum;
+
+    // short-term state of the current track, cleared by al_reset()
+    float short_ms; // mean square, 0 until the first block
+    float flatness;
+    uint32_t loud_blocks;
+    bool ad;
+
+    // long-term level of everything that was not flagged
+    float reference_ms;
+    uint32_t reference_blocks;
+} al_detector_t;
+
+void al_init( al_detector_t *al );
+void al_reset( al_detector_t *al );
+bool al_feed( al_detector_t *al, const float *samples, size_t frames );
+
+float al_db( float mean_square );
+
+void al_spectrum_init( al_spectrum_t *spectrum );
+void al_spectrum_power( al_spectrum_t *spectrum,
+                        const float *window,
+                        float *power );
+float al_downmix( const float *restrict in, float *restrict mono, size_t n );
+
+#endif // SDE_AUDIO_LEVEL_H
@@ -0,0 +1,209 @@
+#!/bin/sh
+# Scale benchmark for spotify_mute, run it with `make bench`.
+#
+# Starts a private dbus-daemon and a PulseAudio server with null sinks only,
+# then for every COUNT runs spotify_mute_fakeplayer with COUNT MPRIS players
+# and COUNT sink inputs (one of each is Spotify) and a fresh spotify_mute
+# against them. Per COUNT it prints:
+#
+#   first_ms     daemon start to its first decision: is_spotify_availible()
+#                over every bus name, then fetching and decoding the metadata
+#   det_p50/99   track change on the bus to the daemon's decision on it, usec
+#   mute_p50/99  mute request to PulseAudio confirming it, usec; the request
+#                goes to every sink input matched in pactl.c
+#   missed       ads the daemon never decided on
+#   cpu          daemon CPU time over the run, % of one core
+#   rss, hwm     daemon resident set at the end and its peak, KiB
+#
+# Usage: ./bench.sh [COUNT...]          (default: 1 10 100 1000)
+#
+# BENCH_RATE     track changes per second of every player (default 20)
+# BENCH_SECONDS  length of every run (default 10)
+
+set -eu
+
+rate=${BENCH_RATE:-20}
+seconds=${BENCH_SECONDS:-10}
+counts=${*:-1 10 100 1000}
+
+for tool in dbus-daemon pulseaudio; do
+    if ! command -v "$tool" > /dev/null; then
+        echo "$0: $tool is needed" >&2
+        exit 1
+    fi
+done
+
+dir=$(mktemp -d "${TMPDIR:-/tmp}/spotify_mute_bench.XXXXXX")
+pids=""
+
+cleanup()
+{
+    for pid in $pids; do
+        kill "$pid" 2> /dev/null || true
+    done
+    wait 2> /dev/null || true
+    rm -rf "$dir"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# usec on the same clock as the NDJSON events and the fake player's log
+now()
+{
+    echo $(( $(date +%s%N) / 1000 ))
+}
+
+# wait_for FILE PATTERN: give up after 30 s
+wait_for()
+{
+    tries=0
+    until grep -q "$2" "$1" 2> /dev/null; do
+        tries=$((tries + 1))
+        if [ "$tries" -gt 300 ]; then
+            echo "$0: timed out waiting for '$2' in $1" >&2
+            exit 1
+        fi
+        sleep 0.1
+    done
+}
+
+# one connection per player plus ours
+ulimit -n "$(ulimit -H -n)" 2> /dev/null || true
+
+dbus-daemon --session --nofork --nopidfile \
+    --address="unix:path=$dir/bus" > "$dir/dbus.log" 2>&1 &
+pids="$pids $!"
+
+# PulseAudio takes at most 256 inputs per sink, keep 200 on each
+max=0
+for count in $counts; do
+    if [ "$count" -gt "$max" ]; then
+        max=$count
+    fi
+done
+sinks=$(( max / 200 + 1 ))
+
+: > "$dir/bench.pa"
+i=0
+while [ "$i" -lt "$sinks" ]; do
+    echo "load-module module-null-sink sink_name=bench$i" >> "$dir/bench.pa"
+    i=$((i + 1))
+done
+echo "load-module module-native-protocol-unix socket=$dir/pulse" \
+     "auth-anonymous=1" >> "$dir/bench.pa"
+
+HOME=$dir XDG_RUNTIME_DIR=$dir pulseaudio -n --daemonize=no \
+    --exit-idle-time=-1 --use-pid-file=no -F "$dir/bench.pa" \
+    > "$dir/pulse.log" 2>&1 &
+pids="$pids $!"
+
+until [ -S "$dir/bus" ] && [ -S "$dir/pulse" ]; do
+    sleep 0.1
+done
+
+export DBUS_SESSION_BUS_ADDRESS="unix:path=$dir/bus"
+export PULSE_SERVER="unix:$dir/pulse"
+
+printf '%7s %8s %8s %8s %9s %9s %6s %6s %8s %8s\n' \
+       count first_ms det_p50 det_p99 mute_p50 mute_p99 missed cpu rss hwm
+
+for count in $counts; do
+    rm -f "$dir/player.out" "$dir/tracks.log" "$dir/events.json"
+
+    ./spotify_mute_fakeplayer -n "$count" -i "$count" -d "$sinks" \
+        -r "$rate" -l "$dir/tracks.log" > "$dir/player.out" 2>&1 &
+    player=$!
+    pids="$pids $player"
+    wait_for "$dir/player.out" ready
+
+    start=$(now)
+    ./spotify_mute -s "$DBUS_SESSION_BUS_ADDRESS" -p "$PULSE_SERVER" \
+        -j "$dir/events.json" -C "$dir/ctl.sock" -M "$dir/state.page" \
+        > /dev/null 2> "$dir/daemon.log" &
+    daemon=$!
+    pids="$pids $daemon"
+    wait_for "$dir/events.json" '"decision"'
+
+    sleep "$seconds"
+
+    # sample before stopping it, the exit path is not what is measured
+    ticks=$(awk '{ print $14 + $15 }' "/proc/$daemon/stat")
+    elapsed=$(( $(now) - start ))
+    rss=$(awk '/^VmRSS:/ { print $2 }' "/proc/$daemon/status")
+    hwm=$(awk '/^VmHWM:/ { print $2 }' "/proc/$daemon/status")
+
+    # let the daemon decide on the player's last tracks
+    kill "$player"
+    wait "$player" 2> /dev/null || true
+    sleep 0.5
+    kill "$daemon"
+    wait "$daemon" 2> /dev/null || true
+
+    awk -v start="$start" -v count="$count" -v ticks="$ticks" \
+        -v hz="$(getconf CLK_TCK)" -v elapsed="$elapsed" \
+        -v rss="$rss" -v hwm="$hwm" -v tmp="$dir/lat" '
+        function field( name,    v )
+        {
+            if ( !match( $0, "\"" name "\":(\"[^\"]*\"|[0-9a-z]+)" ) )
+                return ""
+            v = substr( $0, RSTART + length( name ) + 3,
+                        RLENGTH - length( name ) - 3 )
+            gsub( /"/, "", v )
+            return v
+        }
+
+        # percentile of the sorted numbers in file f, n of them
+        function pct( f, n, p,    cmd, i, v )
+        {
+            if ( !n )
+                return "-"
+            cmd = "sort -n " f
+            for ( i = 0; i <= int( ( n - 1 ) * p ); ++i )
+                cmd | getline v
+            close( cmd )
+            return v
+        }
+
+        # the fake player log: emission time and trackid
+        FNR == NR {
+            emitted[$2] = $1
+            next
+        }
+
+        field( "event" ) == "decision" {
+            t = field( "time" )
+            if ( first == "" )
+                first = t
+            id = field( "trackid" )
+            if ( ( id in emitted ) && !( id in decided ) &&
+                 emitted[id] >= start )
+            {
+                decided[id] = 1
+                print t - emitted[id] > ( tmp ".det" )
+                ndet++
+            }
+        }
+
+        # mutes of streams that showed up later carry no latency
+        field( "event" ) == "mute_result" && field( "success" ) == "true" &&
+        field( "latency_usec" ) != "" {
+            print field( "latency_usec" ) > ( tmp ".mute" )
+            nmute++
+        }
+
+        END {
+            close( tmp ".det" )
+            close( tmp ".mute" )
+            for ( id in emitted )
+                if ( emitted[id] >= start && id ~ /^spotify:ad:/ &&
+                     !( id in decided ) )
+                    missed++
+            printf "%7d %8.1f %8s %8s %9s %9s %6d %5.1f%% %8d %8d\n",
+                   count, ( first - start ) / 1000,
+                   pct( tmp ".det", ndet, 0.5 ), pct( tmp ".det", ndet, 0.99 ),
+                   pct( tmp ".mute", nmute, 0.5 ),
+                   pct( tmp ".mute", nmute, 0.99 ),
+                   missed, 100 * ticks / hz / ( elapsed / 1e6 ), rss, hwm
+        }' "$dir/tracks.log" "$dir/events.json"
+    rm -f "$dir/lat.det" "$dir/lat.mute"
+done
@@ -0,0 +1,408 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "control.h"
+
+struct control_client
+{
+    control_t *ctl;
+    int fd; // -1 for a free slot
+    ev_source_t *src;
+    bool subscribed;
+
+    char in[CONTROL_LINE_MAX];
+    size_t in_len;
+
+    char out[CONTROL_OUT_SIZE];
+    size_t out_len;
+};
+
+struct control
+{
+    ev_loop_t *loop;
+    char *path;
+    int fd;
+    ev_source_t *src;
+
+    control_fn fn;
+    void *userdata;
+
+    control_client_t clients[CONTROL_MAX_CLIENTS];
+};
+
+// function prototypes
+void control_accept( ev_source_t *src, uint32_t events, void *userdata );
+void control_client_io( ev_source_t *src, uint32_t events, void *userdata );
+void control_client_close( control_client_t *client );
+int control_client_flush( control_client_t *client );
+int control_set_nonblock( int fd );
+int control_remove_stale( const struct sockaddr_un *addr );
+
+int control_set_nonblock( int fd )
+{
+    int flags = fcntl( fd, F_GETFL );
+    if ( flags < 0 || fcntl( fd, F_SETFL, flags | O_NONBLOCK ) < 0 ||
+         fcntl( fd, F_SETFD, FD_CLOEXEC ) < 0 )
+    {
+        return -errno;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Remove the socket a previous run left at the address. Anything that is not
+ * a socket, or a socket somebody still listens on, is left alone.
+ *
+ * Returns: 0 (`EXIT_SUCCESS`) if the path is free, a negative errno otherwise.
+ */
+int control_remove_stale( const struct sockaddr_un *addr )
+{
+    struct stat st;
+
+    if ( lstat( addr->sun_path, &st ) < 0 )
+    {
+        return errno == ENOENT ? EXIT_SUCCESS : -errno;
+    }
+    if ( !S_ISSOCK( st.st_mode ) )
+    {
+        return -EEXIST;
+    }
+
+    // only a socket nobody listens on any more refuses the connection
+    int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( fd < 0 )
+    {
+        return -errno;
+    }
+    int r = connect( fd, (const struct sockaddr *)addr, sizeof( *addr ) );
+    int err = errno;
+    close( fd );
+    if ( r == 0 )
+    {
+        return -EADDRINUSE;
+    }
+    if ( err != ECONNREFUSED )
+    {
+        return -err;
+    }
+
+    if ( unlink( addr->sun_path ) < 0 && errno != ENOENT )
+    {
+        return -errno;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Listen on `path`, replacing a stale socket left behind by a previous run.
+ *
+ * Returns: 0 (`EXIT_SUCCESS`) on success, a negative errno on failure.
+ */
+int control_open( control_t **ret,
+                  ev_loop_t *loop,
+                  const char *path,
+                  control_fn fn,
+                  void *userdata )
+{
+    int r = 0;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if ( strlen( path ) >= sizeof( addr.sun_path ) )
+    {
+        return -ENAMETOOLONG;
+    }
+    strcpy( addr.sun_path, path );
+
+    control_t *ctl = calloc( 1, sizeof( *ctl ) );
+    if ( !ctl )
+    {
+        return -ENOMEM;
+    }
+    ctl->loop = loop;
+    ctl->fn = fn;
+    ctl->userdata = userdata;
+    for ( int i = 0; i < CONTROL_MAX_CLIENTS; ++i )
+    {
+        ctl->clients[i].ctl = ctl;
+        ctl->clients[i].fd = -1;
+    }
+
+    ctl->fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( ctl->fd < 0 )
+    {
+        r = -errno;
+        goto cleanup;
+    }
+
+    r = control_set_nonblock( ctl->fd );
+    if ( r < 0 )
+    {
+        goto cleanup;
+    }
+
+    r = control_remove_stale( &addr );
+    if ( r < 0 )
+    {
+        goto cleanup;
+    }
+
+    // created owner only, there is no window with wider permissions
+    mode_t mask = umask( 077 );
+    r = bind( ctl->fd, (struct sockaddr *)&addr, sizeof( addr ) );
+    umask( mask );
+    if ( r < 0 || listen( ctl->fd, 8 ) < 0 )
+    {
+        r = -errno;
+        goto cleanup;
+    }
+
+    ctl->path = malloc( strlen( path ) + 1 );
+    if ( !ctl->path )
+    {
+        r = -ENOMEM;
+        goto cleanup;
+    }
+    strcpy( ctl->path, path );
+
+    r = ev_add_io( loop, &ctl->src, ctl->fd, EPOLLIN, control_accept, ctl );
+
+cleanup:
+    if ( r < 0 )
+    {
+        fprintf( stderr,
+                 "Could not open control socket %s: %s\n",
+                 path,
+                 strerror( -r ) );
+        control_close( ctl );
+        ctl = NULL;
+    }
+
+    *ret = ctl;
+    return r;
+}
+
+void control_close( control_t *ctl )
+{
+    if ( !ctl )
+    {
+        return;
+    }
+
+    for ( int i = 0; i < CONTROL_MAX_CLIENTS; ++i )
+    {
+        control_client_close( &ctl->clients[i] );
+    }
+
+    ev_source_free( ctl->src );
+    if ( ctl->fd >= 0 )
+    {
+        close( ctl->fd );
+    }
+    if ( ctl->path )
+    {
+        unlink( ctl->path );
+    }
+    free( ctl->path );
+    free( ctl );
+}
+
+void control_accept( ev_source_t *src, uint32_t events, void *userdata )
+{
+    (void)( src );
+    (void)( events );
+    control_t *ctl = userdata;
+
+    int fd = -1;
+    while ( ( fd = accept( ctl->fd, NULL, NULL ) ) >= 0 )
+    {
+        control_client_t *client = NULL;
+        for ( int i = 0; i < CONTROL_MAX_CLIENTS && !client; ++i )
+        {
+            if ( ctl->clients[i].fd < 0 )
+            {
+                client = &ctl->clients[i];
+            }
+        }
+
+        if ( !client || control_set_nonblock( fd ) < 0 ||
+             ev_add_io( ctl->loop,
+                        &client->src,
+                        fd,
+                        EPOLLIN,
+                        control_client_io,
+                        client ) < 0 )
+        {
+            close( fd );
+            continue;
+        }
+
+        client->fd = fd;
+        client->subscribed = false;
+        client->in_len = 0;
+        client->out_len = 0;
+    }
+}
+
+void control_client_close( control_client_t *client )
+{
+    if ( client->fd < 0 )
+    {
+        return;
+    }
+
+    ev_source_free( client->src );
+    client->src = NULL;
+    close( client->fd );
+    client->fd = -1;
+}
+
+/*
+ * Write as much buffered output as the socket takes.
+ *
+ * Returns: 0 (`EXIT_SUCCESS`) on success, a negative errno if the client is
+ * gone.
+ */
+int control_client_flush( control_client_t *client )
+{
+    size_t done = 0;
+    while ( done < client->out_len )
+    {
+        ssize_t n = send( client->fd,
+                          client->out + done,
+                          client->out_len - done,
+                          MSG_NOSIGNAL );
+        if ( n < 0 )
+        {
+            if ( errno == EAGAIN )
+            {
+                break;
+            }
+            return -errno;
+        }
+        done += (size_t)n;
+    }
+
+    memmove( client->out, client->out + done, client->out_len - done );
+    client->out_len -= done;
+
+    // only wait for the socket to drain while something is left
+    return ev_io_set_events( client->src,
+                             client->out_len ? EPOLLIN | EPOLLOUT : EPOLLIN );
+}
+
+void control_client_io( ev_source_t *src, uint32_t events, void *userdata )
+{
+    (void)( src );
+    control_client_t *client = userdata;
+
+    if ( events & EPOLLOUT && control_client_flush( client ) < 0 )
+    {
+        control_client_close( client );
+        return;
+    }
+    if ( !( events & ( EPOLLIN | EPOLLHUP | EPOLLERR ) ) )
+    {
+        return;
+    }
+
+    ssize_t n = read( client->fd,
+                      client->in + client->in_len,
+                      sizeof( client->in ) - client->in_len );
+    if ( n <= 0 )
+    {
+        if ( n == 0 || errno != EAGAIN )
+        {
+            control_client_close( client );
+        }
+        return;
+    }
+    client->in_len += (size_t)n;
+
+    // handle every complete line, the client may go away while doing so
+    char *line = client->in;
+    char *end = NULL;
+    while ( client->fd >= 0 &&
+            ( end = memchr( line,
+                            '\n',
+                            client->in_len - (size_t)( line - client->in ) ) ) )
+    {
+        *end = '\0';
+        if ( end > line && end[-1] == '\r' )
+        {
+            end[-1] = '\0';
+        }
+        client->ctl->fn( client, line, client->ctl->userdata );
+        line = end + 1;
+    }
+    if ( client->fd < 0 )
+    {
+        return;
+    }
+
+    client->in_len -= (size_t)( line - client->in );
+    memmove( client->in, line, client->in_len );
+    if ( client->in_len == sizeof( client->in ) )
+    {
+        control_send( client, "error line too long" );
+        control_client_close( client );
+    }
+}
+
+/*
+ * Queue one response line for `client`.
+ */
+void control_send( control_client_t *client, const char *line )
+{
+    size_t len = strlen( line );
+
+    if ( client->fd < 0 )
+    {
+        return;
+    }
+    if ( client->out_len + len + 1 > sizeof( client->out ) )
+    {
+        // the client does not keep up, drop it instead of buffering forever
+        control_client_close( client );
+        return;
+    }
+
+    memcpy( client->out + client->out_len, line, len );
+    client->out[client->out_len + len] = '\n';
+    client->out_len += len + 1;
+
+    if ( control_client_flush( client ) < 0 )
+    {
+        control_client_close( client );
+    }
+}
+
+void control_subscribe( control_client_t *client, bool subscribe )
+{
+    client->subscribed = subscribe;
+}
+
+void control_broadcast( control_t *ctl, const char *line )
+{
+    if ( !ctl )
+    {
+        return;
+    }
+
+    for ( int i = 0; i < CONTROL_MAX_CLIENTS; ++i )
+    {
+        if ( ctl->clients[i].fd >= 0 && ctl->clients[i].subscribed )
+        {
+            control_send( &ctl->clients[i], line );
+        }
+    }
+}
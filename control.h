@@ -0,0 +1,43 @@
+#ifndef SDE_CONTROL_H
+#define SDE_CONTROL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "event_loop.h"
+
+/* Local control socket.
+ *
+ * A Unix stream socket served from the event loop. Requests and responses
+ * are single text lines; the meaning of a request is up to the `control_fn`
+ * the socket was opened with. Clients that subscribed also get every line
+ * passed to `control_broadcast()`.
+ *
+ * Output is buffered per client up to `CONTROL_OUT_SIZE`; a client that
+ * stops reading is disconnected rather than stalling the daemon.
+ */
+
+#define CONTROL_MAX_CLIENTS 16
+#define CONTROL_LINE_MAX 256
+#define CONTROL_OUT_SIZE 8192
+
+typedef struct control control_t;
+typedef struct control_client control_client_t;
+
+// called for every request line, without the newline
+typedef void ( *control_fn )( control_client_t *client,
+                              char *line,
+                              void *userdata );
+
+int control_open( control_t **ret,
+                  ev_loop_t *loop,
+                  const char *path,
+                  control_fn fn,
+                  void *userdata );
+void control_close( control_t *ctl );
+
+void control_send( control_client_t *client, const char *line );
+void control_subscribe( control_client_t *client, bool subscribe );
+void control_broadcast( control_t *ctl, const char *line );
+
+#endif // SDE_CONTROL_H
@@ -1,78 +1,366 @@
 #include <errno.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <systemd/sd-bus.h>
 
+#include "alloc.h"
 #include "dbus_utils.h"
+#include "probes.h"
+
+/* Decoding is done in two passes over the message. The first pass runs with
+ * `nodes` and `strs` set to NULL and only counts how many nodes and string
+ * bytes are needed. The message is then rewound and the second pass fills the
+ * buffer that was allocated from those counts.
+ */
+typedef struct
+{
+    dbus_node_t *nodes; // NULL during the sizing pass
+    char *strs;         // NULL during the sizing pass
+    size_t num_nodes;
+    size_t str_bytes;
+
+    // values the caller already holds are consumed without being copied
+    bus_skip_fn skip; // NULL decodes every value
+    void *skip_userdata;
+    const char *dict_key; // key of the a{sv} whose entries are being read
+} dbus_buf_t;
 
 // function prototypes
-int bus_free_sv( dbus_sv_t *sv );
-int bus_read_s_array( char **str_ptr, sd_bus_message *msg );
-int bus_read_v( dbus_v_t *v, char *type, bool *need_free, sd_bus_message *msg );
-int bus_read_sv( dbus_sv_t *sv, sd_bus_message *msg );
+char *bus_store_str( dbus_buf_t *buf, const char *s );
+int bus_read_raw( dbus_v_t *v, char *type, sd_bus_message *msg );
+int bus_read_basic( dbus_v_t *v,
+                    char *type,
+                    dbus_buf_t *buf,
+                    sd_bus_message *msg );
+int bus_read_node( dbus_buf_t *buf, sd_bus_message *msg );
+int bus_read_sv_node( dbus_buf_t *buf, sd_bus_message *msg, uint32_t *len );
+int bus_read_v( dbus_v_t *v,
+                char *type,
+                const char *key,
+                dbus_buf_t *buf,
+                sd_bus_message *msg );
+int bus_read_sv( dbus_sv_t *sv, dbus_buf_t *buf, sd_bus_message *msg );
+int bus_print_node( const dbus_node_t *node );
+
+/* bus_store_str
+ * copy a string into the string area of the buffer, or only count its bytes
+ * during the sizing pass.
+ *
+ * Returns: the copy, NULL during the sizing pass.
+ */
+char *bus_store_str( dbus_buf_t *buf, const char *s )
+{
+    size_t len = strlen( s );
+    char *copy = NULL;
+
+    if ( buf->strs )
+    {
+        copy = memcpy( buf->strs + buf->str_bytes, s, len + 1 );
+    }
+    buf->str_bytes += len + 1;
+
+    return copy;
+}
 
-int bus_read_s_array( char **str_ptr, sd_bus_message *msg )
+/* bus_read_raw
+ * read a single basic type at the current message position. String types are
+ * collapsed into the 's' type and still point into the message.
+ *
+ * Returns: a positive value if a value was read, 0 at the end of the current
+ * container and a negative errno on failure.
+ */
+int bus_read_raw( dbus_v_t *v, char *type, sd_bus_message *msg )
 {
     int ret = 0;
+    char t;
+    const char *contents_type = NULL;
+
+    ret = sd_bus_message_peek_type( msg, &t, &contents_type );
+    if ( ret <= 0 )
+    {
+        goto no_cleanup;
+    }
 
-    // enter string array
-    ret = sd_bus_message_enter_container( msg, SD_BUS_TYPE_ARRAY, "s" );
+    ret = sd_bus_message_read_basic( msg, t, (void *)v );
     if ( ret < 0 )
     {
         fprintf( stderr,
-                 "Error entering string array: %s\n",
+                 "Error reading varient value: %s\n",
                  strerror( -ret ) );
+        if ( ret == -EINVAL )
+        {
+            fprintf( stderr, "varient type: %c\n", t );
+        }
         goto no_cleanup;
     }
 
-    // read data until we run out
-    while ( true )
+    *type = t;
+    switch ( t )
     {
-        // read string
-        const char *tmp_str = NULL;
-        ret = sd_bus_message_read_basic( msg, 's', (void *)&tmp_str );
-        if ( ret < 0 )
-        {
-            fprintf( stderr,
-                     "Error reading varient value: %s\n",
-                     strerror( -ret ) );
-            goto exit_container;
-        }
-        // if we got a valid string
-        else if ( tmp_str )
+        // string types, collapse into string type
+        case 's':
+        case 'o':
+        case 'g':
+            *type = 's';
+            break;
+
+        // base types, don't need to do anything
+        case 'y':
+        case 'b':
+        case 'n':
+        case 'q':
+        case 'i':
+        case 'u':
+        case 'h':
+        case 'x':
+        case 't':
+        case 'd':
+            break;
+
+        // default, unexpected type
+        default:
+            ret = -ENXIO;
+            break;
+    }
+
+no_cleanup:
+    return ret;
+}
+
+/* bus_read_basic
+ * read a single basic type at the current message position. String types are
+ * copied into the string area of the buffer and collapsed into the 's' type.
+ *
+ * Returns: a positive value if a value was read, 0 at the end of the current
+ * container and a negative errno on failure.
+ */
+int bus_read_basic( dbus_v_t *v,
+                    char *type,
+                    dbus_buf_t *buf,
+                    sd_bus_message *msg )
+{
+    int ret = bus_read_raw( v, type, msg );
+    if ( ret > 0 && *type == 's' )
+    {
+        v->s = bus_store_str( buf, v->s );
+    }
+    return ret;
+}
+
+/* bus_read_node
+ * read one complete value (basic or container) at the current message
+ * position into the next node of the buffer. Containers are followed by their
+ * children, read recursively.
+ *
+ * Returns: a positive value if a node was read, 0 at the end of the current
+ * container and a negative errno on failure.
+ */
+int bus_read_node( dbus_buf_t *buf, sd_bus_message *msg )
+{
+    int ret = 0;
+    char t;
+    const char *contents_type = NULL;
+
+    ret = sd_bus_message_peek_type( msg, &t, &contents_type );
+    if ( ret < 0 )
+    {
+        fprintf( stderr, "Error reading message: %s\n", strerror( -ret ) );
+        goto no_cleanup;
+    }
+    // out of data
+    else if ( ret == 0 )
+    {
+        goto no_cleanup;
+    }
+
+    size_t idx = buf->num_nodes++;
+    dbus_node_t node = { 0 };
+
+    switch ( t )
+    {
+        case SD_BUS_TYPE_ARRAY:
+        case SD_BUS_TYPE_VARIANT:
+        case SD_BUS_TYPE_STRUCT:
+        case SD_BUS_TYPE_DICT_ENTRY:
         {
-            // two cases, empty string, and concatenation
-            if ( !( *str_ptr ) )
+            ret = sd_bus_message_enter_container( msg, t, contents_type );
+            if ( ret < 0 )
+            {
+                fprintf( stderr,
+                         "Error entering container '%c%s': %s\n",
+                         t,
+                         contents_type,
+                         strerror( -ret ) );
+                goto no_cleanup;
+            }
+
+            // read the children until we run out
+            if ( t == SD_BUS_TYPE_DICT_ENTRY && buf->skip && buf->dict_key &&
+                 strcmp( contents_type, "sv" ) == 0 )
             {
-                *str_ptr = malloc( strlen( tmp_str ) + 1 );
-                strcpy( *str_ptr, tmp_str );
+                ret = bus_read_sv_node( buf, msg, &node.len );
             }
             else
             {
-                // copy over the string, reallocating enough space for both plus
-                // the null character and a comma
-                *str_ptr = realloc( *str_ptr,
-                                    strlen( *str_ptr ) + strlen( ", " ) +
-                                        strlen( tmp_str ) + 1 );
-                strcat( *str_ptr, ", " );
-                strcat( *str_ptr, tmp_str );
+                while ( ( ret = bus_read_node( buf, msg ) ) > 0 )
+                {
+                    node.len++;
+                }
             }
-        }
-        // out of data
-        else if ( ret == 0 )
-        {
+
+            int r = sd_bus_message_exit_container( msg );
+            if ( ret >= 0 )
+            {
+                ret = r;
+            }
+            node.type = t;
             break;
         }
+
+        default:
+            ret = bus_read_basic( &node.v, &node.type, buf, msg );
+            if ( node.type == 's' )
+            {
+                node.len = buf->nodes ? strlen( node.v.s ) : 0;
+            }
+            break;
     }
 
-exit_container:
-    ret = sd_bus_message_exit_container( msg );
+    if ( ret < 0 )
+    {
+        goto no_cleanup;
+    }
+
+    node.size = buf->num_nodes - idx;
+    if ( buf->nodes )
+    {
+        buf->nodes[idx] = node;
+    }
+    ret = 1;
 
 no_cleanup:
     return ret;
 }
 
-int bus_read_v( dbus_v_t *v, char *type, bool *need_free, sd_bus_message *msg )
+/* bus_read_sv_node
+ * read the key and value of an entry of the a{sv} in `buf->dict_key` into
+ * nodes. A basic value the skip function reports as unchanged is consumed
+ * without being copied and stored as a single node of type 0.
+ *
+ * Returns: 0 at the end of the entry and a negative errno on failure.
+ */
+int bus_read_sv_node( dbus_buf_t *buf, sd_bus_message *msg, uint32_t *len )
+{
+    int ret = 0;
+    const char *key = NULL;
+    char t;
+    const char *contents_type = NULL;
+
+    ret = sd_bus_message_read_basic( msg, 's', &key );
+    if ( ret <= 0 )
+    {
+        return ret < 0 ? ret : -EBADMSG;
+    }
+
+    dbus_node_t *key_node = buf->nodes ? &buf->nodes[buf->num_nodes] : NULL;
+    buf->num_nodes++;
+    char *key_copy = bus_store_str( buf, key );
+    if ( key_node )
+    {
+        *key_node = ( dbus_node_t ){ .type = 's',
+                                     .len = (uint32_t)strlen( key ),
+                                     .size = 1,
+                                     .v.s = key_copy };
+    }
+    *len = 1;
+
+    ret = sd_bus_message_peek_type( msg, &t, &contents_type );
+    if ( ret <= 0 )
+    {
+        return ret < 0 ? ret : -EBADMSG;
+    }
+
+    // containers are decoded in full, their own dicts are not the caller's
+    if ( t != SD_BUS_TYPE_VARIANT || !contents_type[0] || contents_type[1] ||
+         strchr( "av(", contents_type[0] ) )
+    {
+        const char *dict_key = buf->dict_key;
+        buf->dict_key = NULL;
+        ret = bus_read_node( buf, msg );
+        buf->dict_key = dict_key;
+        if ( ret > 0 )
+        {
+            *len = 2;
+            ret = 0;
+        }
+        return ret;
+    }
+
+    ret = sd_bus_message_enter_container( msg,
+                                          SD_BUS_TYPE_VARIANT,
+                                          contents_type );
+    if ( ret < 0 )
+    {
+        return ret;
+    }
+
+    dbus_v_t v;
+    char type;
+    ret = bus_read_raw( &v, &type, msg );
+    if ( ret <= 0 )
+    {
+        sd_bus_message_exit_container( msg );
+        return ret < 0 ? ret : -EBADMSG;
+    }
+
+    size_t idx = buf->num_nodes;
+    if ( buf->skip( buf->dict_key, key, type, &v, buf->skip_userdata ) )
+    {
+        buf->num_nodes++;
+        if ( buf->nodes )
+        {
+            buf->nodes[idx] = ( dbus_node_t ){ .type = 0, .size = 1 };
+        }
+    }
+    else
+    {
+        // the same variant node with one child bus_read_node() produces
+        buf->num_nodes += 2;
+        if ( type == 's' )
+        {
+            v.s = bus_store_str( buf, v.s );
+        }
+        if ( buf->nodes )
+        {
+            buf->nodes[idx] = ( dbus_node_t ){ .type = SD_BUS_TYPE_VARIANT,
+                                               .len = 1,
+                                               .size = 2 };
+            buf->nodes[idx + 1] =
+                ( dbus_node_t ){ .type = type,
+                                 .len = type == 's' ? strlen( v.s ) : 0,
+                                 .size = 1,
+                                 .v = v };
+        }
+    }
+    *len = 2;
+
+    return sd_bus_message_exit_container( msg ) < 0 ? -EBADMSG : 0;
+}
+
+/* bus_read_v
+ * read a varient (v) at the current message position. Basic types are stored
+ * directly in `v`, container types are decoded into nodes and `v->node` points
+ * at the container node. A basic value the skip function reports as
+ * unchanged is consumed without being copied and gets type 0.
+ */
+int bus_read_v( dbus_v_t *v,
+                char *type,
+                const char *key,
+                dbus_buf_t *buf,
+                sd_bus_message *msg )
 {
     int ret = 0;
     char t;
@@ -115,93 +403,72 @@ int bus_read_v( dbus_v_t *v, char *type, bool *need_free, sd_bus_message *msg )
         goto no_cleanup;
     }
 
-
-    // check if we have a string array
-    // if we do, concatenate into a single list
-    if ( strcmp( contents_type, "as" ) == 0 )
+    switch ( *contents_type )
     {
-        char *tmp_str = NULL;
-        ret = bus_read_s_array( &tmp_str, msg );
-        if ( ret < 0 )
+        // container types, decode into nodes
+        case SD_BUS_TYPE_ARRAY:
+        case SD_BUS_TYPE_VARIANT:
+        case '(':
         {
-            fprintf( stderr,
-                     "Error reading varient value: %s\n",
-                     strerror( -ret ) );
-            if ( ret == -EINVAL )
+            size_t idx = buf->num_nodes;
+            // the entries of a dictionary value may be skipped one by one
+            if ( strcmp( contents_type, "a{sv}" ) == 0 )
             {
-                printf( "varient type: %s\n", contents_type );
+                buf->dict_key = key;
             }
-            goto exit_container;
-        }
-        v->s = tmp_str;
-        *type = 's';
-        *need_free = true;
-        ret = EXIT_SUCCESS;
-    }
-    // read single varient type
-    else
-    {
-        ret = sd_bus_message_read_basic( msg, *contents_type, (void *)v );
-        if ( ret < 0 )
-        {
-            fprintf( stderr,
-                     "Error reading varient value: %s\n",
-                     strerror( -ret ) );
-            if ( ret == -EINVAL )
+            ret = bus_read_node( buf, msg );
+            buf->dict_key = NULL;
+            if ( ret > 0 )
             {
-                fprintf( stderr, "varient type: %s\n", contents_type );
+                *type = *contents_type == '(' ? SD_BUS_TYPE_STRUCT
+                                              : *contents_type;
+                v->node = buf->nodes ? &buf->nodes[idx] : NULL;
             }
-            goto exit_container;
-        }
-        else if ( ret == 0 )
-        {
-            fprintf( stderr, "Error: message empty" );
-            ret = -EXIT_FAILURE;
-            goto exit_container;
+            break;
         }
 
-        *type = *contents_type;
-        *need_free = false;
-
-        char *tmp = NULL;
-        switch ( *contents_type )
-        {
-            // string types, collapse into string type
-            case 's':
-            case 'o':
-            case 'g':
-                tmp = malloc( strlen( v->s ) + 1 );
-                tmp = strcpy( tmp, v->s );
-                v->s = tmp;
-
-                *type = 's';
-                *need_free = true;
-
-                ret = EXIT_SUCCESS;
-                break;
-
-            // base types, don't need to do anything
-            case 'y':
-            case 'b':
-            case 'n':
-            case 'q':
-            case 'i':
-            case 'u':
-            case 'h':
-            case 'x':
-            case 't':
-            case 'd':
-                ret = EXIT_SUCCESS;
+        // read single varient type
+        default:
+            ret = bus_read_raw( v, type, msg );
+            if ( ret <= 0 )
+            {
                 break;
+            }
+            if ( buf->skip &&
+                 buf->skip( NULL, key, *type, v, buf->skip_userdata ) )
+            {
+                *type = 0;
+            }
+            else if ( *type == 's' )
+            {
+                v->s = bus_store_str( buf, v->s );
+            }
+            break;
+    }
 
-            // default, unexpected type
-            default:
-                ret = -ENXIO;
-                goto no_cleanup;
+    if ( ret < 0 )
+    {
+        fprintf( stderr,
+                 "Error reading varient value: %s\n",
+                 strerror( -ret ) );
+        if ( ret == -EINVAL )
+        {
+            fprintf( stderr, "varient type: %s\n", contents_type );
         }
+        // leave the container, but keep the error
+        sd_bus_message_exit_container( msg );
+        goto no_cleanup;
+    }
+    else if ( ret == 0 )
+    {
+        fprintf( stderr, "Error: message empty" );
+        sd_bus_message_exit_container( msg );
+        ret = -EXIT_FAILURE;
+        goto no_cleanup;
     }
 
-exit_container:
+    SM_PROBE2( variant, (int)*type, buf->nodes == NULL );
+
     // exit varient
     ret = sd_bus_message_exit_container( msg );
 
@@ -212,7 +479,7 @@ no_cleanup:
 /* bus_read_sv
  * read dbus dictionary entry ({sv}) into a structure.
  */
-int bus_read_sv( dbus_sv_t *sv, sd_bus_message *msg )
+int bus_read_sv( dbus_sv_t *sv, dbus_buf_t *buf, sd_bus_message *msg )
 {
     int ret = 0;
 
@@ -236,21 +503,21 @@ int bus_read_sv( dbus_sv_t *sv, sd_bus_message *msg )
         goto no_cleanup;
     }
 
-    // read string
-    const char *tmp_str;
-    ret = sd_bus_message_read_basic( msg, 's', (void *)&tmp_str );
-    if ( ret < 0 )
+    // read the key, it stays in the message until it is copied below
+    const char *key = NULL;
+    ret = sd_bus_message_read_basic( msg, 's', &key );
+    if ( ret <= 0 )
     {
-        fprintf( stderr, "Error reading dict key: %s\n", strerror( -ret ) );
+        fprintf( stderr,
+                 "Error reading dict key: %s\n",
+                 ret < 0 ? strerror( -ret ) : "missing" );
+        ret = ret < 0 ? ret : -EXIT_FAILURE;
         goto exit_container;
     }
-
-    // copy over the string
-    sv->s = malloc( strlen( tmp_str ) + 1 );
-    strcpy( sv->s, tmp_str );
+    sv->s = bus_store_str( buf, key );
 
     // read the varient
-    ret = bus_read_v( &sv->v, &sv->v_type, &sv->need_free, msg );
+    ret = bus_read_v( &sv->v, &sv->v_type, key, buf, msg );
     if ( ret < 0 )
     {
         fprintf( stderr, "Error reading dict value: %s\n", strerror( -ret ) );
@@ -258,8 +525,15 @@ int bus_read_sv( dbus_sv_t *sv, sd_bus_message *msg )
     }
 
 exit_container:
-    // exit varient
-    ret = sd_bus_message_exit_container( msg );
+    // exit the dict entry, keeping the first error
+    if ( ret < 0 )
+    {
+        sd_bus_message_exit_container( msg );
+    }
+    else
+    {
+        ret = sd_bus_message_exit_container( msg );
+    }
 
 no_cleanup:
     return ret;
@@ -269,9 +543,30 @@ no_cleanup:
  * read dbus dictionary array entry (a{sv}) into a structure.
  */
 int bus_read_sv_array( dbus_sv_array_t **asv_ptr, sd_bus_message *msg )
+{
+    return bus_read_sv_array_skip( asv_ptr, msg, NULL, NULL );
+}
+
+/* bus_read_sv_array_skip
+ * read dbus dictionary array entry (a{sv}) into a structure, asking `skip`
+ * about every basic value first. Values it reports as unchanged are not
+ * copied and get type 0 (see bus_skip_fn).
+ *
+ * The array is walked twice: once to size the buffer and once to fill it, so
+ * decoding does a single allocation and is linear in the message size.
+ */
+int bus_read_sv_array_skip( dbus_sv_array_t **asv_ptr,
+                            sd_bus_message *msg,
+                            bus_skip_fn skip,
+                            void *userdata )
 {
     int ret = 0;
     dbus_sv_array_t *sv = NULL;
+    dbus_buf_t buf = { .skip = skip, .skip_userdata = userdata };
+    dbus_sv_t scratch = { 0 };
+    int len = 0;
+
+    alloc_event( ALLOC_DBUS );
 
     // open the dictionary
     ret = sd_bus_message_enter_container( msg, SD_BUS_TYPE_ARRAY, "{sv}" );
@@ -286,18 +581,47 @@ int bus_read_sv_array( dbus_sv_array_t **asv_ptr, sd_bus_message *msg )
         goto no_cleanup;
     }
 
-    // do initial malloc for sv
-    sv = malloc( sizeof( dbus_sv_array_t ) );
-    sv->len = 0;
+    // sizing pass, count entries, nodes and string bytes
+    while ( ( ret = bus_read_sv( &scratch, &buf, msg ) ) > 0 )
+    {
+        len++;
+    }
+    if ( ret < 0 )
+    {
+        fprintf( stderr, "Error reading dict: %s\n", strerror( -ret ) );
+        goto exit_container;
+    }
+
+    SM_PROBE3( sv_array_sized, len, buf.num_nodes, buf.str_bytes );
 
-    bool data_remaining = true;
-    while ( data_remaining )
+    ret = sd_bus_message_rewind( msg, false );
+    if ( ret < 0 )
     {
-        // put the new dict entry on the stack
-        dbus_sv_t new_sv = { 0 };
+        fprintf( stderr, "Error rewinding dict: %s\n", strerror( -ret ) );
+        goto exit_container;
+    }
 
-        // read the varient
-        ret = bus_read_sv( &new_sv, msg );
+    // single allocation for the entries, the nodes and the strings
+    size_t nodes_offset =
+        sizeof( dbus_sv_array_t ) + sizeof( dbus_sv_t ) * (size_t)len;
+    size_t strs_offset = nodes_offset + sizeof( dbus_node_t ) * buf.num_nodes;
+    sv = alloc_malloc( ALLOC_DBUS, strs_offset + buf.str_bytes );
+    if ( !sv )
+    {
+        ret = -ENOMEM;
+        goto exit_container;
+    }
+    sv->len = 0;
+
+    buf.nodes = (dbus_node_t *)(void *)( (char *)sv + nodes_offset );
+    buf.strs = (char *)sv + strs_offset;
+    buf.num_nodes = 0;
+    buf.str_bytes = 0;
+
+    // fill pass, the message has not changed so this cannot outgrow the buffer
+    while ( sv->len < len )
+    {
+        ret = bus_read_sv( &sv->sv_array[sv->len], &buf, msg );
         if ( ret < 0 )
         {
             fprintf( stderr, "Error reading dict: %s\n", strerror( -ret ) );
@@ -308,109 +632,167 @@ int bus_read_sv_array( dbus_sv_array_t **asv_ptr, sd_bus_message *msg )
         {
             break;
         }
-
-        // grow the list
-        size_t new_size =
-            sizeof( dbus_sv_array_t ) + sizeof( dbus_sv_t[sv->len + 1] );
-        sv = realloc( sv, new_size );
-
-        // shallow copy the data into the flexable array member
-        // also upddate the length at the same time
-        sv->sv_array[sv->len++] = new_sv;
+        SM_PROBE2( sv_entry,
+                   sv->sv_array[sv->len].s,
+                   (int)sv->sv_array[sv->len].v_type );
+        sv->len++;
     }
 
-
 memory_cleanup:
-    // if we had an error, recursively free the structure
+    // if we had an error, free the structure
     if ( sv && ret < 0 )
     {
-        // todo recursively free structure
         bus_free_sv_array( &sv );
-        sv = NULL;
     }
     *asv_ptr = sv;
 
 exit_container:
-    // exit varient
-    ret = sd_bus_message_exit_container( msg );
+    // exit the array, keeping the first error
+    if ( ret < 0 )
+    {
+        sd_bus_message_exit_container( msg );
+    }
+    else
+    {
+        ret = sd_bus_message_exit_container( msg );
+    }
 
 no_cleanup:
     return ret;
 }
 
+
 /*
- * Free a sv (string, value) dictionary
+ * Free a sv (string, value) dictionary array
  *
- * Returns: 0 (`EXIT_SUCCESS`) if entry were freed, a negative value
+ * Returns: 0 (`EXIT_SUCCESS`) if array was freed, a negative value
  * (`EXIT_FAILURE`) if invalid.
  */
-int bus_free_sv( dbus_sv_t *sv )
+int bus_free_sv_array( dbus_sv_array_t **sv_array_ptr )
 {
     int ret = EXIT_SUCCESS;
-    if ( !sv )
+
+    if ( !sv_array_ptr )
     {
         ret = -EXIT_FAILURE;
         goto no_cleanup;
     }
 
-    // always cleanup the entry name string
-    free( sv->s );
-    sv->s = NULL;
+    // the entries, nodes and strings are part of the same allocation
+    alloc_free( ALLOC_DBUS, *sv_array_ptr );
 
-    // possibly cleanup the value
-    if ( sv->need_free )
-    {
-        free( sv->v.s );
-        sv->v.s = NULL;
-    }
+    // null the container
+    *sv_array_ptr = NULL;
 
 no_cleanup:
     return ret;
 }
 
-
 /*
- * Free a sv (string, value) dictionary array
+ * Find the entry with the given key in a `dbus_sv_array_t`.
  *
- * Returns: 0 (`EXIT_SUCCESS`) if array was freed, a negative value
- * (`EXIT_FAILURE`) if invalid.
+ * Returns: a pointer to the entry, or NULL if the key is not present.
  */
-int bus_free_sv_array( dbus_sv_array_t **sv_array_ptr )
+const dbus_sv_t *bus_find_sv( const dbus_sv_array_t *sv_array, const char *key )
 {
-    int ret = EXIT_SUCCESS;
-
-    if ( !sv_array_ptr )
+    if ( !sv_array || !key )
     {
-        ret = -EXIT_FAILURE;
-        goto no_cleanup;
+        return NULL;
     }
 
-    // check for a valid sv array
-    dbus_sv_array_t *sv_array = *sv_array_ptr;
-    if ( !sv_array )
+    for ( int i = 0; i < sv_array->len; ++i )
     {
-        // array has already been freed
-        ret = EXIT_SUCCESS;
-        goto no_cleanup;
+        if ( strcmp( sv_array->sv_array[i].s, key ) == 0 )
+        {
+            return &sv_array->sv_array[i];
+        }
     }
 
-    // loop through the array members, recursively freeing them
-    for ( int i = 0; i < sv_array->len; ++i )
+    return NULL;
+}
+
+/*
+ * Prints a single decoded node, recursing into containers. Arrays are printed
+ * as `[a, b]`, structs as `(a, b)` and dict entries as `key: value`.
+ */
+int bus_print_node( const dbus_node_t *node )
+{
+    switch ( node->type )
     {
-        dbus_sv_t *sv = &sv_array->sv_array[i];
+        case 's':
+            printf( "%s", node->v.s );
+            break;
+        case 'b':
+            printf( "%s", node->v.b ? "true" : "false" );
+            break;
+        case 'y':
+            printf( "%u", node->v.y );
+            break;
+        case 'n':
+            printf( "%d", node->v.n );
+            break;
+        case 'q':
+            printf( "%u", node->v.q );
+            break;
+        case 'i':
+            printf( "%d", node->v.i );
+            break;
+        case 'u':
+        case 'h':
+            printf( "%u", node->v.u );
+            break;
+        case 'x':
+            printf( "%lld", (long long)node->v.x );
+            break;
+        case 't':
+            printf( "%llu", (unsigned long long)node->v.t );
+            break;
+        case 'd':
+            printf( "%lf", node->v.d );
+            break;
 
-        // free the inner dict contents
-        bus_free_sv( sv );
-    }
+        case SD_BUS_TYPE_ARRAY:
+        case SD_BUS_TYPE_STRUCT:
+        case SD_BUS_TYPE_DICT_ENTRY:
+        case SD_BUS_TYPE_VARIANT:
+        {
+            const char *open = "[";
+            const char *sep = ", ";
+            const char *close = "]";
+            if ( node->type == SD_BUS_TYPE_STRUCT )
+            {
+                open = "(";
+                close = ")";
+            }
+            else if ( node->type == SD_BUS_TYPE_DICT_ENTRY )
+            {
+                open = "";
+                sep = ": ";
+                close = "";
+            }
+            else if ( node->type == SD_BUS_TYPE_VARIANT )
+            {
+                open = "";
+                close = "";
+            }
 
-    // free the containing structure
-    free( sv_array );
+            printf( "%s", open );
+            const dbus_node_t *child = node + 1;
+            for ( uint32_t i = 0; i < node->len; ++i, child += child->size )
+            {
+                printf( "%s", i ? sep : "" );
+                bus_print_node( child );
+            }
+            printf( "%s", close );
+            break;
+        }
 
-    // null the container
-    *sv_array_ptr = NULL;
+        default:
+            printf( "null" );
+            break;
+    }
 
-no_cleanup:
-    return ret;
+    return EXIT_SUCCESS;
 }
 
 /*
@@ -435,27 +817,196 @@ int bus_print_sv_array( const dbus_sv_array_t *sv_array )
     for ( int i = 0; i < sv_array->len; ++i )
     {
         const dbus_sv_t *sv = &sv_array->sv_array[i];
-        if ( sv )
+        if ( sv->v_type == 's' )
         {
-            if ( sv->v_type == 's' )
-            {
-                printf( "%20s: %s\n", sv->s, sv->v.s );
-            }
-            else if ( sv->v_type == 'd' )
-            {
-                printf( "%20s: %lf\n", sv->s, sv->v.d );
-            }
-            else if ( sv->v_type == 'i' )
-            {
-                printf( "%20s: %d\n", sv->s, sv->v.i );
-            }
-            else
-            {
-                printf( "%20s: null\n", sv->s );
-            }
+            printf( "%20s: %s\n", sv->s, sv->v.s );
+        }
+        else if ( sv->v_type == 'd' )
+        {
+            printf( "%20s: %lf\n", sv->s, sv->v.d );
+        }
+        else if ( sv->v_type == 'i' )
+        {
+            printf( "%20s: %d\n", sv->s, sv->v.i );
+        }
+        else if ( sv->v_type == SD_BUS_TYPE_ARRAY ||
+                  sv->v_type == SD_BUS_TYPE_STRUCT ||
+                  sv->v_type == SD_BUS_TYPE_VARIANT )
+        {
+            printf( "%20s: ", sv->s );
+            bus_print_node( sv->v.node );
+            puts( "" );
+        }
+        else
+        {
+            printf( "%20s: null\n", sv->s );
         }
     }
 
 no_cleanup:
     return ret;
 }
+
+/*
+ * Convert a decoded node into the (type, value) form used by `dbus_sv_t`.
+ * Variant nodes are unwrapped, basic types are copied into `v` and container
+ * types are referenced through `v->node`.
+ */
+void bus_node_v( const dbus_node_t *node, char *type, dbus_v_t *v )
+{
+    // unwrap varients, the value is the only child
+    while ( node->type == SD_BUS_TYPE_VARIANT && node->len == 1 )
+    {
+        node++;
+    }
+
+    *type = node->type;
+    switch ( node->type )
+    {
+        case SD_BUS_TYPE_ARRAY:
+        case SD_BUS_TYPE_STRUCT:
+        case SD_BUS_TYPE_DICT_ENTRY:
+        case SD_BUS_TYPE_VARIANT:
+            // nodes are only ever read through const pointers
+            v->node = (dbus_node_t *)(uintptr_t)node;
+            break;
+        default:
+            *v = node->v;
+            break;
+    }
+}
+
+/*
+ * Compare two basic values of the same type.
+ */
+static bool bus_basic_equal( char type, const dbus_v_t *a, const dbus_v_t *b )
+{
+    switch ( type )
+    {
+        case 's':
+            return strcmp( a->s, b->s ) == 0;
+        case 'y':
+            return a->y == b->y;
+        case 'b':
+            return a->b == b->b;
+        case 'n':
+            return a->n == b->n;
+        case 'q':
+            return a->q == b->q;
+        case 'i':
+            return a->i == b->i;
+        case 'u':
+        case 'h':
+            return a->u == b->u;
+        case 'x':
+            return a->x == b->x;
+        case 't':
+            return a->t == b->t;
+        case 'd':
+            // bitwise compare, we want to know if the value changed
+            return memcmp( &a->d, &b->d, sizeof( a->d ) ) == 0;
+        default:
+            return true;
+    }
+}
+
+static bool bus_is_container( char type )
+{
+    return type == SD_BUS_TYPE_ARRAY || type == SD_BUS_TYPE_STRUCT ||
+           type == SD_BUS_TYPE_DICT_ENTRY || type == SD_BUS_TYPE_VARIANT;
+}
+
+/*
+ * Deep compare two values of the given type. Containers are compared node by
+ * node, which is linear because the subtrees are stored flat.
+ *
+ * Returns: true if the values are equal.
+ */
+bool bus_v_equal( char type, const dbus_v_t *a, const dbus_v_t *b )
+{
+    if ( !bus_is_container( type ) )
+    {
+        return bus_basic_equal( type, a, b );
+    }
+
+    const dbus_node_t *na = a->node;
+    const dbus_node_t *nb = b->node;
+    if ( na->size != nb->size )
+    {
+        return false;
+    }
+
+    for ( uint32_t i = 0; i < na->size; ++i )
+    {
+        if ( na[i].type != nb[i].type || na[i].len != nb[i].len ||
+             na[i].size != nb[i].size ||
+             !bus_basic_equal( na[i].type, &na[i].v, &nb[i].v ) )
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Number of bytes of storage `bus_v_copy()` needs to make an owned copy of a
+ * value. Basic types other than strings need no storage.
+ */
+size_t bus_v_storage_size( char type, const dbus_v_t *v )
+{
+    if ( type == 's' )
+    {
+        return strlen( v->s ) + 1;
+    }
+    else if ( !bus_is_container( type ) )
+    {
+        return 0;
+    }
+
+    const dbus_node_t *node = v->node;
+    size_t bytes = sizeof( dbus_node_t ) * node->size;
+    for ( uint32_t i = 0; i < node->size; ++i )
+    {
+        if ( node[i].type == 's' )
+        {
+            bytes += node[i].len + 1;
+        }
+    }
+
+    return bytes;
+}
+
+/*
+ * Copy a value into `storage`, which must be at least
+ * `bus_v_storage_size()` bytes and suitably aligned (from malloc). The copy
+ * points only into `storage` and stays valid after the source is freed.
+ */
+void bus_v_copy( dbus_v_t *dst, char type, const dbus_v_t *src, void *storage )
+{
+    if ( type == 's' )
+    {
+        dst->s = strcpy( storage, src->s );
+        return;
+    }
+    else if ( !bus_is_container( type ) )
+    {
+        *dst = *src;
+        return;
+    }
+
+    const dbus_node_t *node = src->node;
+    dbus_node_t *nodes = storage;
+    char *strs = (char *)storage + sizeof( dbus_node_t ) * node->size;
+
+    memcpy( nodes, node, sizeof( dbus_node_t ) * node->size );
+    for ( uint32_t i = 0; i < node->size; ++i )
+    {
+        if ( nodes[i].type == 's' )
+        {
+            nodes[i].v.s = memcpy( strs, node[i].v.s, node[i].len + 1 );
+            strs += node[i].len + 1;
+        }
+    }
+    dst->node = nodes;
+}
@@ -6,6 +6,9 @@
 #include <stdlib.h>
 #include <systemd/sd-bus.h>
 
+// decoded container node, see dbus_node_t below
+typedef struct dbus_node dbus_node_t;
+
 // union value name based on dbus type names
 // see: https://dbus.freedesktop.org/doc/dbus-specification.html#basic-types
 typedef union
@@ -23,20 +26,42 @@ typedef union
 
     // string types
     char *s; // regular string
+
+    // container types (a, e, r, v)
+    dbus_node_t *node;
 } dbus_v_t;
 
+/* Container values are decoded into a flat list of tagged nodes. Each node is
+ * followed directly by its children, so a container node covers the next
+ * `size - 1` entries of the list. Walk the direct children with:
+ *
+ *   const dbus_node_t *child = node + 1;
+ *   for ( uint32_t i = 0; i < node->len; ++i, child += child->size )
+ */
+struct dbus_node
+{
+    char type;     // dbus type code, 'o' and 'g' are collapsed into 's'
+    uint32_t len;  // number of direct children, or string length for 's'
+    uint32_t size; // number of nodes in this subtree including this one
+    dbus_v_t v;    // value for basic types
+};
+
 typedef struct
 {
     // information for string (s) type;
     char *s;
 
     // information for varient (v) type
+    // basic types are stored in `v` directly, containers in `v.node`
     char v_type;
-    bool need_free;
     dbus_v_t v;
 
 } dbus_sv_t;
 
+/* The dictionary array, its entries, every container node and every string
+ * live in a single allocation that is sized before it is filled, so the whole
+ * structure is released with one free().
+ */
 typedef struct
 {
     int len;
@@ -53,9 +78,31 @@ typedef struct
         free( strv_name );                                \
     } while ( 0 )
 
+/* Asked about every basic value before it is copied out of the message, with
+ * the value's key and, for the entries of a dictionary value, the key of that
+ * dictionary in `dict` (NULL for the entries of the array itself). Strings
+ * still point into the message. Returning true means the caller already has
+ * the value: it is skipped and its entry (or dict entry node) gets type 0.
+ */
+typedef bool ( *bus_skip_fn )( const char *dict,
+                               const char *key,
+                               char type,
+                               const dbus_v_t *v,
+                               void *userdata );
+
 int bus_print_property( const char *name, sd_bus_message *property );
 int bus_read_sv_array( dbus_sv_array_t **sv, sd_bus_message *msg );
+int bus_read_sv_array_skip( dbus_sv_array_t **sv,
+                            sd_bus_message *msg,
+                            bus_skip_fn skip,
+                            void *userdata );
 int bus_free_sv_array( dbus_sv_array_t **sv );
 int bus_print_sv_array( const dbus_sv_array_t *sv );
+const dbus_sv_t *bus_find_sv( const dbus_sv_array_t *sv, const char *key );
+
+void bus_node_v( const dbus_node_t *node, char *type, dbus_v_t *v );
+bool bus_v_equal( char type, const dbus_v_t *a, const dbus_v_t *b );
+size_t bus_v_storage_size( char type, const dbus_v_t *v );
+void bus_v_copy( dbus_v_t *dst, char type, const dbus_v_t *src, void *storage );
 
 #endif // SDE_DBUS_UTILS_H
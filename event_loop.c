@@ -0,0 +1,687 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event_loop.h"
+
+#define EV_MAX_EVENTS 32
+
+// pulseaudio marks monotonic timevals with this bit in tv_usec
+#define EV_PA_TIMEVAL_RTCLOCK ( 1U << 30 )
+
+typedef enum
+{
+    EV_SOURCE_IO,
+    EV_SOURCE_TIMER,
+    EV_SOURCE_DEFER,
+} ev_kind_t;
+
+struct ev_source
+{
+    ev_loop_t *loop;
+    ev_kind_t kind;
+    int fd; // owned for timers
+    uint32_t events;
+    bool enabled; // defer sources only
+
+    // freed sources stay allocated until the end of the current dispatch so
+    // an event that is already queued for them can be skipped safely
+    bool dead;
+
+    ev_callback_t cb;
+    void *userdata;
+    ev_source_t *next;
+};
+
+struct ev_loop
+{
+    int epfd;
+    bool quit;
+    int retval;
+
+    ev_source_t *sources;
+    bool have_dead;
+
+    pa_mainloop_api pa_api;
+};
+
+// pulseaudio glue, see pulse/mainloop-api.h
+struct pa_io_event
+{
+    ev_source_t *src;
+    pa_mainloop_api *api;
+    pa_io_event_cb_t cb;
+    void *userdata;
+    pa_io_event_destroy_cb_t destroy;
+};
+
+struct pa_time_event
+{
+    ev_source_t *src;
+    pa_mainloop_api *api;
+    struct timeval tv;
+    pa_time_event_cb_t cb;
+    void *userdata;
+    pa_time_event_destroy_cb_t destroy;
+};
+
+struct pa_defer_event
+{
+    ev_source_t *src;
+    pa_mainloop_api *api;
+    pa_defer_event_cb_t cb;
+    void *userdata;
+    pa_defer_event_destroy_cb_t destroy;
+};
+
+// function prototypes
+int ev_add_source( ev_loop_t *loop,
+                   ev_source_t **ret,
+                   ev_kind_t kind,
+                   ev_callback_t cb,
+                   void *userdata );
+void ev_reap( ev_loop_t *loop );
+void ev_pa_init( ev_loop_t *loop );
+
+/*
+ * Current time in microseconds on CLOCK_MONOTONIC.
+ */
+uint64_t ev_now( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+int ev_loop_new( ev_loop_t **ret )
+{
+    ev_loop_t *loop = calloc( 1, sizeof( *loop ) );
+    if ( !loop )
+    {
+        return -ENOMEM;
+    }
+
+    loop->epfd = epoll_create1( EPOLL_CLOEXEC );
+    if ( loop->epfd < 0 )
+    {
+        int err = errno;
+        free( loop );
+        return -err;
+    }
+
+    ev_pa_init( loop );
+    *ret = loop;
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Free the loop and every source still attached to it. Users must free their
+ * own sources (and pulseaudio contexts) first if they need destroy callbacks.
+ */
+void ev_loop_free( ev_loop_t *loop )
+{
+    if ( !loop )
+    {
+        return;
+    }
+
+    for ( ev_source_t *src = loop->sources; src; src = src->next )
+    {
+        ev_source_free( src );
+    }
+    ev_reap( loop );
+
+    close( loop->epfd );
+    free( loop );
+}
+
+void ev_loop_quit( ev_loop_t *loop, int retval )
+{
+    loop->quit = true;
+    loop->retval = retval;
+}
+
+/*
+ * Remove sources that were freed during the last dispatch.
+ */
+void ev_reap( ev_loop_t *loop )
+{
+    if ( !loop->have_dead )
+    {
+        return;
+    }
+
+    ev_source_t **link = &loop->sources;
+    while ( *link )
+    {
+        ev_source_t *src = *link;
+        if ( src->dead )
+        {
+            *link = src->next;
+            free( src );
+        }
+        else
+        {
+            link = &src->next;
+        }
+    }
+    loop->have_dead = false;
+}
+
+/*
+ * Run the loop until `ev_loop_quit()` is called.
+ *
+ * Returns: the value passed to `ev_loop_quit()`, or a negative errno if
+ * waiting failed.
+ */
+int ev_loop_run( ev_loop_t *loop )
+{
+    struct epoll_event events[EV_MAX_EVENTS];
+
+    loop->quit = false;
+    while ( !loop->quit )
+    {
+        // deferred work runs once per iteration while enabled
+        bool have_defer = false;
+        for ( ev_source_t *src = loop->sources; src; src = src->next )
+        {
+            if ( src->kind == EV_SOURCE_DEFER && src->enabled && !src->dead )
+            {
+                have_defer = true;
+                src->cb( src, 0, src->userdata );
+            }
+        }
+        ev_reap( loop );
+        if ( loop->quit )
+        {
+            break;
+        }
+
+        int n = epoll_wait( loop->epfd,
+                            events,
+                            EV_MAX_EVENTS,
+                            have_defer ? 0 : -1 );
+        if ( n < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            fprintf( stderr, "epoll_wait() failed: %s\n", strerror( errno ) );
+            return -errno;
+        }
+
+        for ( int i = 0; i < n; ++i )
+        {
+            ev_source_t *src = events[i].data.ptr;
+            if ( src->dead )
+            {
+                continue;
+            }
+
+            if ( src->kind == EV_SOURCE_TIMER )
+            {
+                // clear the expiration, timers are one shot
+                uint64_t expirations;
+                if ( read( src->fd, &expirations, sizeof( expirations ) ) < 0 )
+                {
+                    continue;
+                }
+                src->cb( src, 0, src->userdata );
+            }
+            else
+            {
+                src->cb( src, events[i].events, src->userdata );
+            }
+        }
+        ev_reap( loop );
+    }
+
+    return loop->retval;
+}
+
+int ev_add_source( ev_loop_t *loop,
+                   ev_source_t **ret,
+                   ev_kind_t kind,
+                   ev_callback_t cb,
+                   void *userdata )
+{
+    ev_source_t *src = calloc( 1, sizeof( *src ) );
+    if ( !src )
+    {
+        return -ENOMEM;
+    }
+
+    src->loop = loop;
+    src->kind = kind;
+    src->fd = -1;
+    src->cb = cb;
+    src->userdata = userdata;
+
+    src->next = loop->sources;
+    loop->sources = src;
+    *ret = src;
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Watch a file descriptor for the given epoll events. The fd is not owned by
+ * the source.
+ */
+int ev_add_io( ev_loop_t *loop,
+               ev_source_t **ret,
+               int fd,
+               uint32_t events,
+               ev_callback_t cb,
+               void *userdata )
+{
+    ev_source_t *src = NULL;
+    int r = ev_add_source( loop, &src, EV_SOURCE_IO, cb, userdata );
+    if ( r < 0 )
+    {
+        return r;
+    }
+
+    struct epoll_event ev = { .events = events, .data.ptr = src };
+    if ( epoll_ctl( loop->epfd, EPOLL_CTL_ADD, fd, &ev ) < 0 )
+    {
+        r = -errno;
+        ev_source_free( src );
+        return r;
+    }
+    src->fd = fd;
+    src->events = events;
+    *ret = src;
+
+    return EXIT_SUCCESS;
+}
+
+int ev_io_set_events( ev_source_t *src, uint32_t events )
+{
+    if ( src->events == events )
+    {
+        return EXIT_SUCCESS;
+    }
+
+    struct epoll_event ev = { .events = events, .data.ptr = src };
+    if ( epoll_ctl( src->loop->epfd, EPOLL_CTL_MOD, src->fd, &ev ) < 0 )
+    {
+        return -errno;
+    }
+    src->events = events;
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Add a one shot timer firing at the absolute monotonic time `usec`, or
+ * disarmed if `usec` is `EV_TIMER_OFF`.
+ */
+int ev_add_timer( ev_loop_t *loop,
+                  ev_source_t **ret,
+                  uint64_t usec,
+                  ev_callback_t cb,
+                  void *userdata )
+{
+    ev_source_t *src = NULL;
+    int r = ev_add_source( loop, &src, EV_SOURCE_TIMER, cb, userdata );
+    if ( r < 0 )
+    {
+        return r;
+    }
+
+    src->fd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = src };
+    if ( src->fd < 0 ||
+         epoll_ctl( loop->epfd, EPOLL_CTL_ADD, src->fd, &ev ) < 0 )
+    {
+        r = -errno;
+        ev_source_free( src );
+        return r;
+    }
+    src->events = EPOLLIN;
+
+    r = ev_timer_set( src, usec );
+    if ( r < 0 )
+    {
+        ev_source_free( src );
+        return r;
+    }
+    *ret = src;
+
+    return EXIT_SUCCESS;
+}
+
+int ev_timer_set( ev_source_t *src, uint64_t usec )
+{
+    struct itimerspec its = { 0 };
+    if ( usec != EV_TIMER_OFF )
+    {
+        // a zero it_value disarms the timer, fire as soon as possible instead
+        if ( usec == 0 )
+        {
+            usec = 1;
+        }
+        its.it_value.tv_sec = (time_t)( usec / 1000000 );
+        its.it_value.tv_nsec = (long)( usec % 1000000 ) * 1000;
+    }
+
+    if ( timerfd_settime( src->fd, TFD_TIMER_ABSTIME, &its, NULL ) < 0 )
+    {
+        return -errno;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Add a deferred callback which runs once per loop iteration while enabled.
+ * New defer sources start disabled.
+ */
+int ev_add_defer( ev_loop_t *loop,
+                  ev_source_t **ret,
+                  ev_callback_t cb,
+                  void *userdata )
+{
+    return ev_add_source( loop, ret, EV_SOURCE_DEFER, cb, userdata );
+}
+
+void ev_defer_enable( ev_source_t *src, bool enable )
+{
+    src->enabled = enable;
+}
+
+/*
+ * Detach a source from the loop. The memory is released at the end of the
+ * current dispatch, so it is safe to call from any callback.
+ */
+void ev_source_free( ev_source_t *src )
+{
+    if ( !src || src->dead )
+    {
+        return;
+    }
+
+    if ( src->fd >= 0 && src->kind != EV_SOURCE_DEFER )
+    {
+        epoll_ctl( src->loop->epfd, EPOLL_CTL_DEL, src->fd, NULL );
+    }
+    if ( src->kind == EV_SOURCE_TIMER && src->fd >= 0 )
+    {
+        close( src->fd );
+    }
+    src->fd = -1;
+    src->dead = true;
+    src->loop->have_dead = true;
+}
+
+int ev_source_get_fd( const ev_source_t *src )
+{
+    return src->fd;
+}
+
+/*
+ * pulseaudio mainloop api
+ */
+
+static uint32_t ev_pa_to_epoll( pa_io_event_flags_t flags )
+{
+    return ( flags & PA_IO_EVENT_INPUT ? EPOLLIN : 0 ) |
+           ( flags & PA_IO_EVENT_OUTPUT ? EPOLLOUT : 0 ) |
+           ( flags & PA_IO_EVENT_HANGUP ? EPOLLHUP : 0 ) |
+           ( flags & PA_IO_EVENT_ERROR ? EPOLLERR : 0 );
+}
+
+static pa_io_event_flags_t ev_epoll_to_pa( uint32_t events )
+{
+    unsigned flags = ( events & EPOLLIN ? PA_IO_EVENT_INPUT : 0 ) |
+                     ( events & EPOLLOUT ? PA_IO_EVENT_OUTPUT : 0 ) |
+                     ( events & EPOLLHUP ? PA_IO_EVENT_HANGUP : 0 ) |
+                     ( events & EPOLLERR ? PA_IO_EVENT_ERROR : 0 );
+    return (pa_io_event_flags_t)flags;
+}
+
+// convert a pulseaudio timeval (realtime or rtclock) to monotonic usec
+static uint64_t ev_pa_timeval_usec( const struct timeval *tv )
+{
+    if ( !tv )
+    {
+        return EV_TIMER_OFF;
+    }
+
+    uint64_t usec = (uint64_t)tv->tv_sec * 1000000;
+    uint64_t tv_usec = (uint64_t)tv->tv_usec;
+    if ( tv_usec & EV_PA_TIMEVAL_RTCLOCK )
+    {
+        return usec + ( tv_usec & ~(uint64_t)EV_PA_TIMEVAL_RTCLOCK );
+    }
+    usec += tv_usec;
+
+    // wall clock time, rebase onto the monotonic clock
+    struct timeval now;
+    gettimeofday( &now, NULL );
+    uint64_t now_usec = (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_usec;
+    uint64_t mono = ev_now();
+
+    return usec > now_usec ? mono + ( usec - now_usec ) : mono;
+}
+
+static void ev_pa_io_cb( ev_source_t *src, uint32_t events, void *userdata )
+{
+    pa_io_event *e = userdata;
+    e->cb( e->api, e, src->fd, ev_epoll_to_pa( events ), e->userdata );
+}
+
+static pa_io_event *ev_pa_io_new( pa_mainloop_api *api,
+                                  int fd,
+                                  pa_io_event_flags_t events,
+                                  pa_io_event_cb_t cb,
+                                  void *userdata )
+{
+    ev_loop_t *loop = api->userdata;
+    pa_io_event *e = calloc( 1, sizeof( *e ) );
+    if ( !e )
+    {
+        return NULL;
+    }
+    e->api = api;
+    e->cb = cb;
+    e->userdata = userdata;
+
+    if ( ev_add_io( loop,
+                    &e->src,
+                    fd,
+                    ev_pa_to_epoll( events ),
+                    ev_pa_io_cb,
+                    e ) < 0 )
+    {
+        free( e );
+        return NULL;
+    }
+
+    return e;
+}
+
+static void ev_pa_io_enable( pa_io_event *e, pa_io_event_flags_t events )
+{
+    ev_io_set_events( e->src, ev_pa_to_epoll( events ) );
+}
+
+static void ev_pa_io_free( pa_io_event *e )
+{
+    if ( e->destroy )
+    {
+        e->destroy( e->api, e, e->userdata );
+    }
+    ev_source_free( e->src );
+    free( e );
+}
+
+static void ev_pa_io_set_destroy( pa_io_event *e,
+                                  pa_io_event_destroy_cb_t cb )
+{
+    e->destroy = cb;
+}
+
+static void ev_pa_time_cb( ev_source_t *src, uint32_t events, void *userdata )
+{
+    (void)( src );
+    (void)( events );
+    pa_time_event *e = userdata;
+    e->cb( e->api, e, &e->tv, e->userdata );
+}
+
+static pa_time_event *ev_pa_time_new( pa_mainloop_api *api,
+                                      const struct timeval *tv,
+                                      pa_time_event_cb_t cb,
+                                      void *userdata )
+{
+    ev_loop_t *loop = api->userdata;
+    pa_time_event *e = calloc( 1, sizeof( *e ) );
+    if ( !e )
+    {
+        return NULL;
+    }
+    e->api = api;
+    e->cb = cb;
+    e->userdata = userdata;
+    if ( tv )
+    {
+        e->tv = *tv;
+    }
+
+    if ( ev_add_timer( loop,
+                       &e->src,
+                       ev_pa_timeval_usec( tv ),
+                       ev_pa_time_cb,
+                       e ) < 0 )
+    {
+        free( e );
+        return NULL;
+    }
+
+    return e;
+}
+
+static void ev_pa_time_restart( pa_time_event *e, const struct timeval *tv )
+{
+    if ( tv )
+    {
+        e->tv = *tv;
+    }
+    ev_timer_set( e->src, ev_pa_timeval_usec( tv ) );
+}
+
+static void ev_pa_time_free( pa_time_event *e )
+{
+    if ( e->destroy )
+    {
+        e->destroy( e->api, e, e->userdata );
+    }
+    ev_source_free( e->src );
+    free( e );
+}
+
+static void ev_pa_time_set_destroy( pa_time_event *e,
+                                    pa_time_event_destroy_cb_t cb )
+{
+    e->destroy = cb;
+}
+
+static void ev_pa_defer_cb( ev_source_t *src,
+                            uint32_t events,
+                            void *userdata )
+{
+    (void)( src );
+    (void)( events );
+    pa_defer_event *e = userdata;
+    e->cb( e->api, e, e->userdata );
+}
+
+static pa_defer_event *ev_pa_defer_new( pa_mainloop_api *api,
+                                        pa_defer_event_cb_t cb,
+                                        void *userdata )
+{
+    ev_loop_t *loop = api->userdata;
+    pa_defer_event *e = calloc( 1, sizeof( *e ) );
+    if ( !e )
+    {
+        return NULL;
+    }
+    e->api = api;
+    e->cb = cb;
+    e->userdata = userdata;
+
+    if ( ev_add_defer( loop, &e->src, ev_pa_defer_cb, e ) < 0 )
+    {
+        free( e );
+        return NULL;
+    }
+
+    // pulseaudio defer events start enabled
+    ev_defer_enable( e->src, true );
+
+    return e;
+}
+
+static void ev_pa_defer_enable( pa_defer_event *e, int b )
+{
+    ev_defer_enable( e->src, b );
+}
+
+static void ev_pa_defer_free( pa_defer_event *e )
+{
+    if ( e->destroy )
+    {
+        e->destroy( e->api, e, e->userdata );
+    }
+    ev_source_free( e->src );
+    free( e );
+}
+
+static void ev_pa_defer_set_destroy( pa_defer_event *e,
+                                     pa_defer_event_destroy_cb_t cb )
+{
+    e->destroy = cb;
+}
+
+static void ev_pa_quit( pa_mainloop_api *api, int retval )
+{
+    ev_loop_quit( api->userdata, retval );
+}
+
+void ev_pa_init( ev_loop_t *loop )
+{
+    pa_mainloop_api *api = &loop->pa_api;
+
+    api->userdata = loop;
+    api->io_new = ev_pa_io_new;
+    api->io_enable = ev_pa_io_enable;
+    api->io_free = ev_pa_io_free;
+    api->io_set_destroy = ev_pa_io_set_destroy;
+    api->time_new = ev_pa_time_new;
+    api->time_restart = ev_pa_time_restart;
+    api->time_free = ev_pa_time_free;
+    api->time_set_destroy = ev_pa_time_set_destroy;
+    api->defer_new = ev_pa_defer_new;
+    api->defer_enable = ev_pa_defer_enable;
+    api->defer_free = ev_pa_defer_free;
+    api->defer_set_destroy = ev_pa_defer_set_destroy;
+    api->quit = ev_pa_quit;
+}
+
+pa_mainloop_api *ev_loop_get_pa_api( ev_loop_t *loop )
+{
+    return &loop->pa_api;
+}
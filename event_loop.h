@@ -0,0 +1,62 @@
+#ifndef SDE_EVENT_LOOP_H
+#define SDE_EVENT_LOOP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pulse/mainloop-api.h>
+
+/* Single threaded epoll event loop.
+ *
+ * Every session (D-Bus connection, PulseAudio context, ...) registers its file
+ * descriptors and timers here so any number of them are served by one thread.
+ * PulseAudio contexts attach through the `pa_mainloop_api` returned by
+ * `ev_loop_get_pa_api()`.
+ *
+ * Timers are absolute times in microseconds on CLOCK_MONOTONIC (the same clock
+ * sd-bus uses for its timeouts), backed by a timerfd. `EV_TIMER_OFF` disarms a
+ * timer; an idle loop with no armed timers never wakes up.
+ */
+
+#define EV_TIMER_OFF UINT64_MAX
+
+typedef struct ev_loop ev_loop_t;
+typedef struct ev_source ev_source_t;
+
+// `events` holds the ready epoll events for io sources, 0 otherwise
+typedef void ( *ev_callback_t )( ev_source_t *src,
+                                 uint32_t events,
+                                 void *userdata );
+
+int ev_loop_new( ev_loop_t **ret );
+void ev_loop_free( ev_loop_t *loop );
+int ev_loop_run( ev_loop_t *loop );
+void ev_loop_quit( ev_loop_t *loop, int retval );
+pa_mainloop_api *ev_loop_get_pa_api( ev_loop_t *loop );
+
+int ev_add_io( ev_loop_t *loop,
+               ev_source_t **ret,
+               int fd,
+               uint32_t events,
+               ev_callback_t cb,
+               void *userdata );
+int ev_io_set_events( ev_source_t *src, uint32_t events );
+
+int ev_add_timer( ev_loop_t *loop,
+                  ev_source_t **ret,
+                  uint64_t usec,
+                  ev_callback_t cb,
+                  void *userdata );
+int ev_timer_set( ev_source_t *src, uint64_t usec );
+
+int ev_add_defer( ev_loop_t *loop,
+                  ev_source_t **ret,
+                  ev_callback_t cb,
+                  void *userdata );
+void ev_defer_enable( ev_source_t *src, bool enable );
+
+void ev_source_free( ev_source_t *src );
+int ev_source_get_fd( const ev_source_t *src );
+
+uint64_t ev_now( void );
+
+#endif // SDE_EVENT_LOOP_H
@@ -0,0 +1,748 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+#include <pulse/context.h>
+#include <pulse/error.h>
+#include <pulse/stream.h>
+#include <systemd/sd-bus.h>
+
+#include "event_loop.h"
+#include "stats.h"
+
+/* Stand-in MPRIS players and PulseAudio streams for bench.sh.
+ *
+ * Every player is its own bus connection. The first one owns the name
+ * spotify_mute watches, the others org.mpris.MediaPlayer2.spotify.decoyN, so
+ * they fill the name list and the bus without matching its signals. All of
+ * them change track RATE times a second; every AD_EVERY-th track is an ad.
+ *
+ * The streams are corked playback streams, the first one is named "Spotify".
+ * A sink takes at most 256 inputs, so with -d they are spread over the sinks
+ * bench0 .. bench(SINKS - 1).
+ *
+ * The bus and server are the default ones, DBUS_SESSION_BUS_ADDRESS and
+ * PULSE_SERVER pick private ones. "ready" is printed on stdout once every
+ * name is owned and every stream is connected or has failed.
+ */
+
+#define PLAYER_PATH "/org/mpris/MediaPlayer2"
+#define PLAYER_INTERFACE "org.mpris.MediaPlayer2.Player"
+#define SPOTIFY_NAME "org.mpris.MediaPlayer2.spotify"
+
+typedef struct
+{
+    unsigned index;
+    unsigned long track;
+    unsigned ad_every;
+    sd_bus *bus;
+    sd_bus_slot *slot;
+    ev_source_t *bus_io;
+    ev_source_t *bus_timer;
+} player_t;
+
+typedef struct
+{
+    ev_loop_t *loop;
+
+    player_t *players;
+    unsigned num_players;
+    ev_source_t *tick_timer;
+    uint64_t tick_usec;
+    unsigned ad_every;
+    FILE *log; // emission times of the Spotify player's tracks
+
+    pa_context *pa;
+    pa_stream **streams; // NULL entries failed to connect
+    unsigned num_streams;
+    unsigned num_sinks;
+    bool ready; // "ready" was printed
+} fake_t;
+
+// function prototypes
+void track_names( const player_t *player,
+                  char *trackid,
+                  char *title,
+                  size_t size );
+int player_get_metadata( sd_bus *bus,
+                         const char *path,
+                         const char *interface,
+                         const char *property,
+                         sd_bus_message *reply,
+                         void *userdata,
+                         sd_bus_error *ret_error );
+int player_get_status( sd_bus *bus,
+                       const char *path,
+                       const char *interface,
+                       const char *property,
+                       sd_bus_message *reply,
+                       void *userdata,
+                       sd_bus_error *ret_error );
+int player_bus_update( player_t *player );
+void player_bus_process( ev_source_t *src, uint32_t events, void *userdata );
+int player_open( fake_t *fake, player_t *player );
+void player_close( player_t *player );
+void tick_timeout( ev_source_t *src, uint32_t events, void *userdata );
+void streams_open( fake_t *fake );
+void streams_check( fake_t *fake );
+void stream_state_callback( pa_stream *s, void *userdata );
+void context_state_callback( pa_context *c, void *userdata );
+void quit_callback( ev_source_t *src, uint32_t events, void *userdata );
+void usage( const char *name );
+
+const sd_bus_vtable player_vtable[] = {
+    SD_BUS_VTABLE_START( 0 ),
+    SD_BUS_PROPERTY( "Metadata",
+                     "a{sv}",
+                     player_get_metadata,
+                     0,
+                     SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE ),
+    SD_BUS_PROPERTY( "PlaybackStatus",
+                     "s",
+                     player_get_status,
+                     0,
+                     SD_BUS_VTABLE_PROPERTY_CONST ),
+    SD_BUS_VTABLE_END,
+};
+
+void track_names( const player_t *player,
+                  char *trackid,
+                  char *title,
+                  size_t size )
+{
+    bool ad = player->ad_every && player->track % player->ad_every == 0;
+
+    snprintf( trackid,
+              size,
+              "spotify:%s:%u-%lu",
+              ad ? "ad" : "track",
+              player->index,
+              player->track );
+    snprintf( title,
+              size,
+              "%s %lu",
+              ad ? "Advertisement" : "Song",
+              player->track );
+}
+
+int player_get_metadata( sd_bus *bus,
+                         const char *path,
+                         const char *interface,
+                         const char *property,
+                         sd_bus_message *reply,
+                         void *userdata,
+                         sd_bus_error *ret_error )
+{
+    (void)( bus );
+    (void)( path );
+    (void)( interface );
+    (void)( property );
+    (void)( ret_error );
+    const player_t *player = userdata;
+    char trackid[64];
+    char title[64];
+
+    track_names( player, trackid, title, sizeof( trackid ) );
+    return sd_bus_message_append( reply,
+                                  "a{sv}",
+                                  3,
+                                  "mpris:trackid",
+                                  "s",
+                                  trackid,
+                                  "xesam:title",
+                                  "s",
+                                  title,
+                                  "mpris:length",
+                                  "x",
+                                  (int64_t)30 * 1000 * 1000 );
+}
+
+int player_get_status( sd_bus *bus,
+                       const char *path,
+                       const char *interface,
+                       const char *property,
+                       sd_bus_message *reply,
+                       void *userdata,
+                       sd_bus_error *ret_error )
+{
+    (void)( bus );
+    (void)( path );
+    (void)( interface );
+    (void)( property );
+    (void)( userdata );
+    (void)( ret_error );
+
+    return sd_bus_message_append( reply, "s", "Playing" );
+}
+
+/*
+ * Follow the events and timeout sd-bus wants, like session_bus_update().
+ */
+int player_bus_update( player_t *player )
+{
+    int ret = 0;
+    uint64_t timeout = 0;
+
+    ret = sd_bus_get_events( player->bus );
+    if ( ret < 0 )
+    {
+        return ret;
+    }
+
+    uint32_t events = ( ret & POLLIN ? EPOLLIN : 0 ) |
+                      ( ret & POLLOUT ? EPOLLOUT : 0 );
+    ret = ev_io_set_events( player->bus_io, events );
+    if ( ret < 0 )
+    {
+        return ret;
+    }
+
+    ret = sd_bus_get_timeout( player->bus, &timeout );
+    if ( ret < 0 )
+    {
+        return ret;
+    }
+
+    return ev_timer_set( player->bus_timer, timeout );
+}
+
+void player_bus_process( ev_source_t *src, uint32_t events, void *userdata )
+{
+    (void)( src );
+    (void)( events );
+    player_t *player = userdata;
+    int ret = 0;
+
+    while ( ( ret = sd_bus_process( player->bus, NULL ) ) > 0 )
+    {
+    }
+
+    if ( ret >= 0 )
+    {
+        ret = player_bus_update( player );
+    }
+
+    // a stand-in has nothing to recover, the run is void without it
+    if ( ret < 0 )
+    {
+        fprintf( stderr,
+                 "Player %u lost the bus: %s\n",
+                 player->index,
+                 strerror( -ret ) );
+        exit( EXIT_FAILURE );
+    }
+}
+
+/*
+ * Connect a player to the bus and take its name.
+ *
+ * Returns: 0 (`EXIT_SUCCESS`) on success, a negative errno on failure.
+ */
+int player_open( fake_t *fake, player_t *player )
+{
+    char name[64];
+    int ret = 0;
+
+    if ( player->index == 0 )
+    {
+        snprintf( name, sizeof( name ), "%s", SPOTIFY_NAME );
+    }
+    else
+    {
+        snprintf( name,
+                  sizeof( name ),
+                  SPOTIFY_NAME ".decoy%u",
+                  player->index );
+    }
+
+    ret = sd_bus_open_user( &player->bus );
+    if ( ret < 0 )
+    {
+        fprintf( stderr,
+                 "Could not connect to the bus: %s\n",
+                 strerror( -ret ) );
+        goto cleanup;
+    }
+
+    ret = sd_bus_add_object_vtable( player->bus,
+                                    &player->slot,
+                                    PLAYER_PATH,
+                                    PLAYER_INTERFACE,
+                                    player_vtable,
+                                    player );
+    if ( ret < 0 )
+    {
+        goto cleanup;
+    }
+
+    ret = sd_bus_request_name( player->bus, name, 0 );
+    if ( ret < 0 )
+    {
+        fprintf( stderr, "Could not own %s: %s\n", name, strerror( -ret ) );
+        goto cleanup;
+    }
+
+    ret = ev_add_io( fake->loop,
+                     &player->bus_io,
+                     sd_bus_get_fd( player->bus ),
+                     EPOLLIN,
+                     player_bus_process,
+                     player );
+    if ( ret < 0 )
+    {
+        goto cleanup;
+    }
+
+    ret = ev_add_timer( fake->loop,
+                        &player->bus_timer,
+                        EV_TIMER_OFF,
+                        player_bus_process,
+                        player );
+    if ( ret < 0 )
+    {
+        goto cleanup;
+    }
+
+    ret = player_bus_update( player );
+
+cleanup:
+    if ( ret < 0 )
+    {
+        player_close( player );
+    }
+
+    return ret;
+}
+
+void player_close( player_t *player )
+{
+    ev_source_free( player->bus_io );
+    ev_source_free( player->bus_timer );
+    player->bus_io = NULL;
+    player->bus_timer = NULL;
+
+    sd_bus_slot_unref( player->slot );
+    player->slot = NULL;
+    sd_bus_flush_close_unref( player->bus );
+    player->bus = NULL;
+}
+
+/*
+ * Move every player to its next track.
+ */
+void tick_timeout( ev_source_t *src, uint32_t events, void *userdata )
+{
+    (void)( events );
+    fake_t *fake = userdata;
+    char trackid[64];
+    char title[64];
+
+    for ( unsigned i = 0; i < fake->num_players; ++i )
+    {
+        player_t *player = &fake->players[i];
+
+        player->track++;
+        uint64_t now = stats_time();
+        sd_bus_emit_properties_changed( player->bus,
+                                        PLAYER_PATH,
+                                        PLAYER_INTERFACE,
+                                        "Metadata",
+                                        NULL );
+        player_bus_update( player );
+
+        if ( i == 0 && fake->log )
+        {
+            track_names( player, trackid, title, sizeof( trackid ) );
+            fprintf( fake->log,
+                     "%llu %s\n",
+                     (unsigned long long)now,
+                     trackid );
+        }
+    }
+
+    ev_timer_set( src, ev_now() + fake->tick_usec );
+}
+
+void streams_open( fake_t *fake )
+{
+    const pa_sample_spec spec = {
+        .format = PA_SAMPLE_S16LE,
+        .rate = 44100,
+        .channels = 2,
+    };
+    char name[32];
+    char sink[32];
+
+    for ( unsigned i = 0; i < fake->num_streams; ++i )
+    {
+        snprintf( name, sizeof( name ), "Decoy %u", i );
+        fake->streams[i] =
+            pa_stream_new( fake->pa, i ? name : "Spotify", &spec, NULL );
+        if ( !fake->streams[i] )
+        {
+            fprintf( stderr,
+                     "pa_stream_new() failed: %s\n",
+                     pa_strerror( pa_context_errno( fake->pa ) ) );
+            continue;
+        }
+
+        // deal the streams out evenly over the sinks
+        if ( fake->num_sinks )
+        {
+            snprintf( sink, sizeof( sink ), "bench%u", i % fake->num_sinks );
+        }
+        pa_stream_set_state_callback( fake->streams[i],
+                                      stream_state_callback,
+                                      fake );
+        if ( pa_stream_connect_playback( fake->streams[i],
+                                         fake->num_sinks ? sink : NULL,
+                                         NULL,
+                                         PA_STREAM_START_CORKED,
+                                         NULL,
+                                         NULL ) < 0 )
+        {
+            fprintf( stderr,
+                     "Could not connect stream %u: %s\n",
+                     i,
+                     pa_strerror( pa_context_errno( fake->pa ) ) );
+            pa_stream_unref( fake->streams[i] );
+            fake->streams[i] = NULL;
+        }
+    }
+
+    // in case none of them got as far as connecting
+    streams_check( fake );
+}
+
+/*
+ * Print "ready" once no stream is still connecting, the measurements would
+ * otherwise include streams showing up one by one.
+ */
+void streams_check( fake_t *fake )
+{
+    unsigned failed = 0;
+
+    if ( fake->ready )
+    {
+        return;
+    }
+
+    for ( unsigned i = 0; i < fake->num_streams; ++i )
+    {
+        if ( !fake->streams[i] )
+        {
+            failed++;
+            continue;
+        }
+
+        switch ( pa_stream_get_state( fake->streams[i] ) )
+        {
+            case PA_STREAM_READY:
+                break;
+
+            case PA_STREAM_FAILED:
+            case PA_STREAM_TERMINATED:
+                failed++;
+                break;
+
+            case PA_STREAM_UNCONNECTED:
+            case PA_STREAM_CREATING:
+            default:
+                return;
+        }
+    }
+
+    if ( failed )
+    {
+        fprintf( stderr,
+                 "%u of %u streams failed\n",
+                 failed,
+                 fake->num_streams );
+    }
+    fake->ready = true;
+    printf( "ready\n" );
+    fflush( stdout );
+}
+
+void stream_state_callback( pa_stream *s, void *userdata )
+{
+    (void)( s );
+    streams_check( userdata );
+}
+
+void context_state_callback( pa_context *c, void *userdata )
+{
+    fake_t *fake = userdata;
+
+    switch ( pa_context_get_state( c ) )
+    {
+        case PA_CONTEXT_READY:
+            streams_open( fake );
+            break;
+
+        case PA_CONTEXT_FAILED:
+        case PA_CONTEXT_TERMINATED:
+            fprintf( stderr,
+                     "Lost PulseAudio: %s\n",
+                     pa_strerror( pa_context_errno( c ) ) );
+            ev_loop_quit( fake->loop, EXIT_FAILURE );
+            break;
+
+        case PA_CONTEXT_UNCONNECTED:
+        case PA_CONTEXT_CONNECTING:
+        case PA_CONTEXT_AUTHORIZING:
+        case PA_CONTEXT_SETTING_NAME:
+        default:
+            break;
+    }
+}
+
+void quit_callback( ev_source_t *src, uint32_t events, void *userdata )
+{
+    (void)( src );
+    (void)( events );
+    fake_t *fake = userdata;
+
+    ev_loop_quit( fake->loop, EXIT_SUCCESS );
+}
+
+void usage( const char *name )
+{
+    fprintf( stderr,
+             "Usage: %s [-n PLAYERS] [-i STREAMS] [-d SINKS] [-r RATE]\n"
+             "          [-a AD_EVERY] [-t SECONDS] [-l LOG]\n"
+             "\n"
+             "  -n PLAYERS   MPRIS players, the first one is Spotify\n"
+             "               (default 1)\n"
+             "  -i STREAMS   playback streams, the first one is Spotify\n"
+             "               (default 1)\n"
+             "  -d SINKS     spread the streams over the sinks bench0 ..\n"
+             "               bench(SINKS - 1) instead of the default sink\n"
+             "  -r RATE      track changes per second of every player\n"
+             "               (default 10)\n"
+             "  -a AD_EVERY  every AD_EVERY-th track is an ad, 0 for none\n"
+             "               (default 4)\n"
+             "  -t SECONDS   exit after SECONDS instead of at SIGINT or\n"
+             "               SIGTERM\n"
+             "  -l LOG       write the time (usec) and trackid of every\n"
+             "               Spotify track change to LOG\n",
+             name );
+}
+
+int main( int argc, char **argv )
+{
+    fake_t fake = { 0 };
+    unsigned rate = 10;
+    unsigned seconds = 0;
+    const char *log_path = NULL;
+    ev_source_t *signal_src = NULL;
+    ev_source_t *quit_timer = NULL;
+    int signal_fd = -1;
+    int ret = EXIT_FAILURE;
+    int opt;
+
+    fake.num_players = 1;
+    fake.num_streams = 1;
+    fake.ad_every = 4;
+
+    while ( ( opt = getopt( argc, argv, "n:i:d:r:a:t:l:h" ) ) != -1 )
+    {
+        switch ( opt )
+        {
+            case 'n':
+                fake.num_players = (unsigned)strtoul( optarg, NULL, 10 );
+                break;
+
+            case 'i':
+                fake.num_streams = (unsigned)strtoul( optarg, NULL, 10 );
+                break;
+
+            case 'd':
+                fake.num_sinks = (unsigned)strtoul( optarg, NULL, 10 );
+                break;
+
+            case 'r':
+                rate = (unsigned)strtoul( optarg, NULL, 10 );
+                break;
+
+            case 'a':
+                fake.ad_every = (unsigned)strtoul( optarg, NULL, 10 );
+                break;
+
+            case 't':
+                seconds = (unsigned)strtoul( optarg, NULL, 10 );
+                break;
+
+            case 'l':
+                log_path = optarg;
+                break;
+
+            case 'h':
+            default:
+                usage( argv[0] );
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if ( !rate )
+    {
+        usage( argv[0] );
+        return EXIT_FAILURE;
+    }
+    fake.tick_usec = 1000000 / rate;
+
+    // a bus connection and a timer per player
+    struct rlimit nofile;
+    if ( getrlimit( RLIMIT_NOFILE, &nofile ) == 0 )
+    {
+        nofile.rlim_cur = nofile.rlim_max;
+        setrlimit( RLIMIT_NOFILE, &nofile );
+    }
+
+    if ( log_path )
+    {
+        fake.log = fopen( log_path, "w" );
+        if ( !fake.log )
+        {
+            fprintf( stderr,
+                     "Could not open %s: %s\n",
+                     log_path,
+                     strerror( errno ) );
+            goto cleanup;
+        }
+    }
+
+    if ( ev_loop_new( &fake.loop ) < 0 )
+    {
+        goto cleanup;
+    }
+
+    sigset_t mask;
+    sigemptyset( &mask );
+    sigaddset( &mask, SIGINT );
+    sigaddset( &mask, SIGTERM );
+    sigprocmask( SIG_BLOCK, &mask, NULL );
+    signal_fd = signalfd( -1, &mask, SFD_NONBLOCK | SFD_CLOEXEC );
+    if ( signal_fd < 0 ||
+         ev_add_io( fake.loop,
+                    &signal_src,
+                    signal_fd,
+                    EPOLLIN,
+                    quit_callback,
+                    &fake ) < 0 )
+    {
+        goto cleanup;
+    }
+
+    if ( seconds &&
+         ev_add_timer( fake.loop,
+                       &quit_timer,
+                       ev_now() + seconds * 1000000ULL,
+                       quit_callback,
+                       &fake ) < 0 )
+    {
+        goto cleanup;
+    }
+
+    fake.players = calloc( fake.num_players, sizeof( *fake.players ) );
+    fake.streams = calloc( fake.num_streams + 1, sizeof( *fake.streams ) );
+    if ( !fake.players || !fake.streams )
+    {
+        goto cleanup;
+    }
+
+    for ( unsigned i = 0; i < fake.num_players; ++i )
+    {
+        fake.players[i].index = i;
+        fake.players[i].ad_every = fake.ad_every;
+        if ( player_open( &fake, &fake.players[i] ) < 0 )
+        {
+            // only close the ones that were opened
+            fake.num_players = i;
+            goto cleanup;
+        }
+    }
+
+    if ( ev_add_timer( fake.loop,
+                       &fake.tick_timer,
+                       ev_now() + fake.tick_usec,
+                       tick_timeout,
+                       &fake ) < 0 )
+    {
+        goto cleanup;
+    }
+
+    if ( fake.num_streams )
+    {
+        fake.pa = pa_context_new( ev_loop_get_pa_api( fake.loop ),
+                                  "spotify_mute_fakeplayer" );
+        if ( !fake.pa )
+        {
+            goto cleanup;
+        }
+        pa_context_set_state_callback( fake.pa,
+                                       context_state_callback,
+                                       &fake );
+        if ( pa_context_connect( fake.pa, NULL, PA_CONTEXT_NOFLAGS, NULL ) < 0 )
+        {
+            fprintf( stderr,
+                     "Could not connect to PulseAudio: %s\n",
+                     pa_strerror( pa_context_errno( fake.pa ) ) );
+            goto cleanup;
+        }
+    }
+    else
+    {
+        printf( "ready\n" );
+        fflush( stdout );
+    }
+
+    ret = ev_loop_run( fake.loop ) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+cleanup:
+    for ( unsigned i = 0; fake.streams && i < fake.num_streams; ++i )
+    {
+        if ( fake.streams[i] )
+        {
+            pa_stream_disconnect( fake.streams[i] );
+            pa_stream_unref( fake.streams[i] );
+        }
+    }
+    free( fake.streams );
+    if ( fake.pa )
+    {
+        pa_context_disconnect( fake.pa );
+        pa_context_unref( fake.pa );
+    }
+
+    for ( unsigned i = 0; fake.players && i < fake.num_players; ++i )
+    {
+        player_close( &fake.players[i] );
+    }
+    free( fake.players );
+
+    ev_source_free( fake.tick_timer );
+    ev_source_free( quit_timer );
+    ev_source_free( signal_src );
+    if ( signal_fd >= 0 )
+    {
+        close( signal_fd );
+    }
+    ev_loop_free( fake.loop );
+
+    if ( fake.log )
+    {
+        fclose( fake.log );
+    }
+
+    return ret;
+}
@@ -0,0 +1,357 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fingerprint.h"
+
+// power spectrum index ranges of the peak bands, roughly octaves
+const int fp_band_edge[FP_BANDS + 1] = { 0, 8, 16, 32, 64, 128, AL_FFT_BINS };
+
+// function prototypes
+void fp_find_peaks( fp_extractor_t *ex, fp_peaks_t *peaks );
+void fp_analyse( fp_extractor_t *ex, fp_hash_cb cb, void *userdata );
+void fp_matcher_hash( uint32_t hash, uint32_t window, void *userdata );
+void fp_matcher_vote( fp_matcher_t *m,
+                      uint16_t clip,
+                      uint32_t shift,
+                      uint32_t window );
+
+void fp_extractor_init( fp_extractor_t *ex )
+{
+    memset( ex, 0, sizeof( *ex ) );
+    al_spectrum_init( &ex->spectrum );
+}
+
+void fp_extractor_reset( fp_extractor_t *ex )
+{
+    ex->window_len = 0;
+    ex->windows = 0;
+    memset( ex->peaks, 0, sizeof( ex->peaks ) );
+}
+
+/*
+ * Keep the strongest bin of each band if it stands out of the band.
+ */
+void fp_find_peaks( fp_extractor_t *ex, fp_peaks_t *peaks )
+{
+    peaks->count = 0;
+    for ( int b = 0; b < FP_BANDS; ++b )
+    {
+        int lo = fp_band_edge[b];
+        int hi = fp_band_edge[b + 1];
+        int best = lo;
+        float sum = 0.0f;
+
+        for ( int k = lo; k < hi; ++k )
+        {
+            sum += ex->power[k];
+            if ( ex->power[k] > ex->power[best] )
+            {
+                best = k;
+            }
+        }
+
+        // at least 10 dB over the band average, noise rarely gets there
+        float peak = ex->power[best];
+        if ( peak > FP_MIN_POWER && peak * (float)( hi - lo ) > 10.0f * sum )
+        {
+            peaks->bin[peaks->count++] = (uint8_t)( best + 1 );
+        }
+    }
+}
+
+/*
+ * Find the peaks of the full window and hash them against earlier peaks.
+ */
+void fp_analyse( fp_extractor_t *ex, fp_hash_cb cb, void *userdata )
+{
+    uint32_t t = ex->windows++;
+    fp_peaks_t *cur = &ex->peaks[t % FP_ZONE];
+
+    al_spectrum_power( &ex->spectrum, ex->window, ex->power );
+
+    // the slot held window t - FP_ZONE, which is out of reach by now
+    fp_find_peaks( ex, cur );
+
+    for ( int p = 0; p < cur->count; ++p )
+    {
+        int fanout = 0;
+        for ( uint32_t dt = FP_MIN_DT;
+              dt < FP_ZONE && dt <= t && fanout < FP_FANOUT;
+              ++dt )
+        {
+            const fp_peaks_t *anchors = &ex->peaks[( t - dt ) % FP_ZONE];
+            for ( int a = 0; a < anchors->count && fanout < FP_FANOUT; ++a )
+            {
+                // a held note hashes the same at every shift and would
+                // vote for anything that holds the same note
+                if ( abs( anchors->bin[a] - cur->bin[p] ) <= 1 )
+                {
+                    continue;
+                }
+
+                uint32_t hash = (uint32_t)anchors->bin[a] << 13 |
+                                (uint32_t)cur->bin[p] << 5 | dt;
+                cb( hash, t - dt, userdata );
+                fanout++;
+            }
+        }
+    }
+
+    // slide by one hop
+    memmove( ex->window,
+             ex->window + FP_HOP,
+             ( AL_FFT_SIZE - FP_HOP ) * sizeof( float ) );
+    ex->window_len = AL_FFT_SIZE - FP_HOP;
+}
+
+/*
+ * Fingerprint `frames` interleaved stereo float frames, calling `cb` with
+ * every hash and the window of its earlier peak.
+ */
+void fp_extract( fp_extractor_t *ex,
+                 const float *samples,
+                 size_t frames,
+                 fp_hash_cb cb,
+                 void *userdata )
+{
+    while ( frames )
+    {
+        size_t n = AL_FFT_SIZE - ex->window_len;
+        if ( n > frames )
+        {
+            n = frames;
+        }
+
+        al_downmix( samples, ex->window + ex->window_len, n );
+        ex->window_len += (uint32_t)n;
+        samples += n * AL_CHANNELS;
+        frames -= n;
+
+        if ( ex->window_len == AL_FFT_SIZE )
+        {
+            fp_analyse( ex, cb, userdata );
+        }
+    }
+}
+
+/*
+ * Map the index at `path` read-only.
+ *
+ * Returns: 0 (`EXIT_SUCCESS`) on success, a negative errno on failure.
+ */
+int fp_index_open( fp_index_t *index, const char *path )
+{
+    int ret = 0;
+    struct stat st;
+
+    memset( index, 0, sizeof( *index ) );
+    index->map = MAP_FAILED;
+
+    int fd = open( path, O_RDONLY | O_CLOEXEC );
+    if ( fd < 0 || fstat( fd, &st ) < 0 )
+    {
+        ret = -errno;
+        fprintf( stderr, "Could not open %s: %s\n", path, strerror( -ret ) );
+        goto cleanup;
+    }
+    if ( st.st_size < FP_HEADER_SIZE )
+    {
+        ret = -EINVAL;
+        goto cleanup;
+    }
+
+    index->map_size = (size_t)st.st_size;
+    index->map = mmap( NULL, index->map_size, PROT_READ, MAP_SHARED, fd, 0 );
+    if ( index->map == MAP_FAILED )
+    {
+        ret = -errno;
+        fprintf( stderr, "Could not map %s: %s\n", path, strerror( -ret ) );
+        goto cleanup;
+    }
+
+    index->header = index->map;
+    if ( memcmp( index->header->magic,
+                 FP_MAGIC,
+                 sizeof( index->header->magic ) ) != 0 ||
+         index->header->version != FP_VERSION )
+    {
+        ret = -EINVAL;
+        goto cleanup;
+    }
+
+    // the counts come from the file, size the sections without overflowing
+    uint64_t num_clips = index->header->num_clips;
+    uint64_t count = index->header->count;
+    size_t rest = index->map_size - FP_HEADER_SIZE;
+    if ( num_clips > rest / sizeof( fp_clip_t ) )
+    {
+        ret = -EINVAL;
+        goto cleanup;
+    }
+    rest -= num_clips * sizeof( fp_clip_t );
+    if ( rest % sizeof( fp_entry_t ) != 0 ||
+         count != rest / sizeof( fp_entry_t ) )
+    {
+        ret = -EINVAL;
+        goto cleanup;
+    }
+
+    index->clips =
+        (const fp_clip_t *)(const void *)( (const char *)index->map +
+                                           FP_HEADER_SIZE );
+    index->entries =
+        (const fp_entry_t *)(const void *)( index->clips + num_clips );
+
+    // the matcher indexes the clips with these, check them once up front
+    for ( uint64_t i = 0; i < num_clips; ++i )
+    {
+        if ( !memchr( index->clips[i].name, '\0', FP_CLIP_NAME_LEN ) )
+        {
+            ret = -EINVAL;
+            goto cleanup;
+        }
+    }
+    for ( uint64_t i = 0; i < count; ++i )
+    {
+        if ( index->entries[i].clip >= num_clips )
+        {
+            ret = -EINVAL;
+            goto cleanup;
+        }
+    }
+
+cleanup:
+    if ( fd >= 0 )
+    {
+        close( fd );
+    }
+    if ( ret == -EINVAL )
+    {
+        fprintf( stderr, "Error: %s is not a fingerprint index\n", path );
+    }
+    if ( ret < 0 )
+    {
+        fp_index_close( index );
+    }
+
+    return ret;
+}
+
+void fp_index_close( fp_index_t *index )
+{
+    if ( index->map && index->map != MAP_FAILED )
+    {
+        munmap( index->map, index->map_size );
+    }
+    memset( index, 0, sizeof( *index ) );
+}
+
+void fp_matcher_init( fp_matcher_t *m, const fp_index_t *index )
+{
+    fp_extractor_init( &m->extractor );
+    m->index = index;
+    fp_matcher_reset( m );
+}
+
+void fp_matcher_reset( fp_matcher_t *m )
+{
+    fp_extractor_reset( &m->extractor );
+    memset( m->votes, 0, sizeof( m->votes ) );
+    m->match = -1;
+}
+
+/*
+ * Count a hit for `clip` at time `shift`. Votes that are older than the
+ * vote window are recycled.
+ */
+void fp_matcher_vote( fp_matcher_t *m,
+                      uint16_t clip,
+                      uint32_t shift,
+                      uint32_t window )
+{
+    fp_vote_t *vote =
+        &m->votes[( clip * 2654435761u ^ shift ) % FP_VOTE_SLOTS];
+
+    if ( vote->count && vote->clip == clip && vote->shift == shift &&
+         window - vote->first <= FP_VOTE_WINDOWS )
+    {
+        vote->count++;
+    }
+    else
+    {
+        vote->clip = clip;
+        vote->shift = shift;
+        vote->first = window;
+        vote->count = 1;
+    }
+
+    if ( vote->count >= FP_MIN_VOTES )
+    {
+        m->match = clip;
+    }
+}
+
+/*
+ * Look up one hash of the stream and vote for every clip that has it.
+ */
+void fp_matcher_hash( uint32_t hash, uint32_t window, void *userdata )
+{
+    fp_matcher_t *m = userdata;
+    const fp_entry_t *entries = m->index->entries;
+    uint64_t lo = 0;
+    uint64_t hi = m->index->header->count;
+
+    if ( m->match >= 0 )
+    {
+        return;
+    }
+
+    // first entry with this hash
+    while ( lo < hi )
+    {
+        uint64_t mid = lo + ( hi - lo ) / 2;
+        if ( entries[mid].hash < hash )
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    uint64_t end = m->index->header->count;
+    for ( int n = 0; lo < end && entries[lo].hash == hash && n < FP_MAX_HITS;
+          ++lo, ++n )
+    {
+        fp_matcher_vote( m,
+                         entries[lo].clip,
+                         window - entries[lo].window,
+                         window );
+    }
+}
+
+/*
+ * Feed stream audio to the matcher. Once a clip matched nothing is analysed
+ * until `fp_matcher_reset()`.
+ *
+ * Returns: true when a clip matched with these frames.
+ */
+bool fp_matcher_feed( fp_matcher_t *m, const float *samples, size_t frames )
+{
+    if ( m->match >= 0 )
+    {
+        return false;
+    }
+
+    fp_extract( &m->extractor, samples, frames, fp_matcher_hash, m );
+    return m->match >= 0;
+}
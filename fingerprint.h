@@ -0,0 +1,129 @@
+#ifndef SDE_FINGERPRINT_H
+#define SDE_FINGERPRINT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "audio_level.h"
+
+/* Acoustic fingerprints of known ad jingles.
+ *
+ * The stream is cut into `AL_FFT_SIZE` windows every `FP_HOP` frames (5.8 ms)
+ * and the strongest spectral peak of each frequency band is kept. Each new
+ * peak is paired with at most `FP_FANOUT` earlier peaks no more than
+ * `FP_ZONE` windows back, and every pair is hashed from both frequencies and
+ * their distance in windows. Hashes are the same wherever the jingle starts.
+ *
+ * The index maps hashes to the clip and window they were seen at, sorted by
+ * hash so it can be memory mapped and binary searched as is. A clip matches
+ * once `FP_MIN_VOTES` hashes agree on the same clip and time shift within
+ * `FP_VOTE_WINDOWS` (~300 ms).
+ *
+ * Every window costs at most `FP_MAX_PEAKS * FP_FANOUT` lookups of
+ * O(log n) and `FP_MAX_HITS` votes each, whatever the index holds.
+ */
+
+#define FP_HOP ( AL_FFT_SIZE / 2 )
+#define FP_BANDS 6
+#define FP_MAX_PEAKS FP_BANDS
+#define FP_ZONE 32 // windows, a power of two
+#define FP_MIN_DT 2
+#define FP_FANOUT 5
+#define FP_MAX_HITS 16
+#define FP_MIN_POWER 0.01f // about -60 dBFS for a sine
+#define FP_VOTE_SLOTS 64
+#define FP_VOTE_WINDOWS ( AL_RATE * 3 / 10 / FP_HOP )
+#define FP_MIN_VOTES 8
+
+#define FP_MAGIC "SMFPIDX1"
+#define FP_VERSION 1
+#define FP_HEADER_SIZE 64
+#define FP_CLIP_NAME_LEN 60
+#define FP_MAX_CLIPS UINT16_MAX
+#define FP_MAX_CLIP_WINDOWS UINT16_MAX
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t num_clips;
+    uint64_t count; // number of entries
+} fp_header_t;
+
+typedef struct
+{
+    char name[FP_CLIP_NAME_LEN];
+    uint32_t windows;
+} fp_clip_t;
+
+typedef struct
+{
+    uint32_t hash;
+    uint16_t clip;
+    uint16_t window; // of the earlier peak, from the start of the clip
+} fp_entry_t;
+
+/* Memory mapped index file: header, clips, then entries sorted by hash. */
+typedef struct
+{
+    void *map;
+    size_t map_size;
+    const fp_header_t *header;
+    const fp_clip_t *clips;
+    const fp_entry_t *entries;
+} fp_index_t;
+
+typedef void ( *fp_hash_cb )( uint32_t hash, uint32_t window, void *userdata );
+
+typedef struct
+{
+    uint8_t bin[FP_MAX_PEAKS];
+    uint8_t count;
+} fp_peaks_t;
+
+typedef struct
+{
+    al_spectrum_t spectrum;
+
+    // the last AL_FFT_SIZE mono samples
+    float window[AL_FFT_SIZE];
+    uint32_t window_len;
+    float power[AL_FFT_BINS];
+
+    uint32_t windows; // windows analysed so far
+    fp_peaks_t peaks[FP_ZONE];
+} fp_extractor_t;
+
+typedef struct
+{
+    uint16_t clip;
+    uint16_t count;
+    uint32_t shift;
+    uint32_t first;
+} fp_vote_t;
+
+typedef struct
+{
+    fp_extractor_t extractor;
+    const fp_index_t *index;
+    fp_vote_t votes[FP_VOTE_SLOTS];
+    int match; // clip index, -1 until a clip matched
+} fp_matcher_t;
+
+void fp_extractor_init( fp_extractor_t *ex );
+void fp_extractor_reset( fp_extractor_t *ex );
+void fp_extract( fp_extractor_t *ex,
+                 const float *samples,
+                 size_t frames,
+                 fp_hash_cb cb,
+                 void *userdata );
+
+int fp_index_open( fp_index_t *index, const char *path );
+void fp_index_close( fp_index_t *index );
+
+void fp_matcher_init( fp_matcher_t *m, const fp_index_t *index );
+void fp_matcher_reset( fp_matcher_t *m );
+bool fp_matcher_feed( fp_matcher_t *m, const float *samples, size_t frames );
+
+#endif // SDE_FINGERPRINT_H
@@ -0,0 +1,179 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fingerprint.h"
+
+/* Offline builder for the fingerprint index read by spotify_mute -F.
+ *
+ * Every clip is raw interleaved stereo float at 44.1 kHz, for example
+ *     ffmpeg -i jingle.mp3 -f f32le -ac 2 -ar 44100 jingle.raw
+ * The hashes of all clips are sorted once here so the daemon only has to map
+ * the file and binary search it.
+ */
+
+typedef struct
+{
+    fp_entry_t *entries;
+    uint64_t count;
+    uint64_t capacity;
+    uint16_t clip;
+    int error;
+} fp_builder_t;
+
+// function prototypes
+void build_hash( uint32_t hash, uint32_t window, void *userdata );
+int compare_entry( const void *a, const void *b );
+int build_clip( fp_builder_t *b, fp_extractor_t *ex, const char *path );
+
+void build_hash( uint32_t hash, uint32_t window, void *userdata )
+{
+    fp_builder_t *b = userdata;
+
+    if ( b->error || window > FP_MAX_CLIP_WINDOWS )
+    {
+        return;
+    }
+
+    if ( b->count == b->capacity )
+    {
+        uint64_t capacity = b->capacity ? b->capacity * 2 : 65536;
+        fp_entry_t *entries =
+            realloc( b->entries, capacity * sizeof( *entries ) );
+        if ( !entries )
+        {
+            b->error = -ENOMEM;
+            return;
+        }
+        b->entries = entries;
+        b->capacity = capacity;
+    }
+
+    b->entries[b->count++] = ( fp_entry_t ){ .hash = hash,
+                                             .clip = b->clip,
+                                             .window = (uint16_t)window };
+}
+
+int compare_entry( const void *a, const void *b )
+{
+    const fp_entry_t *x = a;
+    const fp_entry_t *y = b;
+    if ( x->hash != y->hash )
+    {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    if ( x->clip != y->clip )
+    {
+        return x->clip < y->clip ? -1 : 1;
+    }
+    return ( x->window > y->window ) - ( x->window < y->window );
+}
+
+/*
+ * Fingerprint one clip into the builder.
+ *
+ * Returns: the number of windows in the clip, a negative errno on failure.
+ */
+int build_clip( fp_builder_t *b, fp_extractor_t *ex, const char *path )
+{
+    float buf[4096 * AL_CHANNELS];
+    size_t frames = 0;
+
+    FILE *f = fopen( path, "rb" );
+    if ( !f )
+    {
+        int ret = -errno;
+        fprintf( stderr, "Could not open %s: %s\n", path, strerror( -ret ) );
+        return ret;
+    }
+
+    fp_extractor_reset( ex );
+    while ( ( frames = fread( buf, sizeof( float ) * AL_CHANNELS, 4096, f ) ) )
+    {
+        fp_extract( ex, buf, frames, build_hash, b );
+    }
+    fclose( f );
+
+    return b->error ? b->error : (int)ex->windows;
+}
+
+int main( int argc, char **argv )
+{
+    int ret = EXIT_FAILURE;
+    FILE *out = NULL;
+    fp_clip_t *clips = NULL;
+    fp_builder_t b = { 0 };
+    static fp_extractor_t ex;
+
+    if ( argc < 3 || argc > FP_MAX_CLIPS + 2 )
+    {
+        fprintf( stderr, "Usage: %s INDEX_FILE CLIP.raw...\n", argv[0] );
+        goto cleanup;
+    }
+
+    int num_clips = argc - 2;
+    clips = calloc( (size_t)num_clips, sizeof( *clips ) );
+    if ( !clips )
+    {
+        goto cleanup;
+    }
+
+    fp_extractor_init( &ex );
+    for ( int i = 0; i < num_clips; ++i )
+    {
+        const char *path = argv[i + 2];
+        const char *name = strrchr( path, '/' );
+        name = name ? name + 1 : path;
+
+        b.clip = (uint16_t)i;
+        int windows = build_clip( &b, &ex, path );
+        if ( windows < 0 )
+        {
+            goto cleanup;
+        }
+
+        strncpy( clips[i].name, name, FP_CLIP_NAME_LEN - 1 );
+        clips[i].windows = (uint32_t)windows;
+        printf( "%s: %d windows\n", name, windows );
+    }
+
+    qsort( b.entries, b.count, sizeof( *b.entries ), compare_entry );
+
+    fp_header_t header = { .version = FP_VERSION,
+                           .num_clips = (uint32_t)num_clips,
+                           .count = b.count };
+    memcpy( header.magic, FP_MAGIC, sizeof( header.magic ) );
+    char pad[FP_HEADER_SIZE - sizeof( header )] = { 0 };
+
+    out = fopen( argv[1], "wb" );
+    if ( !out || fwrite( &header, sizeof( header ), 1, out ) != 1 ||
+         fwrite( pad, sizeof( pad ), 1, out ) != 1 ||
+         fwrite( clips, sizeof( *clips ), (size_t)num_clips, out ) !=
+             (size_t)num_clips ||
+         fwrite( b.entries, sizeof( *b.entries ), b.count, out ) != b.count )
+    {
+        fprintf( stderr,
+                 "Could not write %s: %s\n",
+                 argv[1],
+                 strerror( errno ) );
+        goto cleanup;
+    }
+
+    printf( "%llu hashes from %d clips\n",
+            (unsigned long long)b.count,
+            num_clips );
+    ret = EXIT_SUCCESS;
+
+cleanup:
+    if ( out && fclose( out ) != 0 )
+    {
+        ret = EXIT_FAILURE;
+    }
+    free( clips );
+    free( b.entries );
+
+    return ret;
+}
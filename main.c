@@ -1,7 +1,14 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <unistd.h>
 
 // The implementation to read what spotify is playing should be refactored out
@@ -9,10 +16,21 @@
 // how we should talk to it For this we use the systemd dbus API (sd-bus)
 #include <systemd/sd-bus.h>
 
+#include "adset.h"
+#include "alloc.h"
+#include "audio_level.h"
+#include "control.h"
 #include "dbus_utils.h"
+#include "event_loop.h"
+#include "fingerprint.h"
+#include "metadata_cache.h"
+#include "ndjson.h"
+#include "probes.h"
+#include "statepage.h"
+#include "stats.h"
 
-// include pulse audio so we can mute spotify
-#include "pactl.h"
+// the sound server backends, to mute spotify
+#include "audio_backend.h"
 
 // We need to implement functions to read about Spotify on dbus using the
 // org.mpris.MediaPlayer2 Interface.
@@ -29,248 +47,1993 @@ const char *spotify_dbus_name = "org.mpris.MediaPlayer2.spotify";
 const char *spotify_dbus_path = "/org/mpris/MediaPlayer2";
 const char *spotify_dbus_interface = "org.mpris.MediaPlayer2.Player";
 
-/* Check if Spotify is availible on dbus
+// PropertiesChanged bursts within this window are evaluated once (usec)
+uint64_t coalesce_usec = 20000;
+
+// longest window -c accepts (msec)
+#define COALESCE_MAX_MSEC 60000
+
+// also mute on the level of the Spotify stream itself
+bool audio_detect = false;
+
+// add the ads the level detector caught to the ad set, not only jingles
+bool remember_heard = false;
+
+// sound server backend of every session, see audio_backend.h
+const audio_backend_t *audio_backend = NULL;
+
+// cache key holding the audio detector's verdict for the current track
+#define AUDIO_AD_KEY "spotify_mute:audio-ad"
+
+// cache key set when the stream matched a known ad jingle
+#define JINGLE_KEY "spotify_mute:jingle"
+
+// bus reconnect backoff, doubled after every failed attempt
+#define SESSION_RETRY_MIN_USEC ( 500 * 1000ULL )
+#define SESSION_RETRY_MAX_USEC ( 60 * 1000 * 1000ULL )
+
+/* A session is one user's D-Bus session bus paired with that user's
+ * PulseAudio server. All sessions share the event loop, so each one only
+ * costs its connections and this structure.
+ */
+typedef struct
+{
+    char *bus_address; // NULL for the default user bus
+    char *pa_server;   // NULL for the default server
+    const char *uid;   // the server is the user's one, unless -p is given
+
+    ev_loop_t *loop;
+    sd_bus *bus;
+    sd_bus_slot *slot;
+    sd_bus_slot *owner_slot;
+    sd_bus_slot *names_call;    // outstanding calls, unref cancels them
+    sd_bus_slot *metadata_call;
+    ev_source_t *bus_io;
+    ev_source_t *bus_timer;
+
+    // bus reconnect, only armed while the bus is unreachable
+    ev_source_t *retry_timer;
+    uint64_t retry_usec;
+    bool player_present;
+
+    // deadline for the pending burst of property changes
+    ev_source_t *coalesce_timer;
+    bool coalesce_pending;
+
+    audio_ctl_t *mixer;
+    md_cache_t cache;
+    int muted;
+    int ad;     // decision of the rules, -1 until there is one
+    uint8_t ad_signals; // stats_ad_t behind the decision
+    int forced; // mute state forced over the control socket, -1 for none
+    bool paused; // keep the current mute state whatever the rules decide
+    uint32_t track_version; // cache version of the last trackid seen
+
+    // audio level detector, NULL when disabled
+    al_detector_t *audio;
+
+    // known ad trackids, NULL when disabled
+    adset_t *ads;
+    char *remember; // ad waiting to be added once the mute request is out
+    ev_source_t *ads_timer;
+
+    // jingle matcher, NULL when no fingerprint index is loaded
+    const fp_index_t *jingles;
+    fp_matcher_t *fp;
+
+    // statistics, NULL when disabled
+    stats_t *stats;
+    stats_record_t track; // record of the current track, time 0 for none
+    uint16_t index;
+    uint64_t muted_since;
+
+    // control socket for state changes, NULL when disabled
+    control_t *control;
+
+    // shared memory state page, NULL when disabled
+    statepage_t *page;
+
+    // machine readable event output, NULL when disabled
+    ndjson_t *events;
+} session_t;
+
+// userdata of the control socket
+typedef struct
+{
+    session_t *sessions;
+    int num_sessions;
+} control_ctx_t;
+
+/* Check if Spotify is availible in the reply to a ListNames call
  * if it is avalible then return a positive value (indicating the number of
  * avalible interfaces).
  *
- * Accepts a string array pointer as an output parameter. Set to NULL if the
- * names of the spotify interfaces are unneeded.
- * Returns heap allocated memory which needs to be cleaned by the user with
- * free(). The memory is allocated contigously, so only single free is required.
- *
  * Returns: 0 for no spotify interfaces, a positive number (probably 1) for the
- * number of spotify instances avalible and -1 for a connection error
+ * number of spotify instances avalible and a negative errno for a bad reply
  */
-int is_spotify_availible( sd_bus *bus_ptr, char ***instance_names );
+int is_spotify_availible( sd_bus_message *reply );
 
-int spotify_get_metadata( sd_bus *bus_ptr, dbus_sv_array_t **metadata );
+int spotify_request_names( session_t *session );
+int spotify_names_reply( sd_bus_message *msg,
+                         void *userdata,
+                         sd_bus_error *ret_error );
+int spotify_request_metadata( session_t *session );
+int spotify_metadata_reply( sd_bus_message *msg,
+                            void *userdata,
+                            sd_bus_error *ret_error );
 
 int spotify_send_command( sd_bus *bus_ptr,
                           const char ***instance_names,
                           const char *command );
 
-int is_spotify_availible( sd_bus *bus_ptr, char ***instance_names )
+int spotify_properties_changed( sd_bus_message *msg,
+                                void *userdata,
+                                sd_bus_error *ret_error );
+bool spotify_value_unchanged( const char *dict,
+                              const char *key,
+                              char type,
+                              const dbus_v_t *v,
+                              void *userdata );
+
+void ad_rule( md_cache_t *cache, void *userdata );
+bool cache_flag( md_cache_t *cache, const char *key );
+bool session_known_ad( session_t *session, const char *trackid );
+void session_reset_audio( session_t *session );
+bool session_update_mute( session_t *session );
+void session_describe( session_t *session,
+                       const char *what,
+                       char *buf,
+                       size_t size );
+void session_notify( session_t *session );
+bool session_event( session_t *session, const char *event );
+void session_mute_result( int success,
+                          uint64_t latency_usec,
+                          void *userdata );
+void control_command( control_client_t *client, char *line, void *userdata );
+bool is_ad_trackid( const char *track_name );
+void session_flush( session_t *session );
+void session_audio( const float *samples, size_t frames, void *userdata );
+void session_coalesce_timeout( ev_source_t *src,
+                               uint32_t events,
+                               void *userdata );
+void session_remember( session_t *session, const char *trackid );
+void session_ads_flush( session_t *session );
+void session_ads_timeout( ev_source_t *src, uint32_t events, void *userdata );
+void session_log( session_t *session,
+                  stats_type_t type,
+                  const char *trackid,
+                  uint8_t ad );
+void session_log_track( session_t *session );
+
+int session_open_bus( session_t *session );
+int session_connect( session_t *session );
+void session_disconnect( session_t *session );
+void session_schedule_retry( session_t *session );
+void session_retry_timeout( ev_source_t *src, uint32_t events, void *userdata );
+void session_player_appeared( session_t *session );
+void session_player_vanished( session_t *session );
+int session_owner_changed( sd_bus_message *msg,
+                           void *userdata,
+                           sd_bus_error *ret_error );
+int session_start( session_t *session, ev_loop_t *loop );
+void session_stop( session_t *session );
+int session_bus_update( session_t *session );
+void session_bus_process( ev_source_t *src, uint32_t events, void *userdata );
+void signal_callback( ev_source_t *src, uint32_t events, void *userdata );
+
+int is_spotify_availible( sd_bus_message *reply )
 {
-    char **bus_names = NULL;
-    char **spotify_instances = NULL;
+    const char *media_player_substr = "org.mpris.MediaPlayer2";
+    const char *name = NULL;
     int num_instances = 0;
-
     int ret = 0;
 
-    // call dbus to list the objects availibe
-    ret = sd_bus_list_names( bus_ptr, &bus_names, NULL );
+    ret = sd_bus_message_enter_container( reply, SD_BUS_TYPE_ARRAY, "s" );
     if ( ret < 0 )
     {
-        fprintf( stderr,
-                 "Error getting user bus names: %s\n",
-                 strerror( -ret ) );
-        goto cleanup;
+        return ret;
     }
 
-    // loop through and list all names
-    for ( int i = 0; bus_names[i]; ++i )
+    // loop through and list all media players, counting the spotify ones
+    while ( ( ret = sd_bus_message_read( reply, "s", &name ) ) > 0 )
     {
-        const char *media_player_substr = "org.mpris.MediaPlayer2";
         if ( strncmp( media_player_substr,
-                      bus_names[i],
+                      name,
                       strlen( media_player_substr ) ) == 0 )
         {
-            printf( "media instance: %s\n", bus_names[i] );
+            printf( "media instance: %s\n", name );
         }
 
         // check if spotify is on the bus
-        if ( strcmp( spotify_dbus_name, bus_names[i] ) == 0 )
+        if ( strcmp( spotify_dbus_name, name ) == 0 )
         {
-            // this is techinically unsafe
-            spotify_instances =
-                realloc( spotify_instances,
-                         ( num_instances + 1 ) * sizeof( char * ) );
-
-            // save the memory for the bus names we need
-            spotify_instances[num_instances] = bus_names[i];
             num_instances++;
         }
-        else
-        {
-            // free memory for the unneeded bus names
-            free( bus_names[i] );
-        }
     }
-    // put on a null terminator on the end of the list
-    spotify_instances =
-        realloc( spotify_instances, ( num_instances + 1 ) * sizeof( char * ) );
-    spotify_instances[num_instances] = NULL;
+    if ( ret < 0 )
+    {
+        return ret;
+    }
+
+    ret = sd_bus_message_exit_container( reply );
+
+    return ret < 0 ? ret : num_instances;
+}
+
+/*
+ * Ask the bus daemon for the names on the bus, the reply tells whether
+ * Spotify is already running. The call runs on the event loop like
+ * everything else on the bus, spotify_names_reply() gets the answer.
+ */
+int spotify_request_names( session_t *session )
+{
+    int ret = 0;
+
+    ret = sd_bus_call_method_async( session->bus,
+                                    &session->names_call,
+                                    "org.freedesktop.DBus",
+                                    "/org/freedesktop/DBus",
+                                    "org.freedesktop.DBus",
+                                    "ListNames",
+                                    spotify_names_reply,
+                                    session,
+                                    "" );
+    if ( ret < 0 )
+    {
+        fprintf( stderr,
+                 "Error listing user bus names: %s\n",
+                 strerror( -ret ) );
+    }
+
+    return ret;
+}
+
+int spotify_names_reply( sd_bus_message *msg,
+                         void *userdata,
+                         sd_bus_error *ret_error )
+{
+    (void)( ret_error );
+    session_t *session = userdata;
+    int ret = 0;
+
+    session->names_call = sd_bus_slot_unref( session->names_call );
+
+    // NameOwnerChanged may have reported the player before this reply came
+    if ( session->player_present )
+    {
+        return 0;
+    }
 
-    // if the users asked us for the interface names, copy over the buffer,
-    // othersize cleanup
-    if ( instance_names != NULL )
+    if ( sd_bus_message_is_method_error( msg, NULL ) )
     {
-        *instance_names = spotify_instances;
+        fprintf( stderr,
+                 "Error getting user bus names: %s\n",
+                 sd_bus_message_get_error( msg )->message );
+        ret = -EXIT_FAILURE;
     }
     else
     {
-        FREE_DBUS_STRV( spotify_instances );
+        ret = is_spotify_availible( msg );
     }
 
-cleanup:
-    free( bus_names );
+    if ( ret > 0 )
+    {
+        printf( "Spotify Instances\n%s\n", spotify_dbus_name );
+        session_player_appeared( session );
+        return 0;
+    }
 
-    return ret < 0 ? -EXIT_FAILURE : num_instances;
+    // the name watch still reports spotify once it starts
+    if ( ret == 0 )
+    {
+        puts( "Spotify is not running, waiting for it" );
+    }
+    audio_ctl_park( session->mixer, 1 );
+
+    return 0;
 }
 
+/*
+ * Ask Spotify for its current metadata, spotify_metadata_reply() applies it.
+ * A reply still outstanding is for an earlier player and is dropped.
+ */
+int spotify_request_metadata( session_t *session )
+{
+    int ret = 0;
+
+    session->metadata_call = sd_bus_slot_unref( session->metadata_call );
+
+    ret = sd_bus_call_method_async( session->bus,
+                                    &session->metadata_call,
+                                    spotify_dbus_name,
+                                    spotify_dbus_path,
+                                    "org.freedesktop.DBus.Properties",
+                                    "Get",
+                                    spotify_metadata_reply,
+                                    session,
+                                    "ss",
+                                    spotify_dbus_interface,
+                                    "Metadata" );
+    if ( ret < 0 )
+    {
+        fprintf( stderr,
+                 "Error requesting Spotify metadata: %s\n",
+                 strerror( -ret ) );
+    }
+
+    return ret;
+}
 
-int spotify_get_metadata( sd_bus *bus_ptr, dbus_sv_array_t **metadata_out )
+int spotify_metadata_reply( sd_bus_message *msg,
+                            void *userdata,
+                            sd_bus_error *ret_error )
 {
+    (void)( ret_error );
+    session_t *session = userdata;
     dbus_sv_array_t *metadata = NULL;
-    sd_bus_message *msg = NULL;
-    sd_bus_error err = SD_BUS_ERROR_NULL;
     int ret = 0;
 
-    // get the metadata property from spotify on dbus
-    ret = sd_bus_get_property( bus_ptr,
-                               spotify_dbus_name,
-                               spotify_dbus_path,
-                               spotify_dbus_interface,
-                               "Metadata",
-                               &err,
-                               &msg,
-                               "a{sv}" );
-    if ( ret < 0 )
+    session->metadata_call = sd_bus_slot_unref( session->metadata_call );
+
+    // A player that just started may not have any metadata yet,
+    // PropertiesChanged fills it in later.
+    if ( sd_bus_message_is_method_error( msg, NULL ) )
     {
-        fprintf( stderr, "Error getting Spotify metadata: %s\n", err.message );
-        goto cleanup;
+        fprintf( stderr,
+                 "Error getting Spotify metadata: %s\n",
+                 sd_bus_message_get_error( msg )->message );
+        return 0;
     }
 
-    ret = bus_read_sv_array( &metadata, msg );
+    // the property comes wrapped in a variant
+    ret = sd_bus_message_enter_container( msg, SD_BUS_TYPE_VARIANT, "a{sv}" );
+    if ( ret >= 0 )
+    {
+        ret = bus_read_sv_array( &metadata, msg );
+    }
     if ( ret < 0 )
     {
         fprintf( stderr,
                  "Error reading Spotify metadata: %s\n",
                  strerror( -ret ) );
-        goto cleanup;
+        return 0;
     }
 
-    *metadata_out = metadata;
+    printf( "%20s \n", "Metadata:" );
+    bus_print_sv_array( metadata );
+    puts( "" );
 
+    // the metadata is a single allocation, one free releases all of it
+    md_cache_apply_sv_array( &session->cache, metadata );
+    bus_free_sv_array( &metadata );
+    session_flush( session );
 
-cleanup:
-    sd_bus_error_free( &err );
-    sd_bus_message_unref( msg );
+    // a forced state holds for the new player too
+    session_update_mute( session );
+    session_notify( session );
 
-    // todo recursively free memory
-    if ( ret < 0 )
+    return 0;
+}
+
+/* Append a statistics record for this session. Only stores into the mapped
+ * statistics file, so it is cheap enough for the decision path. `ad` holds
+ * the stats_ad_t signals of the decision.
+ *
+ * A track's record is held back until the track is over, ad_rule() keeps its
+ * decision current and session_log_track() appends it.
+ */
+void session_log( session_t *session,
+                  stats_type_t type,
+                  const char *trackid,
+                  uint8_t ad )
+{
+    if ( !session->stats )
+    {
+        return;
+    }
+
+    stats_record_t record = { 0 };
+    record.time = stats_time();
+    record.type = (uint8_t)type;
+    record.is_ad = ad;
+    record.session = session->index;
+
+    if ( trackid )
+    {
+        record.trackid_hash = stats_hash( trackid );
+        strncpy( record.trackid, trackid, sizeof( record.trackid ) );
+
+        // track length in usec, spotify sends this unsigned
+        const md_entry_t *length = md_cache_get(
+            &session->cache,
+            md_cache_key( &session->cache, "mpris:length" ) );
+        if ( length && ( length->type == 'x' || length->type == 't' ) )
+        {
+            record.length_ms = (uint32_t)( length->v.t / 1000 );
+        }
+    }
+
+    if ( type == STATS_MUTE )
+    {
+        session->muted_since = record.time;
+    }
+    else if ( type == STATS_UNMUTE && session->muted_since )
+    {
+        record.gap_ms =
+            (uint32_t)( ( record.time - session->muted_since ) / 1000 );
+        session->muted_since = 0;
+    }
+
+    if ( type == STATS_TRACK )
     {
-        free( metadata );
+        session_log_track( session );
+        session->track = record;
+        return;
     }
 
-    return ret < 0 ? -EXIT_FAILURE : EXIT_SUCCESS;
+    stats_append( session->stats, &record );
 }
 
-int main( int argc, char **argv )
+/* Append the record of the current track with its final decision.
+ */
+void session_log_track( session_t *session )
 {
-    (void)( argc );
-    (void)( argv );
-    // TODO use getopt to parse command line arguments
-    // we need to start by connecting to the system message bus and looking
-    // for spotify
-    char **instance_names = NULL;
-    dbus_sv_array_t *metadata = NULL;
-    sd_bus_error error = SD_BUS_ERROR_NULL;
-    sd_bus *bus_ptr;
-    int ret;
+    if ( session->stats && session->track.time )
+    {
+        stats_append( session->stats, &session->track );
+    }
+    session->track.time = 0;
+}
 
-    init_pactl();
-    wait_for_context();
+/* Check if a trackid belongs to an ad.
+ */
+bool is_ad_trackid( const char *track_name )
+{
+    const char *ad_prefix = "spotify:ad:";
+    return strncmp( ad_prefix, track_name, strlen( ad_prefix ) ) == 0 ||
+           strstr( track_name, "/ad/" );
+}
 
-    // while ( 1 )
-    // {
-    ret = sd_bus_default_user( &bus_ptr );
-    if ( ret < 0 )
+/* Decision rule for ads, depends only on the track id so updates to other
+ * metadata (cover art, rating, ...) don't re-evaluate it.
+ */
+void ad_rule( md_cache_t *cache, void *userdata )
+{
+    session_t *session = userdata;
+
+    const md_entry_t *track =
+        md_cache_get( cache, md_cache_key( cache, "mpris:trackid" ) );
+    if ( !track || track->type != 's' )
     {
-        fprintf( stderr, "Could not open user bus: %s\n", strerror( -ret ) );
-        goto cleanup;
+        return;
     }
 
-    ret = is_spotify_availible( bus_ptr, &instance_names );
-    if ( ret < 0 )
+    const char *track_name = track->v.s;
+    bool known = session_known_ad( session, track_name );
+    bool new_track = track->version != session->track_version;
+    if ( new_track )
     {
-        fprintf( stderr, "Spotify is not running: %s\n", strerror( -ret ) );
-        goto cleanup;
+        session->track_version = track->version;
+        printf( "current track: %s\n", track_name );
+        session_log( session, STATS_TRACK, track_name, 0 );
+
+        if ( session_event( session, "track" ) )
+        {
+            const md_entry_t *title = md_cache_get(
+                cache,
+                md_cache_key( cache, "xesam:title" ) );
+            ndjson_str( session->events, "trackid", track_name );
+            ndjson_str( session->events,
+                        "title",
+                        title && title->type == 's' ? title->v.s : NULL );
+            ndjson_bool( session->events, "known_ad", known );
+            ndjson_end( session->events );
+        }
+
+        // the audio verdicts belong to the previous track
+        session_reset_audio( session );
+
+        // pick up a set another process rebuilt, after this decision
+        if ( session->ads )
+        {
+            ev_timer_set( session->ads_timer, ev_now() );
+        }
     }
 
-    puts( "Spotify Instances" );
-    char **str = instance_names;
-    while ( *str )
+    bool level = cache_flag( cache, AUDIO_AD_KEY );
+    bool jingle = cache_flag( cache, JINGLE_KEY );
+    bool heard = level || jingle;
+
+    // an ad the audio caught is muted by its trackid the next time, only a
+    // jingle is sure enough for that unless -L asks for the level too
+    if ( ( jingle || ( heard && remember_heard ) ) && !known && session->ads )
     {
-        puts( *str++ );
+        session_remember( session, track_name );
     }
 
-    // spotify is availible, check if the current song is an ad
-    // if it is mute spotify
-    ret = spotify_get_metadata( bus_ptr, &metadata );
-    if ( ret < 0 )
+    SM_PROBE4( ad_decision, session->index, track_name, known, heard );
+    session->ad = known || heard;
+    session->ad_signals = ( known ? STATS_AD_KNOWN : 0 ) |
+                          ( level ? STATS_AD_LEVEL : 0 ) |
+                          ( jingle ? STATS_AD_JINGLE : 0 );
+    session->track.is_ad = session->ad_signals;
+
+    if ( session_event( session, "decision" ) )
     {
-        fprintf( stderr,
-                 "Could not get metadata from Spotify: %s\n",
-                 strerror( -ret ) );
-        goto cleanup_instances;
+        ndjson_str( session->events, "trackid", track_name );
+        ndjson_bool( session->events, "known", known );
+        ndjson_bool( session->events, "heard", heard );
+        ndjson_bool( session->events, "ad", session->ad );
+        ndjson_end( session->events );
+    }
+    if ( session_update_mute( session ) || new_track )
+    {
+        session_notify( session );
     }
+}
 
-    printf( "%20s \n", "Metadata:" );
-    bus_print_sv_array( metadata );
-    puts( "" );
+/*
+ * Apply the mute state the session should be in: the forced one if the
+ * control socket set one, the current one while paused, otherwise the
+ * decision of the rules.
+ *
+ * Returns: true if the mute state changed.
+ */
+bool session_update_mute( session_t *session )
+{
+    int mute = session->forced >= 0 ? session->forced
+               : session->paused    ? session->muted
+                                    : session->ad;
+
+    // only talk to the sound server when the state changes
+    if ( mute < 0 || mute == session->muted || !session->mixer )
+    {
+        return false;
+    }
+    session->muted = mute;
+
+    if ( session->forced >= 0 )
+    {
+        printf( "Forced %s\n", mute ? "mute" : "unmute" );
+    }
+    else if ( mute )
+    {
+        printf( "Ad found, muting\n" );
+    }
+    else
+    {
+        printf( "No ad found, unmuting\n" );
+    }
+
+    if ( session_event( session, "mute" ) )
+    {
+        ndjson_bool( session->events, "muted", mute );
+        ndjson_bool( session->events, "forced", session->forced >= 0 );
+        ndjson_end( session->events );
+    }
+
+    // mute spotify by setting it's output volume to 0, or unmute it
+    audio_ctl_set_mute( session->mixer, mute );
+    session_log( session,
+                 mute ? STATS_MUTE : STATS_UNMUTE,
+                 NULL,
+                 session->ad > 0 ? session->ad_signals : 0 );
+
+    return true;
+}
+
+/*
+ * Format the cached state of a session as a single control line.
+ */
+void session_describe( session_t *session,
+                       const char *what,
+                       char *buf,
+                       size_t size )
+{
+    const md_entry_t *track = md_cache_get(
+        &session->cache,
+        md_cache_key( &session->cache, "mpris:trackid" ) );
+    const char *forced = session->forced < 0 ? "-"
+                         : session->forced   ? "mute"
+                                             : "unmute";
 
-    // loop through the metadata and try and find an ad
-    for ( int i = 0; i < metadata->len; ++i )
+    snprintf( buf,
+              size,
+              "%s %u player=%d muted=%d ad=%d forced=%s paused=%d track=%s",
+              what,
+              session->index,
+              session->player_present,
+              session->muted,
+              session->ad,
+              forced,
+              session->paused,
+              track && track->type == 's' ? track->v.s : "-" );
+}
+
+/*
+ * Start an event of this session on the event output.
+ *
+ * Returns: false if there is no output or the event is dropped.
+ */
+bool session_event( session_t *session, const char *event )
+{
+    if ( !ndjson_begin( session->events, event ) )
     {
-        const char *track_name_id = "mpris:trackid";
-        const char *ad_prefix = "spotify:ad:";
+        return false;
+    }
+    ndjson_int( session->events, "session", session->index );
+    return true;
+}
 
-        const char *param = metadata->sv_array[i].s;
-        const char *track_name = metadata->sv_array[i].v.s;
+/*
+ * The sound server carried out (or failed) a mute request.
+ */
+void session_mute_result( int success,
+                          uint64_t latency_usec,
+                          void *userdata )
+{
+    session_t *session = userdata;
 
-        if ( strncmp( track_name_id, param, strlen( track_name_id ) ) == 0 )
+    if ( session_event( session, "mute_result" ) )
+    {
+        ndjson_bool( session->events, "muted", session->muted > 0 );
+        ndjson_bool( session->events, "success", success );
+        if ( latency_usec )
         {
-            printf( "current track: %s\n", track_name );
-            sd_bus_message *msg = NULL;
-            sd_bus_error err = SD_BUS_ERROR_NULL;
-            if ( strncmp( ad_prefix, track_name, strlen( ad_prefix ) ) == 0 ||
-                 strstr( track_name, "/ad/" ) )
-            {
-                // mute spotify by setting it's output volume to 0
-                printf( "Ad found, muting\n" );
-                set_mute( 1 );
-            }
-            // otherwise unmute spotify
-            else
-            {
-                printf( "No ad found, unmuting\n" );
-                set_mute( 0 );
-            }
-            if ( ret < 0 )
+            ndjson_int( session->events,
+                        "latency_usec",
+                        (long long)latency_usec );
+        }
+        ndjson_end( session->events );
+    }
+}
+
+/*
+ * Publish a change of the session to the state page and the subscribed
+ * control clients.
+ */
+void session_notify( session_t *session )
+{
+    char line[CONTROL_LINE_MAX * 2];
+
+    if ( session->page )
+    {
+        const md_entry_t *track = md_cache_get(
+            &session->cache,
+            md_cache_key( &session->cache, "mpris:trackid" ) );
+        statepage_state_t state = { 0 };
+        state.trackid_hash =
+            track && track->type == 's' ? stats_hash( track->v.s ) : 0;
+        state.changed = stats_time();
+        state.player = session->player_present;
+        state.ad = session->ad > 0;
+        state.muted = session->muted > 0;
+        statepage_publish( session->page, session->index, &state );
+    }
+
+    if ( !session->control )
+    {
+        return;
+    }
+    session_describe( session, "event", line, sizeof( line ) );
+    control_broadcast( session->control, line );
+}
+
+/*
+ * Handle one control request. Every request but memory and (un)subscribe
+ * takes an optional session number and applies to all sessions without one,
+ * those three cover the whole daemon and refuse a session number:
+ *
+ *   state              one state line per session
+ *   mute, unmute       force the mute state
+ *   auto               follow the ad detection again
+ *   pause, resume      keep the current mute state, or stop doing so
+ *   subscribe          get an event line for every change
+ *   memory             allocation counts per subsystem
+ *   unsubscribe
+ *
+ * Each request is answered with "ok" or "error REASON".
+ */
+void control_command( control_client_t *client, char *line, void *userdata )
+{
+    control_ctx_t *ctx = userdata;
+    char *save = NULL;
+    char buf[CONTROL_LINE_MAX * 2];
+    int first = 0;
+    int last = ctx->num_sessions;
+
+    const char *cmd = strtok_r( line, " \t", &save );
+    const char *arg = strtok_r( NULL, " \t", &save );
+    if ( !cmd )
+    {
+        return;
+    }
+
+    bool global = strcmp( cmd, "memory" ) == 0 ||
+                  strcmp( cmd, "subscribe" ) == 0 ||
+                  strcmp( cmd, "unsubscribe" ) == 0;
+    if ( global && arg )
+    {
+        control_send( client, "error request takes no session" );
+        return;
+    }
+    else if ( arg )
+    {
+        char *end = NULL;
+        long i = strtol( arg, &end, 10 );
+        if ( *end || i < 0 || i >= ctx->num_sessions )
+        {
+            control_send( client, "error no such session" );
+            return;
+        }
+        first = (int)i;
+        last = first + 1;
+    }
+
+    if ( strcmp( cmd, "memory" ) == 0 )
+    {
+        for ( int sub = 0; sub < ALLOC_SUBSYSTEMS; ++sub )
+        {
+            char counts[256];
+            if ( alloc_format( (alloc_subsystem_t)sub,
+                               counts,
+                               sizeof( counts ) ) < 0 )
             {
-                fprintf( stderr,
-                         "Error setting Spotify volume: %s\n",
-                         err.message );
+                control_send( client, "error allocation accounting off" );
+                return;
             }
+            snprintf( buf, sizeof( buf ), "memory %s", counts );
+            control_send( client, buf );
+        }
+        control_send( client, "ok" );
+        return;
+    }
+
+    if ( strcmp( cmd, "subscribe" ) == 0 ||
+         strcmp( cmd, "unsubscribe" ) == 0 )
+    {
+        control_subscribe( client, cmd[0] == 's' );
+        control_send( client, "ok" );
+        return;
+    }
+
+    for ( int i = first; i < last; ++i )
+    {
+        session_t *session = &ctx->sessions[i];
 
-            sd_bus_error_free( &err );
-            sd_bus_message_unref( msg );
+        if ( strcmp( cmd, "state" ) == 0 )
+        {
+            session_describe( session, "state", buf, sizeof( buf ) );
+            control_send( client, buf );
+            continue;
+        }
+        else if ( strcmp( cmd, "mute" ) == 0 )
+        {
+            session->forced = 1;
+        }
+        else if ( strcmp( cmd, "unmute" ) == 0 )
+        {
+            session->forced = 0;
+        }
+        else if ( strcmp( cmd, "auto" ) == 0 )
+        {
+            session->forced = -1;
+        }
+        else if ( strcmp( cmd, "pause" ) == 0 )
+        {
+            session->paused = true;
+        }
+        else if ( strcmp( cmd, "resume" ) == 0 )
+        {
+            session->paused = false;
+        }
+        else
+        {
+            control_send( client, "error unknown request" );
+            return;
         }
+
+        session_update_mute( session );
+        session_notify( session );
     }
-    // sleep( 2 );
-    // printf( "\x0C" );
-    //}
 
-cleanup_instances:
-    FREE_DBUS_STRV( instance_names );
-    bus_free_sv_array( &metadata );
+    control_send( client, "ok" );
+}
 
-cleanup:
-    sd_bus_error_free( &error );
-    sd_bus_unref( bus_ptr );
+/* Decoder skip function for PropertiesChanged: values of the top level
+ * properties and of the Metadata dictionary that the cache does not keep or
+ * already holds are not copied out of the message.
+ */
+bool spotify_value_unchanged( const char *dict,
+                              const char *key,
+                              char type,
+                              const dbus_v_t *v,
+                              void *userdata )
+{
+    const session_t *session = userdata;
+
+    if ( dict && strcmp( dict, "Metadata" ) != 0 )
+    {
+        return false;
+    }
+    return md_cache_skip( &session->cache, key, type, v );
+}
+
+/* Handler for org.freedesktop.DBus.Properties.PropertiesChanged from Spotify.
+ * The changed properties are diffed into the metadata cache and only the
+ * rules that depend on a changed key are re-run. Values that did not change
+ * are skipped while decoding.
+ */
+int spotify_properties_changed( sd_bus_message *msg,
+                                void *userdata,
+                                sd_bus_error *ret_error )
+{
+    (void)( ret_error );
+    session_t *session = userdata;
+    md_cache_t *cache = &session->cache;
+    dbus_sv_array_t *changed = NULL;
+    const char *interface = NULL;
+    int ret = 0;
 
-    drain();
+    alloc_event( ALLOC_MAIN );
+
+    ret = sd_bus_message_read( msg, "s", &interface );
+    if ( ret < 0 )
+    {
+        fprintf( stderr,
+                 "Error reading PropertiesChanged: %s\n",
+                 strerror( -ret ) );
+        goto cleanup;
+    }
+
+    // we only care about the player interface
+    if ( strcmp( interface, spotify_dbus_interface ) != 0 )
+    {
+        goto cleanup;
+    }
+
+    ret = bus_read_sv_array_skip( &changed,
+                                  msg,
+                                  spotify_value_unchanged,
+                                  session );
+    if ( ret < 0 )
+    {
+        fprintf( stderr,
+                 "Error reading changed properties: %s\n",
+                 strerror( -ret ) );
+        goto cleanup;
+    }
+
+    for ( int i = 0; i < changed->len; ++i )
+    {
+        const dbus_sv_t *sv = &changed->sv_array[i];
+        if ( !sv->v_type )
+        {
+            // skipped while decoding, the cached value is current
+            continue;
+        }
+        if ( strcmp( sv->s, "Metadata" ) == 0 &&
+             sv->v_type == SD_BUS_TYPE_ARRAY )
+        {
+            ret = md_cache_apply_dict( cache, sv->v.node );
+        }
+        else
+        {
+            ret = md_cache_set( cache, sv->s, sv->v_type, &sv->v );
+        }
+
+        if ( ret < 0 )
+        {
+            fprintf( stderr,
+                     "Error caching %s: %s\n",
+                     sv->s,
+                     strerror( -ret ) );
+        }
+    }
+
+    // an ad has to be muted right away, everything else waits for the rest
+    // of the burst so it is decided once
+    const md_entry_t *track =
+        md_cache_get( cache, md_cache_key( cache, "mpris:trackid" ) );
+    if ( !coalesce_usec ||
+         ( track && track->type == 's' &&
+           session_known_ad( session, track->v.s ) ) )
+    {
+        session_flush( session );
+    }
+    else if ( !session->coalesce_pending )
+    {
+        session->coalesce_pending = true;
+        ev_timer_set( session->coalesce_timer, ev_now() + coalesce_usec );
+    }
+
+cleanup:
+    bus_free_sv_array( &changed );
+
+    // never fail the dispatch, a bad signal should not stop the loop
+    return 0;
+}
+
+/*
+ * Open the session's D-Bus connection, either on an explicit address or on
+ * the default user bus.
+ */
+int session_open_bus( session_t *session )
+{
+    int ret = 0;
+
+    if ( !session->bus_address )
+    {
+        return sd_bus_open_user( &session->bus );
+    }
+
+    ret = sd_bus_new( &session->bus );
+    if ( ret < 0 )
+    {
+        goto no_cleanup;
+    }
+
+    ret = sd_bus_set_address( session->bus, session->bus_address );
+    if ( ret < 0 )
+    {
+        goto cleanup;
+    }
+
+    ret = sd_bus_set_bus_client( session->bus, true );
+    if ( ret < 0 )
+    {
+        goto cleanup;
+    }
+
+    ret = sd_bus_start( session->bus );
+
+cleanup:
+    if ( ret < 0 )
+    {
+        session->bus = sd_bus_unref( session->bus );
+    }
+
+no_cleanup:
+    return ret;
+}
+
+/*
+ * Hand the bus fd and timeout sd-bus currently wants to the event loop.
+ */
+int session_bus_update( session_t *session )
+{
+    int ret = 0;
+    uint64_t timeout = 0;
+
+    ret = sd_bus_get_events( session->bus );
+    if ( ret < 0 )
+    {
+        return ret;
+    }
+
+    uint32_t events = ( ret & POLLIN ? EPOLLIN : 0 ) |
+                      ( ret & POLLOUT ? EPOLLOUT : 0 );
+    ret = ev_io_set_events( session->bus_io, events );
+    if ( ret < 0 )
+    {
+        return ret;
+    }
+
+    ret = sd_bus_get_timeout( session->bus, &timeout );
+    if ( ret < 0 )
+    {
+        return ret;
+    }
+
+    return ev_timer_set( session->bus_timer, timeout );
+}
+
+/*
+ * Event loop callback for both the bus fd and the bus timeout.
+ */
+void session_bus_process( ev_source_t *src, uint32_t events, void *userdata )
+{
+    (void)( src );
+    (void)( events );
+    session_t *session = userdata;
+    int ret = 0;
+
+    // dispatch everything that is queued
+    while ( ( ret = sd_bus_process( session->bus, NULL ) ) > 0 )
+    {
+    }
+
+    if ( ret >= 0 )
+    {
+        ret = session_bus_update( session );
+    }
+
+    if ( ret < 0 )
+    {
+        fprintf( stderr,
+                 "Error processing bus %s: %s\n",
+                 session->bus_address ? session->bus_address : "(user)",
+                 strerror( -ret ) );
+        session_disconnect( session );
+        session_schedule_retry( session );
+    }
+}
+
+/*
+ * Evaluate the rules for everything that changed since the last evaluation.
+ */
+void session_flush( session_t *session )
+{
+    if ( session->coalesce_pending )
+    {
+        session->coalesce_pending = false;
+        ev_timer_set( session->coalesce_timer, EV_TIMER_OFF );
+    }
+    md_cache_run_rules( &session->cache );
+}
+
+/*
+ * Queue an ad for the ad set. Adding takes the file lock and may rebuild the
+ * set, so it runs from a timer after the mute request went out.
+ */
+void session_remember( session_t *session, const char *trackid )
+{
+    if ( session->remember && strcmp( session->remember, trackid ) == 0 )
+    {
+        return;
+    }
+    session_ads_flush( session );
+
+    session->remember = alloc_malloc( ALLOC_MAIN, strlen( trackid ) + 1 );
+    if ( !session->remember )
+    {
+        fprintf( stderr, "Could not remember %s as an ad\n", trackid );
+        return;
+    }
+    strcpy( session->remember, trackid );
+    ev_timer_set( session->ads_timer, ev_now() );
+}
+
+/*
+ * Add the queued ad to the ad set.
+ */
+void session_ads_flush( session_t *session )
+{
+    if ( !session->remember )
+    {
+        return;
+    }
+
+    if ( adset_add( session->ads, session->remember ) > 0 )
+    {
+        printf( "Remembering %s as an ad\n", session->remember );
+    }
+    alloc_free( ALLOC_MAIN, session->remember );
+    session->remember = NULL;
+}
+
+void session_ads_timeout( ev_source_t *src, uint32_t events, void *userdata )
+{
+    (void)( src );
+    (void)( events );
+    session_t *session = userdata;
+
+    // adding already follows a rebuilt set
+    if ( session->remember )
+    {
+        session_ads_flush( session );
+        return;
+    }
+
+    int ret = adset_refresh( session->ads );
+    if ( ret < 0 )
+    {
+        fprintf( stderr, "Could not reload ad set: %s\n", strerror( -ret ) );
+    }
+}
+
+void session_coalesce_timeout( ev_source_t *src,
+                               uint32_t events,
+                               void *userdata )
+{
+    (void)( src );
+    (void)( events );
+    session_t *session = userdata;
+
+    // the timer is one shot, it is already disarmed
+    session->coalesce_pending = false;
+    md_cache_run_rules( &session->cache );
+}
+
+bool session_known_ad( session_t *session, const char *trackid )
+{
+    return is_ad_trackid( trackid ) ||
+           ( session->ads && adset_contains( session->ads, trackid ) );
+}
+
+bool cache_flag( md_cache_t *cache, const char *key )
+{
+    const md_entry_t *entry = md_cache_get( cache, md_cache_key( cache, key ) );
+    return entry && entry->type == 'b' && entry->v.b;
+}
+
+/*
+ * Start the audio detectors over for a new track.
+ */
+void session_reset_audio( session_t *session )
+{
+    dbus_v_t no = { .b = false };
+
+    if ( session->audio )
+    {
+        al_reset( session->audio );
+        md_cache_set( &session->cache, AUDIO_AD_KEY, 'b', &no );
+    }
+    if ( session->fp )
+    {
+        fp_matcher_reset( session->fp );
+        md_cache_set( &session->cache, JINGLE_KEY, 'b', &no );
+    }
+}
+
+/*
+ * Monitor stream callback. The detectors' verdicts go into the cache next
+ * to the metadata, so the ad rule sees every signal.
+ */
+void session_audio( const float *samples, size_t frames, void *userdata )
+{
+    session_t *session = userdata;
+    bool changed = false;
+
+    if ( session->audio && al_feed( session->audio, samples, frames ) )
+    {
+        dbus_v_t v = { .b = session->audio->ad };
+        printf( "Audio level %s an ad\n", v.b ? "indicates" : "no longer" );
+        md_cache_set( &session->cache, AUDIO_AD_KEY, 'b', &v );
+        changed = true;
+    }
+
+    if ( session->fp && fp_matcher_feed( session->fp, samples, frames ) )
+    {
+        dbus_v_t v = { .b = true };
+        printf( "Known ad jingle: %s\n",
+                session->jingles->clips[session->fp->match].name );
+        md_cache_set( &session->cache, JINGLE_KEY, 'b', &v );
+        changed = true;
+    }
+
+    if ( changed )
+    {
+        session_flush( session );
+    }
+}
+
+/*
+ * Spotify showed up on the bus, read its current state and let PulseAudio
+ * reconnect if it needs to.
+ */
+void session_player_appeared( session_t *session )
+{
+    puts( "Spotify appeared" );
+    session->player_present = true;
+    if ( session_event( session, "player" ) )
+    {
+        ndjson_bool( session->events, "present", true );
+        ndjson_end( session->events );
+    }
+    audio_ctl_park( session->mixer, 0 );
+
+    // spotify is availible, check if the current song is an ad
+    // if it is mute spotify
+    spotify_request_metadata( session );
+}
+
+/*
+ * Spotify left the bus. Forget its state and park PulseAudio: with no player
+ * there is nothing to do until it comes back, so no timers stay armed.
+ */
+void session_player_vanished( session_t *session )
+{
+    if ( !session->player_present )
+    {
+        return;
+    }
+
+    puts( "Spotify vanished" );
+    session->player_present = false;
+    session_log_track( session );
+    session->metadata_call = sd_bus_slot_unref( session->metadata_call );
+    if ( session_event( session, "player" ) )
+    {
+        ndjson_bool( session->events, "present", false );
+        ndjson_end( session->events );
+    }
+    md_cache_clear( &session->cache );
+    session_flush( session );
+    if ( session->audio )
+    {
+        al_reset( session->audio );
+    }
+    if ( session->fp )
+    {
+        fp_matcher_reset( session->fp );
+    }
+
+    // the next player starts with a fresh decision
+    session->muted = -1;
+    session->ad = -1;
+    session->muted_since = 0;
+    audio_ctl_park( session->mixer, 1 );
+    session_notify( session );
+}
+
+/* Handler for NameOwnerChanged on the Spotify bus name.
+ */
+int session_owner_changed( sd_bus_message *msg,
+                           void *userdata,
+                           sd_bus_error *ret_error )
+{
+    (void)( ret_error );
+    session_t *session = userdata;
+    const char *name = NULL;
+    const char *old_owner = NULL;
+    const char *new_owner = NULL;
+
+    if ( sd_bus_message_read( msg, "sss", &name, &old_owner, &new_owner ) < 0 )
+    {
+        return 0;
+    }
+
+    if ( new_owner && *new_owner )
+    {
+        session_player_appeared( session );
+    }
+    else
+    {
+        session_player_vanished( session );
+    }
+
+    return 0;
+}
+
+/*
+ * Open the bus, watch for Spotify and attach the bus to the event loop.
+ * A missing Spotify is not an error, the session waits for it to appear.
+ *
+ * Returns: 0 (`EXIT_SUCCESS`) on success, a negative errno if the bus could
+ * not be set up.
+ */
+int session_connect( session_t *session )
+{
+    int ret = 0;
+
+    ret = session_open_bus( session );
+    if ( ret < 0 )
+    {
+        fprintf( stderr, "Could not open user bus: %s\n", strerror( -ret ) );
+        goto cleanup;
+    }
+
+    // Watch the name before looking for spotify so we can't miss it starting.
+    // Nothing here waits for the bus daemon: it handles our messages in
+    // order, so the matches are in place before it answers ListNames. A
+    // failed AddMatch closes the connection, which takes the reconnect path.
+    ret = sd_bus_add_match_async( session->bus,
+                                  &session->owner_slot,
+                                  "type='signal',"
+                                  "sender='org.freedesktop.DBus',"
+                                  "path='/org/freedesktop/DBus',"
+                                  "interface='org.freedesktop.DBus',"
+                                  "member='NameOwnerChanged',"
+                                  "arg0='org.mpris.MediaPlayer2.spotify'",
+                                  session_owner_changed,
+                                  NULL,
+                                  session );
+    if ( ret < 0 )
+    {
+        fprintf( stderr,
+                 "Could not watch for Spotify: %s\n",
+                 strerror( -ret ) );
+        goto cleanup;
+    }
+
+    // subscribe to property changes before reading the current state so we
+    // don't miss a change in between
+    ret = sd_bus_match_signal_async( session->bus,
+                                     &session->slot,
+                                     spotify_dbus_name,
+                                     spotify_dbus_path,
+                                     "org.freedesktop.DBus.Properties",
+                                     "PropertiesChanged",
+                                     spotify_properties_changed,
+                                     NULL,
+                                     session );
+    if ( ret < 0 )
+    {
+        fprintf( stderr,
+                 "Could not subscribe to Spotify: %s\n",
+                 strerror( -ret ) );
+        goto cleanup;
+    }
+
+    // wait for spotify to tell us about changes
+    ret = ev_add_io( session->loop,
+                     &session->bus_io,
+                     sd_bus_get_fd( session->bus ),
+                     EPOLLIN,
+                     session_bus_process,
+                     session );
+    if ( ret < 0 )
+    {
+        goto cleanup;
+    }
+
+    ret = ev_add_timer( session->loop,
+                        &session->bus_timer,
+                        EV_TIMER_OFF,
+                        session_bus_process,
+                        session );
+    if ( ret < 0 )
+    {
+        goto cleanup;
+    }
+
+    ret = spotify_request_names( session );
+    if ( ret < 0 )
+    {
+        goto cleanup;
+    }
+
+    ret = session_bus_update( session );
+
+cleanup:
+    if ( ret < 0 )
+    {
+        session_disconnect( session );
+    }
+    else
+    {
+        session->retry_usec = 0;
+    }
+
+    return ret;
+}
+
+/*
+ * Drop the bus connection, keeping the PulseAudio side and the timers.
+ */
+void session_disconnect( session_t *session )
+{
+    ev_source_free( session->bus_io );
+    ev_source_free( session->bus_timer );
+    session->bus_io = NULL;
+    session->bus_timer = NULL;
+
+    session->names_call = sd_bus_slot_unref( session->names_call );
+    session->metadata_call = sd_bus_slot_unref( session->metadata_call );
+    session->slot = sd_bus_slot_unref( session->slot );
+    session->owner_slot = sd_bus_slot_unref( session->owner_slot );
+    session->bus = sd_bus_flush_close_unref( session->bus );
+
+    session_player_vanished( session );
+}
+
+/*
+ * Retry the bus connection with exponential backoff.
+ */
+void session_schedule_retry( session_t *session )
+{
+    session->retry_usec = session->retry_usec ? session->retry_usec * 2
+                                              : SESSION_RETRY_MIN_USEC;
+    if ( session->retry_usec > SESSION_RETRY_MAX_USEC )
+    {
+        session->retry_usec = SESSION_RETRY_MAX_USEC;
+    }
+
+    fprintf( stderr,
+             "Reconnecting to bus %s in %llu ms\n",
+             session->bus_address ? session->bus_address : "(user)",
+             (unsigned long long)( session->retry_usec / 1000 ) );
+    ev_timer_set( session->retry_timer, ev_now() + session->retry_usec );
+}
+
+void session_retry_timeout( ev_source_t *src, uint32_t events, void *userdata )
+{
+    (void)( src );
+    (void)( events );
+    session_t *session = userdata;
+
+    if ( session_connect( session ) < 0 )
+    {
+        session_schedule_retry( session );
+    }
+}
+
+/*
+ * Set up a session on the event loop. An unreachable bus or PulseAudio server
+ * is retried in the background, only allocation failures make this fail.
+ */
+int session_start( session_t *session, ev_loop_t *loop )
+{
+    int ret = 0;
+
+    session->loop = loop;
+    md_cache_init( &session->cache );
+    session->muted = -1;
+    session->ad = -1;
+    session->forced = -1;
+    const char *ad_rule_keys[] = { "mpris:trackid", AUDIO_AD_KEY, JINGLE_KEY };
+    md_cache_add_rule( &session->cache, ad_rule_keys, 3, ad_rule, session );
+
+    // read by the track event and the statistics, everything else a player
+    // sends is not kept
+    md_cache_key( &session->cache, "xesam:title" );
+    md_cache_key( &session->cache, "mpris:length" );
+
+    ret = audio_ctl_open( &session->mixer,
+                          audio_backend,
+                          loop,
+                          session->pa_server );
+    if ( ret < 0 )
+    {
+        goto cleanup;
+    }
+
+    if ( audio_detect )
+    {
+        session->audio = alloc_malloc( ALLOC_MAIN, sizeof( *session->audio ) );
+        if ( !session->audio )
+        {
+            ret = -ENOMEM;
+            goto cleanup;
+        }
+        al_init( session->audio );
+    }
+
+    if ( session->jingles )
+    {
+        session->fp = alloc_malloc( ALLOC_MAIN, sizeof( *session->fp ) );
+        if ( !session->fp )
+        {
+            ret = -ENOMEM;
+            goto cleanup;
+        }
+        fp_matcher_init( session->fp, session->jingles );
+    }
+
+    if ( session->events )
+    {
+        audio_ctl_set_mute_callback( session->mixer,
+                                     session_mute_result,
+                                     session );
+    }
+
+    if ( session->audio || session->fp )
+    {
+        audio_ctl_set_monitor( session->mixer,
+                               AL_RATE,
+                               session_audio,
+                               session );
+    }
+
+    ret = ev_add_timer( loop,
+                        &session->coalesce_timer,
+                        EV_TIMER_OFF,
+                        session_coalesce_timeout,
+                        session );
+    if ( ret < 0 )
+    {
+        goto cleanup;
+    }
+
+    ret = ev_add_timer( loop,
+                        &session->retry_timer,
+                        EV_TIMER_OFF,
+                        session_retry_timeout,
+                        session );
+    if ( ret < 0 )
+    {
+        goto cleanup;
+    }
+
+    if ( session->ads )
+    {
+        ret = ev_add_timer( loop,
+                            &session->ads_timer,
+                            EV_TIMER_OFF,
+                            session_ads_timeout,
+                            session );
+        if ( ret < 0 )
+        {
+            goto cleanup;
+        }
+    }
+
+    if ( session_connect( session ) < 0 )
+    {
+        session_schedule_retry( session );
+    }
+
+cleanup:
+    if ( ret < 0 )
+    {
+        session_stop( session );
+    }
+
+    return ret;
+}
+
+/*
+ * Detach a session from the event loop and close its connections.
+ */
+void session_stop( session_t *session )
+{
+    session_disconnect( session );
+    session_log_track( session );
+
+    ev_source_free( session->coalesce_timer );
+    ev_source_free( session->retry_timer );
+    session->coalesce_timer = NULL;
+    session->retry_timer = NULL;
+    session->coalesce_pending = false;
+
+    // an ad caught right before exiting is still worth keeping
+    session_ads_flush( session );
+    ev_source_free( session->ads_timer );
+    session->ads_timer = NULL;
+
+    audio_ctl_close( session->mixer );
+    session->mixer = NULL;
+    alloc_free( ALLOC_MAIN, session->audio );
+    session->audio = NULL;
+    alloc_free( ALLOC_MAIN, session->fp );
+    session->fp = NULL;
+
+    md_cache_free( &session->cache );
+}
+
+void signal_callback( ev_source_t *src, uint32_t events, void *userdata )
+{
+    (void)( events );
+    struct signalfd_siginfo info;
+    ev_loop_t *loop = userdata;
+
+    if ( read( ev_source_get_fd( src ), &info, sizeof( info ) ) !=
+         sizeof( info ) )
+    {
+        ev_loop_quit( loop, EXIT_SUCCESS );
+        return;
+    }
+
+    // SIGUSR1 only asks for the allocation counts
+    if ( info.ssi_signo == SIGUSR1 )
+    {
+        alloc_dump( stderr );
+        return;
+    }
+
+    fprintf( stderr, "Got signal %u, exiting\n", info.ssi_signo );
+    ev_loop_quit( loop, EXIT_SUCCESS );
+}
+
+void usage( const char *name )
+{
+    fprintf( stderr,
+             "Usage: %s [-a [-L]] [-F INDEX] [-A AD_SET] [-S STATS_FILE]\n"
+             "          [-C SOCKET] [-M STATE_PAGE] [-j EVENTS] [-c MSEC]\n"
+             "          [-B BACKEND]\n"
+             "          [-u UID | -s BUS_ADDRESS [-p SOUND_SERVER]]...\n"
+             "\n"
+             "Without options the default user bus and sound server are\n"
+             "used. Each -u or -s adds a session, all sessions are watched\n"
+             "from this one process.\n"
+             "\n"
+             "  -s BUS_ADDRESS   D-Bus session bus address for a new session\n"
+             "  -p SOUND_SERVER  sound server for the last session\n"
+             "  -u UID           session for the user's /run/user/UID bus and\n"
+             "                   sound server\n"
+             "  -B BACKEND       mute through BACKEND: pulse (default)\n"
+             "  -a               also detect ads by the level of the Spotify\n"
+             "                   stream (mastered louder than music)\n"
+             "  -L               also add the ads caught by -a to AD_SET, not\n"
+             "                   only those caught by -F\n"
+             "  -F INDEX         mute on known ad jingles from INDEX, built\n"
+             "                   with spotify_mute_fpbuild\n"
+             "  -A AD_SET        mute the trackids in AD_SET and add the ads\n"
+             "                   caught by -F to it, edit it with\n"
+             "                   spotify_mute_adset\n"
+             "  -S STATS_FILE    append ad statistics to STATS_FILE, read it\n"
+             "                   with spotify_mute_stats\n"
+             "  -C SOCKET        serve state queries and forced mute on the\n"
+             "                   Unix socket SOCKET (default\n"
+             "                   $XDG_RUNTIME_DIR/spotify_mute.sock)\n"
+             "  -M STATE_PAGE    publish the state of every session in the\n"
+             "                   shared memory page STATE_PAGE, read it with\n"
+             "                   spotify_mute_state (default\n"
+             "                   /dev/shm/spotify_mute-UID)\n"
+             "  -j EVENTS        write track changes, ad decisions and mute\n"
+             "                   results as JSON lines to the file or FIFO\n"
+             "                   EVENTS, - for stdout (the log then goes to\n"
+             "                   stderr)\n"
+             "  -c MSEC          evaluate bursts of metadata changes once per\n"
+             "                   MSEC window, ads bypass the window\n"
+             "                   (default 20, at most 60000, 0 disables)\n",
+             name );
+}
+
+int main( int argc, char **argv )
+{
+    session_t *sessions = NULL;
+    int num_sessions = 0;
+    ev_loop_t *loop = NULL;
+    ev_source_t *signal_src = NULL;
+    const char *stats_path = NULL;
+    stats_t stats = { .fd = -1 };
+    const char *jingles_path = NULL;
+    fp_index_t jingles = { 0 };
+    const char *ads_path = NULL;
+    adset_t ads = { .fd = -1 };
+    const char *control_path = NULL;
+    char *default_control_path = NULL;
+    control_t *control = NULL;
+    control_ctx_t control_ctx = { 0 };
+    const char *page_path = NULL;
+    char default_page_path[64];
+    statepage_t *page = NULL;
+    const char *events_path = NULL;
+    ndjson_t *events = NULL;
+    int signal_fd = -1;
+    int running = 0;
+    int ret = 0;
+    int opt;
+
+    while ( ( opt = getopt( argc, argv, "s:p:u:S:c:aLF:A:C:M:j:B:h" ) ) != -1 )
+    {
+        switch ( opt )
+        {
+            case 's':
+            case 'u':
+            {
+                size_t size = ( num_sessions + 1 ) * sizeof( *sessions );
+                session_t *grown = alloc_realloc( ALLOC_MAIN, sessions, size );
+                if ( !grown )
+                {
+                    ret = -ENOMEM;
+                    goto cleanup;
+                }
+                sessions = grown;
+                session_t *session = &sessions[num_sessions++];
+                memset( session, 0, sizeof( *session ) );
+
+                // room for the runtime dir paths around the uid
+                size_t len = strlen( optarg ) + 64;
+                session->bus_address = alloc_malloc( ALLOC_MAIN, len );
+                if ( !session->bus_address )
+                {
+                    ret = -ENOMEM;
+                    goto cleanup;
+                }
+                if ( opt == 's' )
+                {
+                    strcpy( session->bus_address, optarg );
+                    break;
+                }
+
+                snprintf( session->bus_address,
+                          len,
+                          "unix:path=/run/user/%s/bus",
+                          optarg );
+                // the server path depends on the backend, filled in below
+                session->uid = optarg;
+                break;
+            }
+
+            case 'p':
+            {
+                if ( !num_sessions )
+                {
+                    usage( argv[0] );
+                    ret = -EINVAL;
+                    goto cleanup;
+                }
+                session_t *session = &sessions[num_sessions - 1];
+                alloc_free( ALLOC_MAIN, session->pa_server );
+                session->pa_server =
+                    alloc_malloc( ALLOC_MAIN, strlen( optarg ) + 1 );
+                if ( !session->pa_server )
+                {
+                    ret = -ENOMEM;
+                    goto cleanup;
+                }
+                strcpy( session->pa_server, optarg );
+                break;
+            }
+
+            case 'S':
+                stats_path = optarg;
+                break;
+
+            case 'c':
+            {
+                // strtoull() takes a sign and wraps it, only plain digits
+                char *end = NULL;
+                errno = 0;
+                unsigned long long msec = strtoull( optarg, &end, 10 );
+                if ( *optarg < '0' || *optarg > '9' || *end || errno ||
+                     msec > COALESCE_MAX_MSEC )
+                {
+                    usage( argv[0] );
+                    ret = -EINVAL;
+                    goto cleanup;
+                }
+                coalesce_usec = msec * 1000;
+                break;
+            }
+
+            case 'a':
+                audio_detect = true;
+                break;
+
+            case 'L':
+                remember_heard = true;
+                break;
+
+            case 'F':
+                jingles_path = optarg;
+                break;
+
+            case 'A':
+                ads_path = optarg;
+                break;
+
+            case 'C':
+                control_path = optarg;
+                break;
+
+            case 'M':
+                page_path = optarg;
+                break;
+
+            case 'j':
+                events_path = optarg;
+                break;
+
+            case 'B':
+                audio_backend = audio_backend_find( optarg );
+                if ( !audio_backend )
+                {
+                    fprintf( stderr,
+                             "Unknown audio backend %s, built in:",
+                             optarg );
+                    for ( int i = 0; audio_backend_name( i ); ++i )
+                    {
+                        fprintf( stderr, " %s", audio_backend_name( i ) );
+                    }
+                    fprintf( stderr, "\n" );
+                    ret = -EINVAL;
+                    goto cleanup;
+                }
+                break;
+
+            case 'h':
+            default:
+                usage( argv[0] );
+                ret = opt == 'h' ? EXIT_SUCCESS : -EINVAL;
+                goto cleanup;
+        }
+    }
+
+    // no sessions given, watch the default user session
+    if ( !num_sessions )
+    {
+        sessions = alloc_calloc( ALLOC_MAIN, 1, sizeof( *sessions ) );
+        if ( !sessions )
+        {
+            ret = -ENOMEM;
+            goto cleanup;
+        }
+        num_sessions = 1;
+    }
+
+    if ( !audio_backend )
+    {
+        audio_backend = audio_backend_find( NULL );
+    }
+    for ( int i = 0; i < num_sessions; ++i )
+    {
+        session_t *session = &sessions[i];
+        if ( !session->uid || session->pa_server )
+        {
+            continue;
+        }
+
+        size_t len = strlen( session->uid ) + 64;
+        session->pa_server = alloc_malloc( ALLOC_MAIN, len );
+        if ( !session->pa_server )
+        {
+            ret = -ENOMEM;
+            goto cleanup;
+        }
+        snprintf( session->pa_server,
+                  len,
+                  "/run/user/%s/%s",
+                  session->uid,
+                  audio_backend->user_socket );
+    }
+
+    ret = ev_loop_new( &loop );
+    if ( ret < 0 )
+    {
+        fprintf( stderr,
+                 "Could not create event loop: %s\n",
+                 strerror( -ret ) );
+        goto cleanup;
+    }
+
+    // exit cleanly on SIGINT and SIGTERM, dump allocations on SIGUSR1
+    sigset_t mask;
+    sigemptyset( &mask );
+    sigaddset( &mask, SIGINT );
+    sigaddset( &mask, SIGTERM );
+    sigaddset( &mask, SIGUSR1 );
+    sigprocmask( SIG_BLOCK, &mask, NULL );
+    signal_fd = signalfd( -1, &mask, SFD_NONBLOCK | SFD_CLOEXEC );
+    if ( signal_fd >= 0 )
+    {
+        ev_add_io( loop,
+                   &signal_src,
+                   signal_fd,
+                   EPOLLIN,
+                   signal_callback,
+                   loop );
+    }
+
+    if ( stats_path )
+    {
+        ret = stats_open( &stats, stats_path );
+        if ( ret < 0 )
+        {
+            goto cleanup;
+        }
+    }
+
+    if ( jingles_path )
+    {
+        ret = fp_index_open( &jingles, jingles_path );
+        if ( ret < 0 )
+        {
+            goto cleanup;
+        }
+    }
+
+    if ( ads_path )
+    {
+        ret = adset_open( &ads, ads_path );
+        if ( ret < 0 )
+        {
+            goto cleanup;
+        }
+    }
+
+    // the control socket is a convenience, the daemon runs without it
+    const char *runtime_dir = getenv( "XDG_RUNTIME_DIR" );
+    if ( !control_path && runtime_dir && *runtime_dir )
+    {
+        size_t len = strlen( runtime_dir ) + sizeof( "/spotify_mute.sock" );
+        default_control_path = alloc_malloc( ALLOC_MAIN, len );
+        if ( default_control_path )
+        {
+            snprintf( default_control_path,
+                      len,
+                      "%s/spotify_mute.sock",
+                      runtime_dir );
+            control_path = default_control_path;
+        }
+    }
+    if ( control_path )
+    {
+        control_ctx.sessions = sessions;
+        control_ctx.num_sessions = num_sessions;
+        control_open( &control,
+                      loop,
+                      control_path,
+                      control_command,
+                      &control_ctx );
+    }
+
+    // so is the state page
+    if ( !page_path )
+    {
+        snprintf( default_page_path,
+                  sizeof( default_page_path ),
+                  STATEPAGE_DEFAULT_PATH,
+                  (unsigned)getuid() );
+        page_path = default_page_path;
+    }
+    statepage_open( &page, page_path, (unsigned)num_sessions );
+
+    if ( events_path )
+    {
+        ret = ndjson_open( &events, loop, events_path );
+        if ( ret < 0 )
+        {
+            goto cleanup;
+        }
+
+        // a consumer that went away must not take the daemon with it
+        signal( SIGPIPE, SIG_IGN );
+
+        // stdout belongs to the events now, keep the log readable
+        if ( strcmp( events_path, "-" ) == 0 )
+        {
+            fflush( stdout );
+            dup2( STDERR_FILENO, STDOUT_FILENO );
+        }
+    }
+
+    for ( int i = 0; i < num_sessions; ++i )
+    {
+        sessions[i].control = control;
+        sessions[i].page = page;
+        sessions[i].events = events;
+        sessions[i].stats = stats_path ? &stats : NULL;
+        sessions[i].ads = ads_path ? &ads : NULL;
+        sessions[i].jingles = jingles_path ? &jingles : NULL;
+        sessions[i].index = (uint16_t)i;
+        if ( session_start( &sessions[i], loop ) >= 0 )
+        {
+            running++;
+        }
+        else
+        {
+            fprintf( stderr,
+                     "Skipping session %s\n",
+                     sessions[i].bus_address ? sessions[i].bus_address
+                                             : "(user)" );
+        }
+    }
+
+    if ( !running )
+    {
+        ret = -ENOENT;
+        goto cleanup;
+    }
+
+    ret = ev_loop_run( loop );
+
+cleanup:
+    for ( int i = 0; i < num_sessions; ++i )
+    {
+        session_stop( &sessions[i] );
+        alloc_free( ALLOC_MAIN, sessions[i].bus_address );
+        alloc_free( ALLOC_MAIN, sessions[i].pa_server );
+    }
+    alloc_free( ALLOC_MAIN, sessions );
+
+    control_close( control );
+    alloc_free( ALLOC_MAIN, default_control_path );
+    statepage_close( page, page_path );
+    ndjson_close( events );
+
+    if ( stats_path )
+    {
+        stats_close( &stats );
+    }
+    fp_index_close( &jingles );
+    adset_close( &ads );
+
+    ev_source_free( signal_src );
+    if ( signal_fd >= 0 )
+    {
+        close( signal_fd );
+    }
+    ev_loop_free( loop );
+
+    // everything is released by now, whatever is live is a leak
+    if ( ALLOC_STATS_ENABLED )
+    {
+        alloc_dump( stderr );
+    }
 
     return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,386 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "metadata_cache.h"
+
+// function prototypes
+int md_cache_update( md_cache_t *cache,
+                     int key_idx,
+                     char type,
+                     const dbus_v_t *v,
+                     bool in_dict );
+void md_cache_clear_entry( md_cache_t *cache, md_entry_t *entry );
+int md_cache_drop_unseen( md_cache_t *cache, const bool *seen );
+
+void md_cache_init( md_cache_t *cache )
+{
+    memset( cache, 0, sizeof( *cache ) );
+}
+
+/*
+ * Free all cached values and keys. The cache can be reused after calling
+ * `md_cache_init()` again.
+ */
+void md_cache_free( md_cache_t *cache )
+{
+    for ( int i = 0; i < cache->len; ++i )
+    {
+        alloc_free( ALLOC_CACHE, cache->entries[i].key );
+        alloc_free( ALLOC_CACHE, cache->entries[i].storage );
+    }
+    md_cache_init( cache );
+}
+
+/*
+ * Drop every cached value, keeping the interned keys and the rules. Every
+ * key that held a value gets a new version so dependent rules run once more.
+ *
+ * Returns: the number of entries that were cleared.
+ */
+int md_cache_clear( md_cache_t *cache )
+{
+    int changed = 0;
+    for ( int i = 0; i < cache->len; ++i )
+    {
+        if ( cache->entries[i].type )
+        {
+            md_cache_clear_entry( cache, &cache->entries[i] );
+            changed++;
+        }
+    }
+    return changed;
+}
+
+/*
+ * Look up the slot index for a key, creating an empty slot if the key has not
+ * been seen before. Slot indices are stable for the lifetime of the cache.
+ *
+ * Returns: the slot index, or a negative errno if the cache is full.
+ */
+int md_cache_key( md_cache_t *cache, const char *key )
+{
+    int key_idx = md_cache_find( cache, key );
+    if ( key_idx >= 0 )
+    {
+        return key_idx;
+    }
+
+    if ( cache->len >= MD_CACHE_MAX_KEYS )
+    {
+        fprintf( stderr, "Error: metadata cache full, dropping %s\n", key );
+        return -ENOSPC;
+    }
+
+    md_entry_t *entry = &cache->entries[cache->len];
+    memset( entry, 0, sizeof( *entry ) );
+    entry->key = alloc_malloc( ALLOC_CACHE, strlen( key ) + 1 );
+    if ( !entry->key )
+    {
+        return -ENOMEM;
+    }
+    strcpy( entry->key, key );
+
+    return cache->len++;
+}
+
+/*
+ * Look up the slot index for a key without creating one.
+ *
+ * Returns: the slot index, or -1 if the cache does not keep the key.
+ */
+int md_cache_find( const md_cache_t *cache, const char *key )
+{
+    for ( int i = 0; i < cache->len; ++i )
+    {
+        if ( strcmp( cache->entries[i].key, key ) == 0 )
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const md_entry_t *md_cache_get( const md_cache_t *cache, int key_idx )
+{
+    if ( key_idx < 0 || key_idx >= cache->len )
+    {
+        return NULL;
+    }
+    return &cache->entries[key_idx];
+}
+
+/*
+ * Check whether the decoder can skip copying a value (see
+ * `bus_read_sv_array_skip()`): the cache does not keep the key, or already
+ * holds the same value.
+ */
+bool md_cache_skip( const md_cache_t *cache,
+                    const char *key,
+                    char type,
+                    const dbus_v_t *v )
+{
+    int key_idx = md_cache_find( cache, key );
+    if ( key_idx < 0 )
+    {
+        return true;
+    }
+
+    const md_entry_t *entry = &cache->entries[key_idx];
+    return entry->type && entry->type == type &&
+           bus_v_equal( type, &entry->v, v );
+}
+
+void md_cache_clear_entry( md_cache_t *cache, md_entry_t *entry )
+{
+    if ( !entry->type )
+    {
+        return;
+    }
+
+    alloc_free( ALLOC_CACHE, entry->storage );
+    entry->storage = NULL;
+    entry->type = 0;
+    memset( &entry->v, 0, sizeof( entry->v ) );
+    entry->version = ++cache->generation;
+}
+
+/*
+ * Diff a single value against the cache and copy it in if it changed.
+ *
+ * Returns: 1 if the value changed, 0 if it was identical, a negative errno on
+ * failure.
+ */
+int md_cache_update( md_cache_t *cache,
+                     int key_idx,
+                     char type,
+                     const dbus_v_t *v,
+                     bool in_dict )
+{
+    md_entry_t *entry = &cache->entries[key_idx];
+    entry->in_dict = in_dict;
+
+    // unchanged values are not copied and keep their version
+    if ( entry->type == type && bus_v_equal( type, &entry->v, v ) )
+    {
+        return 0;
+    }
+
+    void *storage = NULL;
+    size_t bytes = bus_v_storage_size( type, v );
+    if ( bytes )
+    {
+        storage = alloc_malloc( ALLOC_CACHE, bytes );
+        if ( !storage )
+        {
+            return -ENOMEM;
+        }
+    }
+
+    alloc_free( ALLOC_CACHE, entry->storage );
+    entry->storage = storage;
+    entry->type = type;
+    bus_v_copy( &entry->v, type, v, storage );
+    entry->version = ++cache->generation;
+
+    return 1;
+}
+
+/*
+ * Set a single property (e.g. PlaybackStatus) in the cache.
+ *
+ * Returns: 1 if the value changed, 0 if it was identical or the key is not
+ * kept, a negative errno on failure.
+ */
+int md_cache_set( md_cache_t *cache,
+                  const char *key,
+                  char type,
+                  const dbus_v_t *v )
+{
+    int key_idx = md_cache_find( cache, key );
+    if ( key_idx < 0 )
+    {
+        return 0;
+    }
+    return md_cache_update( cache, key_idx, type, v, false );
+}
+
+/*
+ * Drop dictionary keys that were not part of the latest dictionary.
+ */
+int md_cache_drop_unseen( md_cache_t *cache, const bool *seen )
+{
+    int changed = 0;
+    for ( int i = 0; i < cache->len; ++i )
+    {
+        md_entry_t *entry = &cache->entries[i];
+        if ( entry->in_dict && !seen[i] && entry->type )
+        {
+            md_cache_clear_entry( cache, entry );
+            changed++;
+        }
+    }
+    return changed;
+}
+
+/*
+ * Apply a full Metadata dictionary decoded by `bus_read_sv_array()`.
+ *
+ * Returns: the number of keys that changed, or a negative errno on failure.
+ */
+int md_cache_apply_sv_array( md_cache_t *cache,
+                             const dbus_sv_array_t *sv_array )
+{
+    bool seen[MD_CACHE_MAX_KEYS] = { 0 };
+    int changed = 0;
+
+    alloc_event( ALLOC_CACHE );
+
+    for ( int i = 0; i < sv_array->len; ++i )
+    {
+        const dbus_sv_t *sv = &sv_array->sv_array[i];
+        int key_idx = md_cache_find( cache, sv->s );
+        if ( key_idx < 0 )
+        {
+            continue;
+        }
+        seen[key_idx] = true;
+
+        // skipped by the decoder, the cached value is current
+        if ( !sv->v_type )
+        {
+            continue;
+        }
+
+        int ret = md_cache_update( cache, key_idx, sv->v_type, &sv->v, true );
+        if ( ret < 0 )
+        {
+            return ret;
+        }
+        changed += ret;
+    }
+
+    return changed + md_cache_drop_unseen( cache, seen );
+}
+
+/*
+ * Apply a full Metadata dictionary given as a decoded `a{sv}` node, as found
+ * nested inside a PropertiesChanged signal.
+ *
+ * Returns: the number of keys that changed, or a negative errno on failure.
+ */
+int md_cache_apply_dict( md_cache_t *cache, const dbus_node_t *dict )
+{
+    bool seen[MD_CACHE_MAX_KEYS] = { 0 };
+    int changed = 0;
+
+    if ( dict->type != SD_BUS_TYPE_ARRAY )
+    {
+        return -EINVAL;
+    }
+
+    const dbus_node_t *entry = dict + 1;
+    for ( uint32_t i = 0; i < dict->len; ++i, entry += entry->size )
+    {
+        // each entry is a dict entry holding a string key and a value
+        if ( entry->type != SD_BUS_TYPE_DICT_ENTRY || entry->len != 2 ||
+             entry[1].type != 's' )
+        {
+            return -EINVAL;
+        }
+
+        int key_idx = md_cache_find( cache, entry[1].v.s );
+        if ( key_idx < 0 )
+        {
+            continue;
+        }
+        seen[key_idx] = true;
+
+        // skipped by the decoder, the cached value is current
+        if ( !entry[2].type )
+        {
+            continue;
+        }
+
+        char type;
+        dbus_v_t v;
+        bus_node_v( &entry[2], &type, &v );
+
+        int ret = md_cache_update( cache, key_idx, type, &v, true );
+        if ( ret < 0 )
+        {
+            return ret;
+        }
+        changed += ret;
+    }
+
+    return changed + md_cache_drop_unseen( cache, seen );
+}
+
+/*
+ * Register a decision rule depending on the given keys. The rule first runs
+ * once one of its keys has a value.
+ *
+ * Returns: 0 (`EXIT_SUCCESS`) on success, a negative errno on failure.
+ */
+int md_cache_add_rule( md_cache_t *cache,
+                       const char *const *keys,
+                       int num_keys,
+                       md_rule_fn fn,
+                       void *userdata )
+{
+    if ( cache->num_rules >= MD_CACHE_MAX_RULES ||
+         num_keys > MD_RULE_MAX_KEYS )
+    {
+        return -ENOSPC;
+    }
+
+    md_rule_t *rule = &cache->rules[cache->num_rules];
+    memset( rule, 0, sizeof( *rule ) );
+    for ( int i = 0; i < num_keys; ++i )
+    {
+        int key_idx = md_cache_key( cache, keys[i] );
+        if ( key_idx < 0 )
+        {
+            return key_idx;
+        }
+        rule->keys[rule->num_keys++] = key_idx;
+    }
+    rule->fn = fn;
+    rule->userdata = userdata;
+    cache->num_rules++;
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Run every rule for which at least one dependency changed since it last ran.
+ *
+ * Returns: the number of rules that ran.
+ */
+int md_cache_run_rules( md_cache_t *cache )
+{
+    int ran = 0;
+    for ( int r = 0; r < cache->num_rules; ++r )
+    {
+        md_rule_t *rule = &cache->rules[r];
+
+        bool dirty = false;
+        for ( int i = 0; i < rule->num_keys && !dirty; ++i )
+        {
+            dirty = cache->entries[rule->keys[i]].version > rule->last_run;
+        }
+        if ( !dirty )
+        {
+            continue;
+        }
+
+        rule->last_run = cache->generation;
+        rule->fn( cache, rule->userdata );
+        ran++;
+    }
+    return ran;
+}
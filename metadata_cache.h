@@ -0,0 +1,97 @@
+#ifndef SDE_METADATA_CACHE_H
+#define SDE_METADATA_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dbus_utils.h"
+
+#define MD_CACHE_MAX_KEYS 32
+#define MD_CACHE_MAX_RULES 8
+#define MD_RULE_MAX_KEYS 4
+
+typedef struct md_cache md_cache_t;
+
+// decision rule, re-run only when one of the keys it depends on changed
+typedef void ( *md_rule_fn )( md_cache_t *cache, void *userdata );
+
+typedef struct
+{
+    char *key;
+
+    // cached value, strings and containers point into `storage`
+    char type; // 0 if the key is not currently present
+    dbus_v_t v;
+    void *storage;
+
+    // cache generation at which the value last changed
+    uint32_t version;
+
+    // key came from a Metadata dictionary and is dropped when a newer
+    // dictionary no longer contains it
+    bool in_dict;
+} md_entry_t;
+
+typedef struct
+{
+    md_rule_fn fn;
+    void *userdata;
+    int keys[MD_RULE_MAX_KEYS];
+    int num_keys;
+
+    // cache generation at which the rule last ran
+    uint32_t last_run;
+} md_rule_t;
+
+/* Persistent per-player metadata cache.
+ *
+ * Only keys interned up front with `md_cache_key()` or `md_cache_add_rule()`
+ * are kept, the values of every other key a player sends are ignored. The
+ * key table is sized for what the daemon reads, not for what players send.
+ *
+ * Deltas (a Metadata dictionary or single properties from PropertiesChanged)
+ * are diffed key by key against the cached values. Only keys whose value
+ * actually changed are copied into the cache, and each change bumps the
+ * cache generation and stamps it on the key. Rules remember the generation
+ * they last ran at, so `md_cache_run_rules()` skips every rule whose keys did
+ * not change.
+ */
+struct md_cache
+{
+    uint32_t generation;
+
+    int len;
+    md_entry_t entries[MD_CACHE_MAX_KEYS];
+
+    int num_rules;
+    md_rule_t rules[MD_CACHE_MAX_RULES];
+};
+
+void md_cache_init( md_cache_t *cache );
+void md_cache_free( md_cache_t *cache );
+int md_cache_clear( md_cache_t *cache );
+
+int md_cache_key( md_cache_t *cache, const char *key );
+int md_cache_find( const md_cache_t *cache, const char *key );
+const md_entry_t *md_cache_get( const md_cache_t *cache, int key_idx );
+bool md_cache_skip( const md_cache_t *cache,
+                    const char *key,
+                    char type,
+                    const dbus_v_t *v );
+
+int md_cache_set( md_cache_t *cache,
+                  const char *key,
+                  char type,
+                  const dbus_v_t *v );
+int md_cache_apply_sv_array( md_cache_t *cache,
+                             const dbus_sv_array_t *sv_array );
+int md_cache_apply_dict( md_cache_t *cache, const dbus_node_t *dict );
+
+int md_cache_add_rule( md_cache_t *cache,
+                       const char *const *keys,
+                       int num_keys,
+                       md_rule_fn fn,
+                       void *userdata );
+int md_cache_run_rules( md_cache_t *cache );
+
+#endif // SDE_METADATA_CACHE_H
@@ -0,0 +1,467 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "ndjson.h"
+#include "stats.h"
+
+typedef struct
+{
+    size_t len;
+    char data[NDJSON_LINE_MAX];
+} ndjson_line_t;
+
+struct ndjson
+{
+    int fd;             // -1 once the consumer went away
+    bool socket;        // stdout is a socket, see ndjson_open()
+    ev_source_t *io;    // NULL for regular files, they never block
+    ev_source_t *flush; // once per loop iteration while lines are queued
+
+    ndjson_line_t *lines;
+    unsigned head;   // oldest queued line
+    unsigned count;  // queued lines
+    size_t head_off; // bytes of the oldest line already written
+    bool waiting;    // for the consumer to make room
+
+    ndjson_line_t *cur; // line being serialized, NULL if dropped
+    bool overflow;      // the current line did not fit
+
+    uint64_t dropped; // since the last "dropped" event
+};
+
+// function prototypes
+void ndjson_put( ndjson_t *nd, const char *data, size_t len );
+void ndjson_escape( ndjson_t *nd, const char *str );
+void ndjson_key( ndjson_t *nd, const char *key );
+ndjson_line_t *ndjson_push( ndjson_t *nd );
+ssize_t ndjson_write( ndjson_t *nd, struct iovec *iov, int n );
+void ndjson_fail( ndjson_t *nd, int err );
+void ndjson_flush( ev_source_t *src, uint32_t events, void *userdata );
+
+/*
+ * Open the event output: "-" for stdout, otherwise a file or FIFO that is
+ * appended to. A FIFO nobody reads yet is opened anyway, events are dropped
+ * once its buffer is full.
+ *
+ * O_NONBLOCK belongs to the open file description, and the one of stdout is
+ * shared with stderr on a terminal and with the shell. stdout is reopened
+ * through /proc to get a description of our own instead. A socket cannot be
+ * reopened, it is written with MSG_DONTWAIT. Without /proc a pipe or
+ * terminal on stdout is written blocking.
+ *
+ * Returns: 0 (`EXIT_SUCCESS`) on success, a negative errno on failure.
+ */
+int ndjson_open( ndjson_t **ret, ev_loop_t *loop, const char *path )
+{
+    int r = 0;
+
+    ndjson_t *nd = calloc( 1, sizeof( *nd ) );
+    if ( !nd )
+    {
+        return -ENOMEM;
+    }
+    nd->fd = -1;
+
+    nd->lines = malloc( sizeof( *nd->lines ) * NDJSON_QUEUE_LINES );
+    if ( !nd->lines )
+    {
+        r = -ENOMEM;
+        goto cleanup;
+    }
+
+    int flags = O_WRONLY | O_APPEND | O_NONBLOCK | O_CLOEXEC;
+    if ( strcmp( path, "-" ) == 0 )
+    {
+        nd->fd = open( "/proc/self/fd/1", flags );
+        if ( nd->fd < 0 )
+        {
+            struct stat st;
+            nd->fd = fcntl( STDOUT_FILENO, F_DUPFD_CLOEXEC, 0 );
+            nd->socket = nd->fd >= 0 && fstat( nd->fd, &st ) == 0 &&
+                         S_ISSOCK( st.st_mode );
+        }
+    }
+    else
+    {
+        nd->fd = open( path, flags | O_CREAT, 0644 );
+        if ( nd->fd < 0 && errno == ENXIO )
+        {
+            // a FIFO without a reader, hold it open ourselves
+            nd->fd = open( path, ( flags & ~O_WRONLY ) | O_RDWR, 0644 );
+        }
+    }
+    if ( nd->fd < 0 )
+    {
+        r = -errno;
+        goto cleanup;
+    }
+
+    // epoll refuses regular files, writes to them never block anyway
+    r = ev_add_io( loop, &nd->io, nd->fd, 0, ndjson_flush, nd );
+    if ( r == -EPERM )
+    {
+        nd->io = NULL;
+        r = 0;
+    }
+    if ( r < 0 )
+    {
+        goto cleanup;
+    }
+
+    r = ev_add_defer( loop, &nd->flush, ndjson_flush, nd );
+
+cleanup:
+    if ( r < 0 )
+    {
+        fprintf( stderr,
+                 "Could not open event output %s: %s\n",
+                 path,
+                 strerror( -r ) );
+        ndjson_close( nd );
+        nd = NULL;
+    }
+
+    *ret = nd;
+    return r;
+}
+
+void ndjson_close( ndjson_t *nd )
+{
+    if ( !nd )
+    {
+        return;
+    }
+
+    // last chance for the queued events, without waiting for the consumer
+    if ( nd->fd >= 0 && nd->flush )
+    {
+        ndjson_flush( NULL, 0, nd );
+    }
+
+    ev_source_free( nd->io );
+    ev_source_free( nd->flush );
+    if ( nd->fd >= 0 )
+    {
+        close( nd->fd );
+    }
+    free( nd->lines );
+    free( nd );
+}
+
+ssize_t ndjson_write( ndjson_t *nd, struct iovec *iov, int n )
+{
+    if ( !nd->socket )
+    {
+        return writev( nd->fd, iov, n );
+    }
+
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = (size_t)n };
+    return sendmsg( nd->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL );
+}
+
+/*
+ * The consumer went away. Stop watching and writing the output for good,
+ * what is queued and every later event is counted as dropped.
+ */
+void ndjson_fail( ndjson_t *nd, int err )
+{
+    fprintf( stderr, "Event output closed: %s\n", strerror( err ) );
+
+    // an fd with an error or hangup stays ready, it would spin the loop
+    ev_source_free( nd->io );
+    nd->io = NULL;
+    close( nd->fd );
+    nd->fd = -1;
+
+    nd->dropped += nd->count;
+    nd->count = 0;
+    nd->head_off = 0;
+    nd->waiting = false;
+    ev_defer_enable( nd->flush, false );
+}
+
+/*
+ * Write as many queued lines as the output takes, `NDJSON_BATCH` per call.
+ */
+void ndjson_flush( ev_source_t *src, uint32_t events, void *userdata )
+{
+    (void)( src );
+    ndjson_t *nd = userdata;
+    struct iovec iov[NDJSON_BATCH];
+
+    if ( nd->fd < 0 )
+    {
+        return;
+    }
+    if ( events & ( EPOLLERR | EPOLLHUP ) )
+    {
+        ndjson_fail( nd, EPIPE );
+        return;
+    }
+
+    nd->waiting = false;
+    while ( nd->count )
+    {
+        int n = 0;
+        for ( unsigned i = 0; i < nd->count && n < NDJSON_BATCH; ++i )
+        {
+            ndjson_line_t *line =
+                &nd->lines[( nd->head + i ) % NDJSON_QUEUE_LINES];
+            size_t off = i ? 0 : nd->head_off;
+            iov[n].iov_base = line->data + off;
+            iov[n].iov_len = line->len - off;
+            n++;
+        }
+
+        ssize_t written = ndjson_write( nd, iov, n );
+        if ( written < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            if ( errno == EAGAIN && nd->io )
+            {
+                // resume once the consumer caught up
+                nd->waiting = true;
+                ev_io_set_events( nd->io, EPOLLOUT );
+                ev_defer_enable( nd->flush, false );
+                return;
+            }
+
+            ndjson_fail( nd, errno );
+            return;
+        }
+
+        size_t left = (size_t)written;
+        while ( left )
+        {
+            ndjson_line_t *line = &nd->lines[nd->head];
+            size_t rest = line->len - nd->head_off;
+            if ( left < rest )
+            {
+                nd->head_off += left;
+                break;
+            }
+            left -= rest;
+            nd->head_off = 0;
+            nd->head = ( nd->head + 1 ) % NDJSON_QUEUE_LINES;
+            nd->count--;
+        }
+    }
+
+    if ( nd->io )
+    {
+        ev_io_set_events( nd->io, 0 );
+    }
+    ev_defer_enable( nd->flush, false );
+}
+
+/*
+ * Take the next free line of the queue, NULL if it is full.
+ */
+ndjson_line_t *ndjson_push( ndjson_t *nd )
+{
+    if ( nd->count >= NDJSON_QUEUE_LINES )
+    {
+        return NULL;
+    }
+
+    ndjson_line_t *line =
+        &nd->lines[( nd->head + nd->count ) % NDJSON_QUEUE_LINES];
+    line->len = 0;
+    nd->count++;
+
+    // written out once everything of this iteration is queued, unless the
+    // consumer is being waited for already
+    if ( !nd->waiting )
+    {
+        ev_defer_enable( nd->flush, true );
+    }
+
+    return line;
+}
+
+void ndjson_put( ndjson_t *nd, const char *data, size_t len )
+{
+    // keep room for the closing "}\n"
+    if ( nd->cur->len + len + 2 > NDJSON_LINE_MAX )
+    {
+        nd->overflow = true;
+        return;
+    }
+    memcpy( nd->cur->data + nd->cur->len, data, len );
+    nd->cur->len += len;
+}
+
+/*
+ * Append `str` as a JSON string. UTF-8 passes through, quotes, backslashes
+ * and control characters are escaped.
+ */
+void ndjson_escape( ndjson_t *nd, const char *str )
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *run = str;
+
+    ndjson_put( nd, "\"", 1 );
+    for ( const char *p = str; *p; ++p )
+    {
+        unsigned char c = (unsigned char)*p;
+        if ( c >= 0x20 && c != '"' && c != '\\' )
+        {
+            continue;
+        }
+
+        // copy the plain run up to here in one go
+        ndjson_put( nd, run, (size_t)( p - run ) );
+        run = p + 1;
+        if ( c == '"' || c == '\\' )
+        {
+            char esc[2] = { '\\', (char)c };
+            ndjson_put( nd, esc, 2 );
+        }
+        else
+        {
+            char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+            ndjson_put( nd, esc, 6 );
+        }
+    }
+    ndjson_put( nd, run, strlen( run ) );
+    ndjson_put( nd, "\"", 1 );
+}
+
+void ndjson_key( ndjson_t *nd, const char *key )
+{
+    ndjson_put( nd, ",", 1 );
+    ndjson_escape( nd, key );
+    ndjson_put( nd, ":", 1 );
+}
+
+/*
+ * Start an event. The time (CLOCK_REALTIME in usec) and the event name are
+ * always the first two fields.
+ *
+ * Returns: false if the event is dropped.
+ */
+bool ndjson_begin( ndjson_t *nd, const char *event )
+{
+    char buf[32];
+
+    if ( !nd )
+    {
+        return false;
+    }
+
+    nd->cur = NULL;
+    nd->overflow = false;
+
+    // nobody reads the output any more
+    if ( nd->fd < 0 )
+    {
+        nd->dropped++;
+        return false;
+    }
+
+    // report what was lost first, that takes a line of its own
+    if ( nd->dropped && nd->count + 2 <= NDJSON_QUEUE_LINES )
+    {
+        uint64_t dropped = nd->dropped;
+        nd->dropped = 0;
+        ndjson_begin( nd, "dropped" );
+        ndjson_int( nd, "count", (long long)dropped );
+        ndjson_end( nd );
+    }
+
+    nd->cur = ndjson_push( nd );
+    if ( !nd->cur )
+    {
+        nd->dropped++;
+        return false;
+    }
+
+    int len = snprintf( buf,
+                        sizeof( buf ),
+                        "{\"time\":%llu",
+                        (unsigned long long)stats_time() );
+    ndjson_put( nd, buf, (size_t)len );
+    ndjson_key( nd, "event" );
+    ndjson_escape( nd, event );
+
+    return true;
+}
+
+void ndjson_str( ndjson_t *nd, const char *key, const char *value )
+{
+    if ( !nd || !nd->cur )
+    {
+        return;
+    }
+    ndjson_key( nd, key );
+    if ( value )
+    {
+        ndjson_escape( nd, value );
+    }
+    else
+    {
+        ndjson_put( nd, "null", 4 );
+    }
+}
+
+void ndjson_int( ndjson_t *nd, const char *key, long long value )
+{
+    char buf[24];
+
+    if ( !nd || !nd->cur )
+    {
+        return;
+    }
+    int len = snprintf( buf, sizeof( buf ), "%lld", value );
+    ndjson_key( nd, key );
+    ndjson_put( nd, buf, (size_t)len );
+}
+
+void ndjson_bool( ndjson_t *nd, const char *key, bool value )
+{
+    if ( !nd || !nd->cur )
+    {
+        return;
+    }
+    ndjson_key( nd, key );
+    ndjson_put( nd, value ? "true" : "false", value ? 4 : 5 );
+}
+
+/*
+ * Finish the event and queue it. A line that outgrew `NDJSON_LINE_MAX` is
+ * dropped rather than written as broken JSON.
+ */
+void ndjson_end( ndjson_t *nd )
+{
+    if ( !nd || !nd->cur )
+    {
+        return;
+    }
+
+    if ( nd->overflow )
+    {
+        // the line is the newest one queued, take it back
+        nd->count--;
+        nd->dropped++;
+    }
+    else
+    {
+        // ndjson_put() always left room for this
+        memcpy( nd->cur->data + nd->cur->len, "}\n", 2 );
+        nd->cur->len += 2;
+    }
+    nd->cur = NULL;
+}
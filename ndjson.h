@@ -0,0 +1,42 @@
+#ifndef SDE_NDJSON_H
+#define SDE_NDJSON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "event_loop.h"
+
+/* Newline delimited JSON event output.
+ *
+ * Events are serialized straight into a fixed queue of line buffers, one
+ * object per line, with strings escaped in place. Nothing is allocated per
+ * event. The queue is written out with batched `writev()` calls once per loop
+ * iteration, and again whenever a slow consumer makes room.
+ *
+ * The output never blocks the daemon. Pipes and FIFOs are non-blocking, and
+ * an event that finds the queue full is dropped and counted. Once there is
+ * room again the next line reports the count as a "dropped" event. An output
+ * whose consumer went away is closed, later events only count as dropped.
+ *
+ * Every event starts with `ndjson_begin()` and ends with `ndjson_end()`. The
+ * field calls in between are no-ops if the event was dropped, and all calls
+ * accept a NULL output.
+ */
+
+#define NDJSON_QUEUE_LINES 256
+#define NDJSON_LINE_MAX 1024
+#define NDJSON_BATCH 64 // lines per writev()
+
+typedef struct ndjson ndjson_t;
+
+int ndjson_open( ndjson_t **ret, ev_loop_t *loop, const char *path );
+void ndjson_close( ndjson_t *nd );
+
+bool ndjson_begin( ndjson_t *nd, const char *event );
+void ndjson_str( ndjson_t *nd, const char *key, const char *value );
+void ndjson_int( ndjson_t *nd, const char *key, long long value );
+void ndjson_bool( ndjson_t *nd, const char *key, bool value );
+void ndjson_end( ndjson_t *nd );
+
+#endif // SDE_NDJSON_H
@@ -9,66 +9,144 @@ this software. If not, see
 <http://creativecommons.org/publicdomain/zero/1.0/>.*/
 
 #include "pactl.h"
+#include "alloc.h"
+#include "probes.h"
 #include <assert.h>
 #include <errno.h>
-#include <pthread.h>
 #include <pulse/context.h>
 #include <pulse/error.h>
 #include <pulse/introspect.h>
 #include <pulse/mainloop-api.h>
 #include <pulse/mainloop-signal.h>
 #include <pulse/mainloop.h>
+#include <pulse/rtclock.h>
+#include <pulse/stream.h>
+#include <pulse/subscribe.h>
+#include <pulse/timeval.h>
 #include <pulse/xmalloc.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
-
-pa_proplist *proplist = NULL;
-pa_context *context = NULL;
-char context_ready;
-pa_mainloop_api *mainloop_api = NULL;
 
 #define NUM_SINKS 100
-int sink_input_idx[NUM_SINKS];
-int found_sinks;
 
-int retry_update;
-int pending_update;
-int pending_mute;
+// the monitor stream delivers audio in chunks of this length
+#define MONITOR_FRAGMENT_MS 100
 
-// define nanosleep
-extern int nanosleep( const struct timespec *req, struct timespec *rem );
+// reconnect backoff, doubled after every failed attempt
+#define RECONNECT_MIN_USEC ( 500 * 1000ULL )
+#define RECONNECT_MAX_USEC ( 60 * 1000 * 1000ULL )
 
-void context_drain_complete( pa_context *c, void *userdata )
+struct pactl
 {
-    (void)( userdata );
-    pa_context_disconnect( c );
-}
+    pa_mainloop_api *api;
+    char *server;
+    pa_proplist *proplist;
+    pa_context *context;
+    char context_ready;
 
-void drain( void )
-{
-    if ( !context )
-        return;
-    pa_operation *o;
-    if ( !( o = pa_context_drain( context, context_drain_complete, NULL ) ) )
-        pa_context_disconnect( context );
-    else
-        pa_operation_unref( o );
-}
+    int sink_input_idx[NUM_SINKS];
+    int found_sinks;
+
+    int retry_update;
+    int desired_mute; // -1 until set_mute() is called
+    pa_usec_t mute_requested; // to report the mute latency
+
+    // reconnect state
+    pa_time_event *reconnect_event;
+    pa_usec_t backoff;
+    int parked;
+
+    // record stream on the first Spotify sink input, if requested
+    audio_monitor_cb monitor_cb;
+    void *monitor_userdata;
+    unsigned monitor_rate;
+    pa_stream *monitor;
+    int monitor_idx; // sink input being monitored, -1 if none
+
+    // result of every mute request, if requested
+    audio_mute_cb mute_cb;
+    void *mute_userdata;
+};
 
+void pactl_connect( pactl_t *pa );
+void pactl_schedule_reconnect( pactl_t *pa );
+void pactl_monitor_start( pactl_t *pa, const pa_sink_input_info *i );
+void pactl_monitor_stop( pactl_t *pa );
+
+// completion of the mutes set_mute() sent, timed from its request
 void mute_callback( pa_context *c, int success, void *userdata )
 {
-    (void)( userdata );
+    pactl_t *pa = userdata;
+    pa_usec_t latency = pa_rtclock_now() - pa->mute_requested;
+    SM_PROBE2( mute_done, success, latency );
+    if ( pa->mute_cb )
+        pa->mute_cb( success, latency, pa->mute_userdata );
     if ( !success )
     {
         fprintf( stderr,
                  "Failure: %s\n",
                  pa_strerror( pa_context_errno( c ) ) );
-        if ( retry_update > 0 )
+        // the sink input probably went away, look for it again
+        if ( pa->retry_update > 0 )
+        {
+            pa->retry_update--;
+            update_sink( pa );
+        }
+    }
+}
+
+// completion of a mute nobody requested just now: a stream that showed up
+// later was brought in line, there is no request to time it from
+void sink_mute_callback( pa_context *c, int success, void *userdata )
+{
+    pactl_t *pa = userdata;
+    if ( pa->mute_cb )
+        pa->mute_cb( success, 0, pa->mute_userdata );
+    if ( !success )
+        fprintf( stderr,
+                 "Failure: %s\n",
+                 pa_strerror( pa_context_errno( c ) ) );
+}
+
+void add_sink( pactl_t *pa, const pa_sink_input_info *i )
+{
+    pactl_monitor_start( pa, i );
+
+    for ( int n = 0; n < pa->found_sinks; ++n )
+        if ( pa->sink_input_idx[n] == (int)i->index )
+            return;
+    if ( pa->found_sinks >= NUM_SINKS )
+        return;
+
+    fprintf( stderr, "add_sink(): Spotify is %u\n", i->index );
+    pa->sink_input_idx[pa->found_sinks++] = i->index;
+
+    // bring new streams in line with the current decision
+    if ( pa->desired_mute >= 0 && i->mute != pa->desired_mute )
+        pa_operation_unref( pa_context_set_sink_input_mute( pa->context,
+                                                            i->index,
+                                                            pa->desired_mute,
+                                                            sink_mute_callback,
+                                                            pa ) );
+}
+
+void remove_sink( pactl_t *pa, uint32_t idx )
+{
+    if ( pa->monitor_idx == (int)idx )
+    {
+        // follow the next Spotify stream, if there is one
+        pactl_monitor_stop( pa );
+        update_sink( pa );
+    }
+
+    for ( int n = 0; n < pa->found_sinks; ++n )
+    {
+        if ( pa->sink_input_idx[n] == (int)idx )
         {
-            pending_update = 1;
-            update_sink();
+            pa->sink_input_idx[n] = pa->sink_input_idx[--pa->found_sinks];
+            pa->sink_input_idx[pa->found_sinks] = -1;
+            return;
         }
     }
 }
@@ -78,156 +156,461 @@ void get_sink_input_info_callback( pa_context *c,
                                    int is_last,
                                    void *userdata )
 {
-    (void)( userdata );
+    pactl_t *pa = userdata;
     if ( is_last < 0 )
     {
+        // not fatal, the state callback deals with a dead connection and a
+        // vanished sink input is picked up by the subscription
         fprintf( stderr,
                  "Failed to get sink input information: %s\n",
                  pa_strerror( pa_context_errno( c ) ) );
-        exit( 1 );
         return;
     }
     if ( is_last )
+        return;
+    assert( i );
+
+    const char *name = pa_proplist_gets( i->proplist, PA_PROP_MEDIA_NAME );
+    SM_PROBE3( sink_input, i->index, name, i->mute );
+    if ( name && !strcmp( name, "Spotify" ) )
+        add_sink( pa, i );
+}
+
+void subscribe_callback( pa_context *c,
+                         pa_subscription_event_type_t t,
+                         uint32_t idx,
+                         void *userdata )
+{
+    pactl_t *pa = userdata;
+    alloc_event( ALLOC_PACTL );
+    if ( ( t & PA_SUBSCRIPTION_EVENT_FACILITY_MASK ) !=
+         PA_SUBSCRIPTION_EVENT_SINK_INPUT )
+        return;
+
+    switch ( t & PA_SUBSCRIPTION_EVENT_TYPE_MASK )
+    {
+        case PA_SUBSCRIPTION_EVENT_NEW:
+            pa_operation_unref(
+                pa_context_get_sink_input_info( c,
+                                                idx,
+                                                get_sink_input_info_callback,
+                                                pa ) );
+            break;
+        case PA_SUBSCRIPTION_EVENT_REMOVE:
+            remove_sink( pa, idx );
+            break;
+        default:
+            break;
+    }
+}
+
+void monitor_read_callback( pa_stream *s, size_t nbytes, void *userdata )
+{
+    (void)( nbytes );
+    pactl_t *pa = userdata;
+    const void *data = NULL;
+    size_t len = 0;
+    const size_t frame = 2 * sizeof( float );
+
+    while ( pa_stream_peek( s, &data, &len ) == 0 && len )
     {
-        retry_update--;
+        // data is NULL for a hole in the stream, skip it
+        if ( data )
+            pa->monitor_cb( data, len / frame, pa->monitor_userdata );
+        pa_stream_drop( s );
+    }
+}
+
+void monitor_state_callback( pa_stream *s, void *userdata )
+{
+    pactl_t *pa = userdata;
+    switch ( pa_stream_get_state( s ) )
+    {
+        case PA_STREAM_FAILED:
+        case PA_STREAM_TERMINATED:
+            pactl_monitor_stop( pa );
+            break;
+
+        case PA_STREAM_UNCONNECTED:
+        case PA_STREAM_CREATING:
+        case PA_STREAM_READY:
+        default:
+            break;
+    }
+}
+
+/* Connect the record stream once we know the sink's monitor source. */
+void monitor_sink_info_callback( pa_context *c,
+                                 const pa_sink_info *i,
+                                 int is_last,
+                                 void *userdata )
+{
+    pactl_t *pa = userdata;
+    if ( is_last < 0 )
+    {
+        fprintf( stderr,
+                 "Failed to get sink information: %s\n",
+                 pa_strerror( pa_context_errno( c ) ) );
+        pa->monitor_idx = -1;
         return;
     }
-    assert( i );
+    if ( is_last || pa->monitor || pa->monitor_idx < 0 )
+        return;
+
+    pa_sample_spec ss = { .format = PA_SAMPLE_FLOAT32NE,
+                          .rate = pa->monitor_rate,
+                          .channels = 2 };
+    pa_buffer_attr attr = {
+        .maxlength = (uint32_t)-1,
+        .fragsize = pa->monitor_rate * MONITOR_FRAGMENT_MS / 1000 * 2 *
+                    (uint32_t)sizeof( float ),
+    };
+    char dev[16];
+    snprintf( dev, sizeof( dev ), "%u", i->monitor_source );
 
-    if ( !strcmp( pa_proplist_gets( i->proplist, PA_PROP_MEDIA_NAME ),
-                  "Spotify" ) )
+    pa->monitor = pa_stream_new( c, "spotify_mute monitor", &ss, NULL );
+    if ( !pa->monitor )
+    {
+        fprintf( stderr, "pa_stream_new() failed.\n" );
+        pa->monitor_idx = -1;
+        return;
+    }
+
+    pa_stream_set_monitor_stream( pa->monitor, (uint32_t)pa->monitor_idx );
+    pa_stream_set_read_callback( pa->monitor, monitor_read_callback, pa );
+    pa_stream_set_state_callback( pa->monitor, monitor_state_callback, pa );
+    if ( pa_stream_connect_record( pa->monitor,
+                                   dev,
+                                   &attr,
+                                   PA_STREAM_DONT_MOVE |
+                                       PA_STREAM_ADJUST_LATENCY ) < 0 )
     {
         fprintf( stderr,
-                 "get_sink_input_info_callback(): Spotify is %u\n",
-                 i->index );
-        sink_input_idx[found_sinks++] = i->index;
-        if ( pending_update )
-        {
-            pending_update = 0;
-            pa_operation_unref(
-                pa_context_set_sink_input_mute( context,
-                                                sink_input_idx[found_sinks - 1],
-                                                pending_mute,
-                                                mute_callback,
-                                                NULL ) );
-        }
+                 "pa_stream_connect_record() failed: %s\n",
+                 pa_strerror( pa_context_errno( c ) ) );
+        pactl_monitor_stop( pa );
     }
 }
 
+/* Monitor `i` unless monitoring is off or another stream is monitored. */
+void pactl_monitor_start( pactl_t *pa, const pa_sink_input_info *i )
+{
+    if ( !pa->monitor_cb || pa->monitor_idx >= 0 )
+        return;
+
+    pa->monitor_idx = (int)i->index;
+    pa_operation_unref(
+        pa_context_get_sink_info_by_index( pa->context,
+                                           i->sink,
+                                           monitor_sink_info_callback,
+                                           pa ) );
+}
+
+void pactl_monitor_stop( pactl_t *pa )
+{
+    pa->monitor_idx = -1;
+    if ( !pa->monitor )
+        return;
+
+    pa_stream_set_read_callback( pa->monitor, NULL, NULL );
+    pa_stream_set_state_callback( pa->monitor, NULL, NULL );
+    pa_stream_disconnect( pa->monitor );
+    pa_stream_unref( pa->monitor );
+    pa->monitor = NULL;
+}
+
+void pactl_set_monitor( pactl_t *pa,
+                        unsigned rate,
+                        audio_monitor_cb cb,
+                        void *userdata )
+{
+    pactl_monitor_stop( pa );
+    pa->monitor_cb = cb;
+    pa->monitor_userdata = userdata;
+    pa->monitor_rate = rate;
+
+    // pick up a stream that is already playing
+    if ( cb && pa->context_ready )
+        update_sink( pa );
+}
+
+void pactl_set_mute_callback( pactl_t *pa, audio_mute_cb cb, void *userdata )
+{
+    pa->mute_cb = cb;
+    pa->mute_userdata = userdata;
+}
+
 void context_state_callback( pa_context *c, void *userdata )
 {
-    (void)( userdata );
+    pactl_t *pa = userdata;
     assert( c );
-    if ( pa_context_get_state( c ) == PA_CONTEXT_READY )
+    switch ( pa_context_get_state( c ) )
     {
-        context_ready = 1;
+        case PA_CONTEXT_READY:
+            pa->context_ready = 1;
+            pa->backoff = 0;
+            pa_context_set_subscribe_callback( c, subscribe_callback, pa );
+            pa_operation_unref( pa_context_subscribe(
+                c, PA_SUBSCRIPTION_MASK_SINK_INPUT, NULL, NULL ) );
+            update_sink( pa );
+            break;
+
+        case PA_CONTEXT_FAILED:
+        case PA_CONTEXT_TERMINATED:
+            fprintf( stderr,
+                     "PulseAudio connection lost: %s\n",
+                     pa_strerror( pa_context_errno( c ) ) );
+            pa->context_ready = 0;
+            pa->found_sinks = 0;
+            pactl_monitor_stop( pa );
+            pactl_schedule_reconnect( pa );
+            break;
+
+        case PA_CONTEXT_UNCONNECTED:
+        case PA_CONTEXT_CONNECTING:
+        case PA_CONTEXT_AUTHORIZING:
+        case PA_CONTEXT_SETTING_NAME:
+        default:
+            break;
     }
 }
 
+void reconnect_callback( pa_mainloop_api *api,
+                         pa_time_event *e,
+                         const struct timeval *tv,
+                         void *userdata )
+{
+    (void)( api );
+    (void)( e );
+    (void)( tv );
+    pactl_connect( userdata );
+}
 
-void *pactl( void *arg )
+/* Retry the connection with exponential backoff. Parked instances don't
+ * retry at all until they are unparked. */
+void pactl_schedule_reconnect( pactl_t *pa )
 {
-    (void)( arg );
-    int ret;
-    pa_mainloop *m = NULL;
-    char *server = NULL;
+    struct timeval tv;
+
+    if ( pa->parked )
+        return;
 
-    proplist = pa_proplist_new();
-    if ( !( m = pa_mainloop_new() ) )
+    pa->backoff = pa->backoff ? pa->backoff * 2 : RECONNECT_MIN_USEC;
+    if ( pa->backoff > RECONNECT_MAX_USEC )
+        pa->backoff = RECONNECT_MAX_USEC;
+    pa_timeval_add( pa_gettimeofday( &tv ), pa->backoff );
+
+    fprintf( stderr,
+             "Reconnecting to PulseAudio in %llu ms\n",
+             (unsigned long long)( pa->backoff / 1000 ) );
+    if ( pa->reconnect_event )
+        pa->api->time_restart( pa->reconnect_event, &tv );
+    else
+        pa->reconnect_event =
+            pa->api->time_new( pa->api, &tv, reconnect_callback, pa );
+}
+
+/* Throw away the old context (if any) and start a new connection. */
+void pactl_connect( pactl_t *pa )
+{
+    pactl_monitor_stop( pa );
+    if ( pa->context )
     {
-        fprintf( stderr, "pa_mainloop_new() failed.\n" );
+        pa_context_set_state_callback( pa->context, NULL, NULL );
+        pa_context_set_subscribe_callback( pa->context, NULL, NULL );
+        pa_context_disconnect( pa->context );
+        pa_context_unref( pa->context );
+        pa->context = NULL;
     }
-    mainloop_api = pa_mainloop_get_api( m );
+    pa->context_ready = 0;
+    pa->found_sinks = 0;
 
-    if ( !( context =
-                pa_context_new_with_proplist( mainloop_api, NULL, proplist ) ) )
+    if ( !( pa->context = pa_context_new_with_proplist( pa->api,
+                                                        NULL,
+                                                        pa->proplist ) ) )
     {
         fprintf( stderr, "pa_context_new() failed.\n" );
+        pactl_schedule_reconnect( pa );
+        return;
     }
 
-    pa_context_set_state_callback( context, context_state_callback, NULL );
-    if ( pa_context_connect( context, server, 0, NULL ) < 0 )
+    pa_context_set_state_callback( pa->context, context_state_callback, pa );
+    if ( pa_context_connect( pa->context, pa->server, 0, NULL ) < 0 )
     {
         fprintf( stderr,
                  "pa_context_connect() failed: %s\n",
-                 pa_strerror( pa_context_errno( context ) ) );
+                 pa_strerror( pa_context_errno( pa->context ) ) );
+        pactl_schedule_reconnect( pa );
+    }
+}
+
+pactl_t *init_pactl( pa_mainloop_api *api, const char *server )
+{
+    pactl_t *pa = alloc_calloc( ALLOC_PACTL, 1, sizeof( *pa ) );
+    if ( !pa )
+    {
+        fprintf( stderr, "calloc() failed.\n" );
+        return NULL;
+    }
+
+    pa->api = api;
+    pa->desired_mute = -1;
+    pa->monitor_idx = -1;
+    for ( int i = 0; i < NUM_SINKS; ++i )
+    {
+        pa->sink_input_idx[i] = -1;
     }
 
-    if ( pa_mainloop_run( m, &ret ) < 0 )
+    if ( server )
     {
-        fprintf( stderr, "pa_mainloop_run() failed.\n" );
+        pa->server = alloc_malloc( ALLOC_PACTL, strlen( server ) + 1 );
+        if ( !pa->server )
+        {
+            free_pactl( pa );
+            return NULL;
+        }
+        strcpy( pa->server, server );
     }
-    return NULL;
+
+    // connection failures are retried, only allocation failures are fatal
+    pa->proplist = pa_proplist_new();
+    pactl_connect( pa );
+
+    return pa;
 }
 
-void update_sink( void )
+void free_pactl( pactl_t *pa )
 {
-    if ( context_ready )
+    if ( !pa )
+        return;
+    if ( pa->reconnect_event )
+        pa->api->time_free( pa->reconnect_event );
+    pactl_monitor_stop( pa );
+    if ( pa->context )
     {
+        pa_context_set_state_callback( pa->context, NULL, NULL );
+        pa_context_set_subscribe_callback( pa->context, NULL, NULL );
+        pa_context_disconnect( pa->context );
+        pa_context_unref( pa->context );
+    }
+    if ( pa->proplist )
+        pa_proplist_free( pa->proplist );
+    alloc_free( ALLOC_PACTL, pa->server );
+    alloc_free( ALLOC_PACTL, pa );
+}
+
+int pactl_ready( const pactl_t *pa )
+{
+    return pa && pa->context_ready;
+}
+
+/* While parked (no player to mute) a lost connection is not retried, so an
+ * idle daemon has no timers armed. Unparking reconnects right away. */
+void pactl_park( pactl_t *pa, int parked )
+{
+    pa->parked = parked;
+    if ( parked )
+    {
+        if ( pa->reconnect_event )
+            pa->api->time_restart( pa->reconnect_event, NULL );
+    }
+    else if ( !pa->context ||
+              !PA_CONTEXT_IS_GOOD( pa_context_get_state( pa->context ) ) )
+    {
+        pa->backoff = 0;
+        pactl_connect( pa );
+    }
+}
+
+void update_sink( pactl_t *pa )
+{
+    if ( pa->context_ready )
+    {
+        // start a fresh enumeration, the callback appends what it finds
+        pa->found_sinks = 0;
         pa_operation_unref(
-            pa_context_get_sink_input_info_list( context,
+            pa_context_get_sink_input_info_list( pa->context,
                                                  get_sink_input_info_callback,
-                                                 NULL ) );
+                                                 pa ) );
     }
     else
         fprintf( stderr, "context is not ready\n" );
 }
 
-void set_mute( int mute )
+void set_mute( pactl_t *pa, int mute )
 {
-    if ( context_ready )
+    SM_PROBE2( set_mute, mute, pa->found_sinks );
+    pa->mute_requested = pa_rtclock_now();
+
+    // remembered so streams found later are muted the same way
+    pa->desired_mute = mute;
+    pa->retry_update = 1;
+    if ( pa->context_ready )
     {
+        // no sink found yet, the enumeration applies the mute when it does
+        if ( !pa->found_sinks )
+            update_sink( pa );
+
         // loop through the found sinks and mute them
-        for ( int i = 0; i < found_sinks; ++i )
+        for ( int i = 0; i < pa->found_sinks; ++i )
         {
-
-            retry_update = 1;
-            pending_mute = mute;
             pa_operation_unref(
-                pa_context_set_sink_input_mute( context,
-                                                sink_input_idx[i],
+                pa_context_set_sink_input_mute( pa->context,
+                                                pa->sink_input_idx[i],
                                                 mute,
                                                 mute_callback,
-                                                NULL ) );
+                                                pa ) );
         }
     }
     else
+    {
+        // applied once the context is ready and the sink is found
         fprintf( stderr, "context is not ready\n" );
+    }
 }
 
-void init_pactl( void )
+/* Adapters from the backend interface to the functions above. */
+
+void *pulse_open( ev_loop_t *loop, const char *server )
 {
-    int s;
-    pthread_t thread;
+    return init_pactl( ev_loop_get_pa_api( loop ), server );
+}
 
-    found_sinks = 0;
-    for ( int i = 0; i < NUM_SINKS; ++i )
-    {
-        sink_input_idx[i] = -1;
-    }
-    s = pthread_create( &thread, NULL, pactl, NULL );
-    if ( s != 0 )
-    {
-        perror( "pthread create error" );
-        exit( EXIT_FAILURE );
-    }
+void pulse_close( void *impl )
+{
+    free_pactl( impl );
 }
 
-void wait_for_context( void )
+void pulse_park( void *impl, int parked )
 {
-    int msec = 100;
-    while ( !context_ready )
-    {
-        struct timespec ts;
-        int res;
+    pactl_park( impl, parked );
+}
 
-        ts.tv_sec = msec / 1000;
-        ts.tv_nsec = ( msec % 1000 ) * 1000000;
+void pulse_set_mute( void *impl, int mute )
+{
+    set_mute( impl, mute );
+}
 
-        do
-        {
-            res = nanosleep( &ts, &ts );
-        } while ( res && errno == EINTR );
-    }
-    update_sink();
+void pulse_set_monitor( void *impl,
+                        unsigned rate,
+                        audio_monitor_cb cb,
+                        void *userdata )
+{
+    pactl_set_monitor( impl, rate, cb, userdata );
 }
+
+void pulse_set_mute_callback( void *impl, audio_mute_cb cb, void *userdata )
+{
+    pactl_set_mute_callback( impl, cb, userdata );
+}
+
+const audio_backend_t pulse_backend = {
+    .name = "pulse",
+    .user_socket = "pulse/native",
+    .open = pulse_open,
+    .close = pulse_close,
+    .park = pulse_park,
+    .set_mute = pulse_set_mute,
+    .set_monitor = pulse_set_monitor,
+    .set_mute_callback = pulse_set_mute_callback,
+};
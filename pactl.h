@@ -8,8 +8,31 @@ You should have received a copy of the CC0 Public Domain Dedication along with
 this software. If not, see
 <http://creativecommons.org/publicdomain/zero/1.0/>.*/
 
-void init_pactl( void );
-void wait_for_context( void );
-void set_mute( int mute );
-void update_sink( void );
-void drain( void );
+#ifndef PACTL_H
+#define PACTL_H
+
+#include <pulse/mainloop-api.h>
+#include <stddef.h>
+
+#include "audio_backend.h"
+
+/* One pactl_t per PulseAudio server. The context runs on the caller's
+ * mainloop, so any number of servers can share a single thread. */
+typedef struct pactl pactl_t;
+
+pactl_t *init_pactl( pa_mainloop_api *api, const char *server );
+void free_pactl( pactl_t *pa );
+int pactl_ready( const pactl_t *pa );
+void pactl_park( pactl_t *pa, int parked );
+void set_mute( pactl_t *pa, int mute );
+void update_sink( pactl_t *pa );
+void pactl_set_monitor( pactl_t *pa,
+                        unsigned rate,
+                        audio_monitor_cb cb,
+                        void *userdata );
+void pactl_set_mute_callback( pactl_t *pa, audio_mute_cb cb, void *userdata );
+
+/* The libpulse backend, "pulse". */
+extern const audio_backend_t pulse_backend;
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef SDE_PROBES_H
+#define SDE_PROBES_H
+
+/* Static user space probes (USDT) for profiling the live daemon.
+ *
+ * Built with `make usdt` the probes become `spotify_mute:*` tracepoints that
+ * perf, bpftrace and systemtap can attach to, e.g.
+ *
+ *   bpftrace -e 'usdt:./spotify_mute:mute_done { @[arg0] = hist(arg1); }'
+ *
+ * A probe site is a single nop until something attaches to it. In normal
+ * builds the macros expand to nothing and their arguments are not evaluated.
+ *
+ *   sv_array_sized(entries, nodes, str_bytes)  a{sv} sizing pass done
+ *   sv_entry(key, type)                        a{sv} entry decoded
+ *   variant(type, sizing)                      variant decoded
+ *   ad_decision(session, trackid, known, heard)
+ *   set_mute(mute, sinks)                      mute requested
+ *   mute_done(success, latency_usec)           PulseAudio acknowledged it
+ *   sink_input(index, media_name, muted)       sink input enumerated
+ */
+
+#ifdef SPOTIFY_MUTE_USDT
+
+#include <sys/sdt.h>
+
+#define SM_PROBE2( name, a, b ) DTRACE_PROBE2( spotify_mute, name, a, b )
+#define SM_PROBE3( name, a, b, c ) DTRACE_PROBE3( spotify_mute, name, a, b, c )
+#define SM_PROBE4( name, a, b, c, d ) \
+    DTRACE_PROBE4( spotify_mute, name, a, b, c, d )
+
+#else
+
+#define SM_PROBE2( name, a, b )
+#define SM_PROBE3( name, a, b, c )
+#define SM_PROBE4( name, a, b, c, d )
+
+#endif // SPOTIFY_MUTE_USDT
+
+#endif // SDE_PROBES_H
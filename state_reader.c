@@ -0,0 +1,107 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "statepage.h"
+
+/* Print the state page published by a running spotify_mute.
+ *
+ * Also serves as the reference reader: map the page read-only once, then
+ * every poll is `statepage_read()`, which never enters the kernel.
+ */
+
+int main( int argc, char **argv )
+{
+    int ret = EXIT_FAILURE;
+    char default_path[64];
+    const char *path = default_path;
+    void *map = MAP_FAILED;
+    struct stat st;
+
+    if ( argc > 2 )
+    {
+        fprintf( stderr, "Usage: %s [STATE_PAGE]\n", argv[0] );
+        goto cleanup;
+    }
+    if ( argc == 2 )
+    {
+        path = argv[1];
+    }
+    else
+    {
+        snprintf( default_path,
+                  sizeof( default_path ),
+                  STATEPAGE_DEFAULT_PATH,
+                  (unsigned)getuid() );
+    }
+
+    int fd = open( path, O_RDONLY | O_CLOEXEC );
+    if ( fd < 0 || fstat( fd, &st ) < 0 )
+    {
+        fprintf( stderr, "Could not open %s: %s\n", path, strerror( errno ) );
+        if ( fd >= 0 )
+        {
+            close( fd );
+        }
+        goto cleanup;
+    }
+    if ( (size_t)st.st_size < sizeof( statepage_t ) )
+    {
+        close( fd );
+        fprintf( stderr, "Error: %s is not a state page\n", path );
+        goto cleanup;
+    }
+
+    map = mmap( NULL, sizeof( statepage_t ), PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    if ( map == MAP_FAILED )
+    {
+        fprintf( stderr, "Could not map %s: %s\n", path, strerror( errno ) );
+        goto cleanup;
+    }
+
+    const statepage_t *page = map;
+    if ( memcmp( page->header.magic,
+                 STATEPAGE_MAGIC,
+                 sizeof( page->header.magic ) ) != 0 ||
+         page->header.version != STATEPAGE_VERSION )
+    {
+        fprintf( stderr, "Error: %s is not a state page\n", path );
+        goto cleanup;
+    }
+
+    unsigned sessions = page->header.sessions;
+    if ( page->header.flags & STATEPAGE_TRUNCATED )
+    {
+        printf( "only the first %u sessions have a slot\n", sessions );
+    }
+    for ( unsigned i = 0; i < sessions && i < STATEPAGE_MAX_SESSIONS; ++i )
+    {
+        statepage_state_t state;
+        statepage_read( page, i, &state );
+        printf( "session %u player=%u ad=%u muted=%u track=%016llx "
+                "changed=%llu\n",
+                i,
+                state.player,
+                state.ad,
+                state.muted,
+                (unsigned long long)state.trackid_hash,
+                (unsigned long long)state.changed );
+    }
+    ret = EXIT_SUCCESS;
+
+cleanup:
+    if ( map != MAP_FAILED )
+    {
+        munmap( map, sizeof( statepage_t ) );
+    }
+
+    return ret;
+}
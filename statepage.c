@@ -0,0 +1,197 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "statepage.h"
+
+/*
+ * Create (or take over) the state page at `path` with `sessions` slots.
+ *
+ * Returns: 0 (`EXIT_SUCCESS`) on success, a negative errno on failure.
+ */
+int statepage_open( statepage_t **ret, const char *path, unsigned sessions )
+{
+    int r = 0;
+    statepage_t *page = NULL;
+
+    *ret = NULL;
+
+    // the mapping keeps the file, the fd is not needed after this
+    int fd = open( path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644 );
+    struct stat st;
+    if ( fd < 0 || fstat( fd, &st ) < 0 )
+    {
+        r = -errno;
+        goto cleanup;
+    }
+
+    // the default path is in a world writable directory, never take over a
+    // file somebody else put there
+    if ( !S_ISREG( st.st_mode ) || st.st_uid != getuid() )
+    {
+        r = -EPERM;
+        goto cleanup;
+    }
+
+    if ( ftruncate( fd, sizeof( *page ) ) < 0 )
+    {
+        r = -errno;
+        goto cleanup;
+    }
+
+    void *map = mmap( NULL,
+                      sizeof( *page ),
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED,
+                      fd,
+                      0 );
+    if ( map == MAP_FAILED )
+    {
+        r = -errno;
+        goto cleanup;
+    }
+    page = map;
+
+    // readers that kept the page of a previous run see every slot reset
+    for ( unsigned i = 0; i < STATEPAGE_MAX_SESSIONS; ++i )
+    {
+        statepage_state_t none = { 0 };
+        statepage_publish( page, i, &none );
+    }
+    page->header.version = STATEPAGE_VERSION;
+    page->header.flags = 0;
+    page->header.sessions = sessions;
+    if ( sessions > STATEPAGE_MAX_SESSIONS )
+    {
+        fprintf( stderr,
+                 "State page %s only shows the first %u of %u sessions\n",
+                 path,
+                 STATEPAGE_MAX_SESSIONS,
+                 sessions );
+        page->header.flags |= STATEPAGE_TRUNCATED;
+        page->header.sessions = STATEPAGE_MAX_SESSIONS;
+    }
+    page->header.pid = (uint32_t)getpid();
+    page->header.dev = (uint64_t)st.st_dev;
+    page->header.ino = (uint64_t)st.st_ino;
+    memcpy( page->header.magic,
+            STATEPAGE_MAGIC,
+            sizeof( page->header.magic ) );
+
+cleanup:
+    if ( fd >= 0 )
+    {
+        close( fd );
+    }
+    if ( r < 0 )
+    {
+        fprintf( stderr,
+                 "Could not open state page %s: %s\n",
+                 path,
+                 strerror( -r ) );
+    }
+
+    *ret = page;
+    return r;
+}
+
+/*
+ * Reset and remove the state page, unless another daemon took it over or the
+ * file at `path` was replaced since it was opened.
+ */
+void statepage_close( statepage_t *page, const char *path )
+{
+    struct stat st;
+
+    if ( !page )
+    {
+        return;
+    }
+
+    // a daemon that took over the file rewrote the pid, leave it its page
+    bool ours = page->header.pid == (uint32_t)getpid();
+    if ( ours )
+    {
+        // nothing is running any more as far as readers are concerned
+        for ( unsigned i = 0; i < page->header.sessions; ++i )
+        {
+            statepage_state_t none = { 0 };
+            statepage_publish( page, i, &none );
+        }
+    }
+
+    ours = ours && lstat( path, &st ) == 0 &&
+           (uint64_t)st.st_dev == page->header.dev &&
+           (uint64_t)st.st_ino == page->header.ino;
+    munmap( page, sizeof( *page ) );
+    if ( ours )
+    {
+        unlink( path );
+    }
+}
+
+/*
+ * Replace the state of slot `index`. Only the daemon writes the page, so
+ * the sequence counter needs no read-modify-write.
+ */
+void statepage_publish( statepage_t *page,
+                        unsigned index,
+                        const statepage_state_t *state )
+{
+    if ( !page || index >= STATEPAGE_MAX_SESSIONS )
+    {
+        return;
+    }
+
+    statepage_slot_t *slot = &page->slots[index];
+    uint32_t seq = slot->seq;
+
+    __atomic_store_n( &slot->seq, seq + 1, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+
+    __atomic_store_n( &slot->state.trackid_hash,
+                      state->trackid_hash,
+                      __ATOMIC_RELAXED );
+    __atomic_store_n( &slot->state.changed, state->changed, __ATOMIC_RELAXED );
+    __atomic_store_n( &slot->state.player, state->player, __ATOMIC_RELAXED );
+    __atomic_store_n( &slot->state.ad, state->ad, __ATOMIC_RELAXED );
+    __atomic_store_n( &slot->state.muted, state->muted, __ATOMIC_RELAXED );
+
+    __atomic_store_n( &slot->seq, seq + 2, __ATOMIC_RELEASE );
+}
+
+/*
+ * Copy a consistent snapshot of slot `index`, retrying while the daemon is
+ * in the middle of an update. Plain loads only, no syscalls.
+ */
+void statepage_read( const statepage_t *page,
+                     unsigned index,
+                     statepage_state_t *state )
+{
+    const statepage_slot_t *slot = &page->slots[index];
+    uint32_t seq;
+
+    do
+    {
+        seq = __atomic_load_n( &slot->seq, __ATOMIC_ACQUIRE );
+
+        state->trackid_hash =
+            __atomic_load_n( &slot->state.trackid_hash, __ATOMIC_RELAXED );
+        state->changed =
+            __atomic_load_n( &slot->state.changed, __ATOMIC_RELAXED );
+        state->player =
+            __atomic_load_n( &slot->state.player, __ATOMIC_RELAXED );
+        state->ad = __atomic_load_n( &slot->state.ad, __ATOMIC_RELAXED );
+        state->muted = __atomic_load_n( &slot->state.muted, __ATOMIC_RELAXED );
+
+        __atomic_thread_fence( __ATOMIC_ACQUIRE );
+    } while ( ( seq & 1 ) ||
+              seq != __atomic_load_n( &slot->seq, __ATOMIC_RELAXED ) );
+}
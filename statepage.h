@@ -0,0 +1,73 @@
+#ifndef SDE_STATEPAGE_H
+#define SDE_STATEPAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Shared memory page with the current state of every session.
+ *
+ * The daemon keeps a single page under /dev/shm mapped and rewrites a
+ * session's slot whenever its state changes. Readers map the page read-only
+ * and poll it without any syscalls or locks.
+ *
+ * Each slot is guarded by a sequence counter which is odd while the daemon
+ * writes the slot. A reader loads the counter, copies the state and loads
+ * the counter again; the copy is consistent if both loads saw the same even
+ * value, otherwise it retries. `statepage_read()` does exactly that.
+ */
+
+#define STATEPAGE_MAGIC "SMSTATE1"
+#define STATEPAGE_VERSION 1
+#define STATEPAGE_MAX_SESSIONS 63 // header and slots fill one page
+#define STATEPAGE_DEFAULT_PATH "/dev/shm/spotify_mute-%u" // the user's uid
+
+// header flag: the daemon runs more sessions than there are slots
+#define STATEPAGE_TRUNCATED 1
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t sessions; // number of slots in use
+    uint32_t flags;
+    uint32_t pid; // of the daemon writing the page
+    uint64_t dev; // the file the daemon created, it only removes that one
+    uint64_t ino;
+    char reserved[24];
+} statepage_header_t;
+
+typedef struct
+{
+    uint64_t trackid_hash; // stats_hash() of the trackid, 0 for none
+    uint64_t changed;      // CLOCK_REALTIME in usec of the last change
+    uint8_t player;        // spotify is running
+    uint8_t ad;            // the current track is an ad
+    uint8_t muted;
+} statepage_state_t;
+
+typedef struct
+{
+    uint32_t seq; // odd while the slot is written
+    uint32_t reserved;
+    statepage_state_t state;
+    char padding[64 - 8 - sizeof( statepage_state_t )];
+} statepage_slot_t;
+
+typedef struct
+{
+    statepage_header_t header;
+    statepage_slot_t slots[STATEPAGE_MAX_SESSIONS];
+} statepage_t;
+
+int statepage_open( statepage_t **ret, const char *path, unsigned sessions );
+void statepage_close( statepage_t *page, const char *path );
+void statepage_publish( statepage_t *page,
+                        unsigned index,
+                        const statepage_state_t *state );
+
+void statepage_read( const statepage_t *page,
+                     unsigned index,
+                     statepage_state_t *state );
+
+#endif // SDE_STATEPAGE_H
@@ -0,0 +1,222 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+// function prototypes
+int stats_map( stats_t *stats, uint64_t capacity );
+
+/*
+ * FNV-1a hash of a string, used to identify trackids in the records.
+ */
+uint64_t stats_hash( const char *str )
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    while ( *str )
+    {
+        hash ^= (unsigned char)*str++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * Wall clock time in microseconds. clock_gettime() is served from the vDSO,
+ * so this does not enter the kernel.
+ */
+uint64_t stats_time( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_REALTIME, &ts );
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/*
+ * (Re)map the file with room for `capacity` records, growing it if needed.
+ * The old mapping stays in place if the new one cannot be made.
+ */
+int stats_map( stats_t *stats, uint64_t capacity )
+{
+    size_t size = STATS_HEADER_SIZE + capacity * sizeof( stats_record_t );
+    struct stat st;
+
+    if ( fstat( stats->fd, &st ) < 0 )
+    {
+        return -errno;
+    }
+    if ( (size_t)st.st_size < size && ftruncate( stats->fd, (off_t)size ) < 0 )
+    {
+        return -errno;
+    }
+
+    void *map =
+        mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, stats->fd, 0 );
+    if ( map == MAP_FAILED )
+    {
+        return -errno;
+    }
+
+    if ( stats->header )
+    {
+        munmap( stats->header, stats->map_size );
+    }
+
+    stats->header = map;
+    stats->records =
+        (stats_record_t *)(void *)( (char *)map + STATS_HEADER_SIZE );
+    stats->map_size = size;
+    stats->capacity = capacity;
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Open (or create) the statistics file at `path` and map it for appending.
+ *
+ * Returns: 0 (`EXIT_SUCCESS`) on success, a negative errno on failure.
+ */
+int stats_open( stats_t *stats, const char *path )
+{
+    int ret = 0;
+    struct stat st;
+
+    memset( stats, 0, sizeof( *stats ) );
+    stats->fd = open( path, O_RDWR | O_CREAT | O_CLOEXEC, 0644 );
+    if ( stats->fd < 0 )
+    {
+        ret = -errno;
+        fprintf( stderr, "Could not open %s: %s\n", path, strerror( -ret ) );
+        goto no_cleanup;
+    }
+
+    // a second daemon appending would race on `count`, only one writer
+    if ( flock( stats->fd, LOCK_EX | LOCK_NB ) < 0 )
+    {
+        ret = -errno;
+        if ( ret == -EWOULDBLOCK )
+        {
+            fprintf( stderr, "Error: %s is in use by another daemon\n", path );
+            ret = -EBUSY;
+        }
+        goto cleanup;
+    }
+
+    if ( fstat( stats->fd, &st ) < 0 )
+    {
+        ret = -errno;
+        goto cleanup;
+    }
+
+    // existing file, keep its records and validate the layout
+    uint64_t capacity = STATS_CHUNK_RECORDS;
+    bool fresh = st.st_size < STATS_HEADER_SIZE;
+    if ( !fresh )
+    {
+        capacity = ( (uint64_t)st.st_size - STATS_HEADER_SIZE ) /
+                   sizeof( stats_record_t );
+    }
+
+    ret = stats_map( stats, capacity );
+    if ( ret < 0 )
+    {
+        fprintf( stderr, "Could not map %s: %s\n", path, strerror( -ret ) );
+        goto cleanup;
+    }
+
+    if ( fresh )
+    {
+        memcpy( stats->header->magic,
+                STATS_MAGIC,
+                sizeof( stats->header->magic ) );
+        stats->header->version = STATS_VERSION;
+        stats->header->record_size = sizeof( stats_record_t );
+        stats->header->count = 0;
+    }
+    else if ( memcmp( stats->header->magic,
+                      STATS_MAGIC,
+                      sizeof( stats->header->magic ) ) != 0 ||
+              stats->header->record_size != sizeof( stats_record_t ) ||
+              stats->header->count > stats->capacity )
+    {
+        fprintf( stderr, "Error: %s is not a statistics file\n", path );
+        ret = -EINVAL;
+        goto cleanup;
+    }
+
+    stats->last_sync = stats_time();
+    return EXIT_SUCCESS;
+
+cleanup:
+    stats_close( stats );
+
+no_cleanup:
+    return ret;
+}
+
+void stats_close( stats_t *stats )
+{
+    if ( stats->header )
+    {
+        msync( stats->header, stats->map_size, MS_SYNC );
+        munmap( stats->header, stats->map_size );
+    }
+    if ( stats->fd >= 0 )
+    {
+        close( stats->fd );
+    }
+    memset( stats, 0, sizeof( *stats ) );
+    stats->fd = -1;
+}
+
+/*
+ * Append a record. Outside of growing the file (once per
+ * `STATS_CHUNK_RECORDS`) and the periodic sync this is only stores into the
+ * mapping.
+ *
+ * Returns: 0 (`EXIT_SUCCESS`) on success, a negative errno on failure.
+ */
+int stats_append( stats_t *stats, const stats_record_t *record )
+{
+    if ( !stats->header )
+    {
+        return -EBADF;
+    }
+
+    uint64_t count = stats->header->count;
+    if ( count >= stats->capacity )
+    {
+        int ret = stats_map( stats, stats->capacity + STATS_CHUNK_RECORDS );
+        if ( ret < 0 )
+        {
+            fprintf( stderr,
+                     "Could not grow statistics: %s\n",
+                     strerror( -ret ) );
+            return ret;
+        }
+    }
+
+    stats->records[count] = *record;
+
+    // publish the record only once it is complete
+    __atomic_store_n( &stats->header->count, count + 1, __ATOMIC_RELEASE );
+
+    // the mapping is shared, so the data survives a crash of the daemon,
+    // syncing only guards against losing the page cache
+    if ( record->time - stats->last_sync > STATS_SYNC_INTERVAL )
+    {
+        msync( stats->header, stats->map_size, MS_ASYNC );
+        stats->last_sync = record->time;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,85 @@
+#ifndef SDE_STATS_H
+#define SDE_STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Persistent ad statistics.
+ *
+ * The statistics file is a fixed header followed by fixed size records and
+ * is only ever appended to. The daemon keeps it memory mapped, so logging an
+ * event is a few stores into the mapping: the file is grown in large chunks
+ * and synced at most once per `STATS_SYNC_INTERVAL`, never per event.
+ *
+ * A STATS_TRACK record carries the final decision for the track, so it is
+ * appended when the next track starts or the player goes away, with the time
+ * the track started. Records are therefore not strictly in time order.
+ *
+ * Readers map the file read-only and only trust the first `count` records,
+ * which the writer publishes after each record is complete. The writer holds
+ * an flock() on the file, a second daemon refuses to open it.
+ */
+
+#define STATS_MAGIC "SMSTATS1"
+#define STATS_VERSION 1
+#define STATS_HEADER_SIZE 4096
+#define STATS_CHUNK_RECORDS 65536
+#define STATS_SYNC_INTERVAL ( 30 * 1000000ULL ) // usec
+#define STATS_TRACKID_LEN 36
+
+typedef enum
+{
+    STATS_TRACK = 1,  // trackid changed
+    STATS_MUTE = 2,   // spotify muted for an ad
+    STATS_UNMUTE = 3, // spotify unmuted, gap_ms is the time spent muted
+} stats_type_t;
+
+/* The signals behind an ad decision, is_ad holds the ones that were set.
+ * Files written before these existed only use STATS_AD_KNOWN.
+ */
+typedef enum
+{
+    STATS_AD_KNOWN = 1 << 0,  // ad trackid or known ad set
+    STATS_AD_LEVEL = 1 << 1,  // audio level detector
+    STATS_AD_JINGLE = 1 << 2, // known ad jingle
+} stats_ad_t;
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count; // number of complete records
+} stats_header_t;
+
+typedef struct
+{
+    uint64_t time;         // CLOCK_REALTIME in usec
+    uint64_t trackid_hash; // FNV-1a of the full trackid
+    uint32_t length_ms;    // track length (mpris:length), 0 if unknown
+    uint32_t gap_ms;       // time spent muted, STATS_UNMUTE only
+    uint8_t type;          // stats_type_t
+    uint8_t is_ad;         // stats_ad_t, 0 if it was no ad
+    uint16_t session;
+    char trackid[STATS_TRACKID_LEN]; // truncated, nul padded
+} stats_record_t;
+
+typedef struct
+{
+    int fd;
+    stats_header_t *header;
+    stats_record_t *records;
+    size_t map_size;
+    uint64_t capacity;
+    uint64_t last_sync;
+} stats_t;
+
+int stats_open( stats_t *stats, const char *path );
+void stats_close( stats_t *stats );
+int stats_append( stats_t *stats, const stats_record_t *record );
+
+uint64_t stats_hash( const char *str );
+uint64_t stats_time( void );
+
+#endif // SDE_STATS_H
@@ -0,0 +1,233 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+/* Offline reader for the statistics file written by spotify_mute -S.
+ *
+ * Maps the file read-only and aggregates it, so reporting never talks to the
+ * running daemon. Only the records published in the header are read, which
+ * makes it safe to run while the daemon is appending.
+ */
+
+int compare_u64( const void *a, const void *b )
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return ( x > y ) - ( x < y );
+}
+
+int main( int argc, char **argv )
+{
+    int ret = EXIT_FAILURE;
+    int fd = -1;
+    void *map = MAP_FAILED;
+    struct stat st;
+    uint64_t *hashes = NULL;
+
+    if ( argc != 2 )
+    {
+        fprintf( stderr, "Usage: %s STATS_FILE\n", argv[0] );
+        goto cleanup;
+    }
+
+    fd = open( argv[1], O_RDONLY | O_CLOEXEC );
+    if ( fd < 0 || fstat( fd, &st ) < 0 )
+    {
+        fprintf( stderr,
+                 "Could not open %s: %s\n",
+                 argv[1],
+                 strerror( errno ) );
+        goto cleanup;
+    }
+    if ( st.st_size < STATS_HEADER_SIZE )
+    {
+        fprintf( stderr, "Error: %s is not a statistics file\n", argv[1] );
+        goto cleanup;
+    }
+
+    map = mmap( NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    if ( map == MAP_FAILED )
+    {
+        fprintf( stderr, "Could not map %s: %s\n", argv[1], strerror( errno ) );
+        goto cleanup;
+    }
+
+    const stats_header_t *header = map;
+    const stats_record_t *records =
+        (const stats_record_t *)(const void *)( (const char *)map +
+                                                STATS_HEADER_SIZE );
+    if ( memcmp( header->magic, STATS_MAGIC, sizeof( header->magic ) ) != 0 ||
+         header->record_size != sizeof( stats_record_t ) )
+    {
+        fprintf( stderr, "Error: %s is not a statistics file\n", argv[1] );
+        goto cleanup;
+    }
+
+    // never read past what is mapped, the writer may have grown the file
+    uint64_t count = __atomic_load_n( &header->count, __ATOMIC_ACQUIRE );
+    uint64_t mapped =
+        ( (uint64_t)st.st_size - STATS_HEADER_SIZE ) / sizeof( stats_record_t );
+    if ( count > mapped )
+    {
+        count = mapped;
+    }
+
+    uint64_t tracks = 0;
+    uint64_t ads = 0;
+    uint64_t ad_ms = 0;
+    uint64_t ad_known = 0;
+    uint64_t ads_by_signal[3] = { 0 }; // known, level, jingle
+    uint32_t ad_max_ms = 0;
+    uint64_t mutes = 0;
+    uint64_t gaps = 0;
+    uint64_t gap_ms = 0;
+    uint32_t gap_max_ms = 0;
+    uint64_t ads_by_hour[24] = { 0 };
+    uint64_t first = 0;
+    uint64_t last = 0;
+
+    hashes = malloc( sizeof( *hashes ) * ( count ? count : 1 ) );
+    if ( !hashes )
+    {
+        goto cleanup;
+    }
+
+    for ( uint64_t i = 0; i < count; ++i )
+    {
+        const stats_record_t *r = &records[i];
+        if ( !first || r->time < first )
+        {
+            first = r->time;
+        }
+        if ( r->time > last )
+        {
+            last = r->time;
+        }
+
+        switch ( r->type )
+        {
+            case STATS_TRACK:
+            {
+                hashes[tracks++] = r->trackid_hash;
+                if ( !r->is_ad )
+                {
+                    break;
+                }
+
+                ads++;
+                ads_by_signal[0] += !!( r->is_ad & STATS_AD_KNOWN );
+                ads_by_signal[1] += !!( r->is_ad & STATS_AD_LEVEL );
+                ads_by_signal[2] += !!( r->is_ad & STATS_AD_JINGLE );
+                time_t t = (time_t)( r->time / 1000000 );
+                struct tm tm;
+                if ( localtime_r( &t, &tm ) )
+                {
+                    ads_by_hour[tm.tm_hour]++;
+                }
+                if ( r->length_ms )
+                {
+                    ad_known++;
+                    ad_ms += r->length_ms;
+                    if ( r->length_ms > ad_max_ms )
+                    {
+                        ad_max_ms = r->length_ms;
+                    }
+                }
+                break;
+            }
+
+            case STATS_MUTE:
+                mutes++;
+                break;
+
+            case STATS_UNMUTE:
+                gaps++;
+                gap_ms += r->gap_ms;
+                if ( r->gap_ms > gap_max_ms )
+                {
+                    gap_max_ms = r->gap_ms;
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    // count distinct trackids
+    qsort( hashes, tracks, sizeof( *hashes ), compare_u64 );
+    uint64_t unique = 0;
+    for ( uint64_t i = 0; i < tracks; ++i )
+    {
+        if ( i == 0 || hashes[i] != hashes[i - 1] )
+        {
+            unique++;
+        }
+    }
+
+    double hours = last > first ? (double)( last - first ) / 3.6e9 : 0.0;
+
+    printf( "%20s: %llu\n", "records", (unsigned long long)count );
+    printf( "%20s: %.1lf\n", "hours covered", hours );
+    printf( "%20s: %llu\n", "tracks", (unsigned long long)tracks );
+    printf( "%20s: %llu\n", "distinct trackids", (unsigned long long)unique );
+    printf( "%20s: %llu\n", "ads", (unsigned long long)ads );
+    printf( "%20s: %llu\n",
+            "known trackid",
+            (unsigned long long)ads_by_signal[0] );
+    printf( "%20s: %llu\n",
+            "audio level",
+            (unsigned long long)ads_by_signal[1] );
+    printf( "%20s: %llu\n", "jingle", (unsigned long long)ads_by_signal[2] );
+    if ( hours > 0.0 )
+    {
+        printf( "%20s: %.2lf\n", "ads per hour", (double)ads / hours );
+    }
+    if ( ad_known )
+    {
+        printf( "%20s: %.1lf s (max %.1lf s)\n",
+                "ad duration",
+                (double)ad_ms / (double)ad_known / 1000.0,
+                ad_max_ms / 1000.0 );
+    }
+    printf( "%20s: %llu\n", "mutes", (unsigned long long)mutes );
+    if ( gaps )
+    {
+        printf( "%20s: %.1lf s (max %.1lf s)\n",
+                "mute gap",
+                (double)gap_ms / (double)gaps / 1000.0,
+                gap_max_ms / 1000.0 );
+    }
+
+    puts( "" );
+    printf( "%20s \n", "Ads by hour:" );
+    for ( int h = 0; h < 24; ++h )
+    {
+        printf( "%17s%02d: %llu\n", "", h, (unsigned long long)ads_by_hour[h] );
+    }
+
+    ret = EXIT_SUCCESS;
+
+cleanup:
+    free( hashes );
+    if ( map != MAP_FAILED )
+    {
+        munmap( map, (size_t)st.st_size );
+    }
+    if ( fd >= 0 )
+    {
+        close( fd );
+    }
+
+    return ret;
+}